@@ -0,0 +1,720 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <iterator>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * Implementation of mdu-bench,
+ * generates reproducible synthetic trees and times mdu on them.
+ * Usage: mdu-bench [--root DIR | --tree DIR] [--fanout N] [--depth N] [--files N]
+ *                  [--size-dist fixed:B|uniform:MIN:MAX|lognormal:MU:SIGMA] [--hardlinks P]
+ *                  [--symlinks P] [--seed N] [--jobs 1,2,4] [--backends getdents,io_uring]
+ *                  [--orders dfs,bfs,hybrid] [--repeat N] [--cold] [--count-syscalls]
+ *                  [--format csv|json] [--mdu PATH] [--baseline PATH] [--mdu-args ARGS] [--keep]
+ *
+ * Author: Marcus Lundqvist.
+ */
+
+#ifndef MDU_BENCH_DEFAULT_MDU
+#define MDU_BENCH_DEFAULT_MDU "mdu"
+#endif
+
+// Shape of the generated tree and what to run on it
+typedef struct BenchOptions
+{
+    std::string root{"/dev/shm/mdu-bench"};
+    // Benchmark an existing tree instead of generating one
+    std::string tree;
+    int fanout{4};
+    int depth{4};
+    int files{32};
+    std::string size_dist{"lognormal:8:2"};
+    double hardlinks{0.0};
+    double symlinks{0.0};
+    std::uint64_t seed{1};
+    std::vector<int> jobs{1, 2, 4};
+    std::vector<std::string> backends{"getdents"};
+    // Values of mdu --order
+    std::vector<std::string> orders{"dfs"};
+    int repeat{3};
+    bool cold{false};
+    bool count_syscalls{false};
+    std::string format{"csv"};
+    std::string mdu{MDU_BENCH_DEFAULT_MDU};
+    // Another build taking turns with mdu on every run, to compare the two
+    std::string baseline;
+    // Passed to every run before the tree, split on spaces
+    std::vector<std::string> mdu_args;
+    bool keep{false};
+} BenchOptions;
+
+// What ended up on disk
+typedef struct TreeInfo
+{
+    std::uint64_t dirs{0};
+    std::uint64_t files{0};
+    std::uint64_t hardlinks{0};
+    std::uint64_t symlinks{0};
+    std::uint64_t bytes{0};
+
+    std::uint64_t entries() const
+    {
+        return dirs + files + hardlinks + symlinks;
+    }
+} TreeInfo;
+
+// One timed mdu run
+typedef struct RunResult
+{
+    std::string backend;
+    std::string order;
+    int jobs{0};
+    int run{0};
+    bool cold{false};
+    double wall{0};
+    int status{0};
+    // -1 when not counted
+    long long syscalls{-1};
+    // Run with BenchOptions::baseline rather than mdu
+    bool baseline{false};
+} RunResult;
+
+/**
+ * parse_int_list() - Splits a comma separated list of numbers.
+ * @list: The list, e.g. "1,2,4".
+ *
+ * Returns: The numbers.
+ *
+ */
+std::vector<int> parse_int_list(const std::string &list);
+
+/**
+ * parse_string_list() - Splits a comma separated list.
+ * @list: The list, e.g. "getdents,io_uring".
+ *
+ * Returns: The items.
+ *
+ */
+std::vector<std::string> parse_string_list(const std::string &list);
+
+/**
+ * parse_options() - Parses the command line.
+ * @argc: Argument count.
+ * @argv: Argument values.
+ *
+ * Returns: The parsed options, exits on bad input.
+ *
+ */
+BenchOptions parse_options(int argc, char *argv[]);
+
+/**
+ * generate_tree() - Creates the synthetic tree under options.root.
+ * The same options and seed always produce the same tree.
+ *
+ * @options: Shape of the tree.
+ *
+ * Returns: Counts of what was created.
+ *
+ */
+TreeInfo generate_tree(const BenchOptions &options);
+
+/**
+ * count_tree() - Counts the entries of an existing tree.
+ * @path: Tree to count.
+ *
+ * Returns: Counts of what was found.
+ *
+ */
+TreeInfo count_tree(const std::string &path);
+
+/**
+ * drop_caches() - Asks the kernel to drop the page, dentry and inode caches.
+ *
+ * Returns: true if permitted.
+ *
+ */
+bool drop_caches();
+
+/**
+ * run_mdu() - Runs mdu once with its output discarded.
+ * @mdu: The mdu binary.
+ * @args: Arguments for mdu.
+ * @count_syscalls: Trace the run with ptrace and count syscalls in every thread.
+ * @result: Filled with wall time, exit status and syscall count.
+ *
+ * Returns: Nothing.
+ *
+ */
+void run_mdu(const std::string &mdu, const std::vector<std::string> &args, bool count_syscalls,
+             RunResult &result);
+
+/**
+ * print_results() - Prints all runs as CSV or JSON.
+ * @options: Benchmark options.
+ * @tree: Counts for the tree that was scanned.
+ * @results: The runs.
+ *
+ * Returns: Nothing.
+ *
+ */
+void print_results(const BenchOptions &options, const TreeInfo &tree, const std::vector<RunResult> &results);
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options = parse_options(argc, argv);
+
+    const bool generated = options.tree.empty();
+    TreeInfo tree;
+    std::string target = options.tree;
+    if (generated)
+    {
+        std::cerr << "Generating tree in " << options.root << '\n';
+        tree = generate_tree(options);
+        target = options.root;
+    }
+    else
+    {
+        tree = count_tree(options.tree);
+    }
+    std::cerr << "Tree: " << tree.dirs << " dirs, " << tree.files << " files, " << tree.hardlinks
+              << " hard links, " << tree.symlinks << " symlinks\n";
+
+    bool cold = options.cold;
+    if (cold && !drop_caches())
+    {
+        std::cerr << "Cannot drop caches (not root?), running warm\n";
+        cold = false;
+    }
+
+    std::vector<std::string> builds{options.mdu};
+    if (!options.baseline.empty())
+    {
+        builds.push_back(options.baseline);
+    }
+
+    std::vector<RunResult> results;
+    for (const std::string &backend : options.backends)
+    {
+        for (const std::string &order : options.orders)
+        {
+            for (int jobs : options.jobs)
+            {
+                std::vector<std::string> args{"-j", std::to_string(jobs), "--order=" + order};
+                if (backend == "io_uring")
+                {
+                    args.emplace_back("--io-uring");
+                }
+                args.insert(args.end(), options.mdu_args.begin(), options.mdu_args.end());
+                args.push_back(target);
+
+                // The builds take turns so drift in the machine's state hits both alike
+                for (int run = 0; run < options.repeat; ++run)
+                {
+                    for (std::size_t build = 0; build < builds.size(); ++build)
+                    {
+                        if (cold)
+                        {
+                            drop_caches();
+                        }
+                        RunResult result{backend, order, jobs, run, cold};
+                        result.baseline = build > 0;
+                        run_mdu(builds[build], args, false, result);
+                        results.push_back(result);
+                    }
+                }
+
+                if (options.count_syscalls)
+                {
+                    // Tracing slows every syscall down, so this run is counted but its time is not meaningful
+                    for (std::size_t build = 0; build < builds.size(); ++build)
+                    {
+                        RunResult result{backend, order, jobs, -1, false};
+                        result.baseline = build > 0;
+                        run_mdu(builds[build], args, true, result);
+                        results.push_back(result);
+                    }
+                }
+            }
+        }
+    }
+
+    print_results(options, tree, results);
+
+    if (generated && !options.keep)
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(options.root, ec);
+    }
+
+    return 0;
+}
+
+std::vector<int> parse_int_list(const std::string &list)
+{
+    std::vector<int> values;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        values.push_back(std::stoi(item));
+    }
+    return values;
+}
+
+std::vector<std::string> parse_string_list(const std::string &list)
+{
+    std::vector<std::string> values;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        values.push_back(item);
+    }
+    return values;
+}
+
+BenchOptions parse_options(int argc, char *argv[])
+{
+    BenchOptions options;
+
+    for (int i = 1; i < argc; i++)
+    {
+        try
+        {
+            std::string arg(argv[i]);
+            if (arg == "--cold")
+            {
+                options.cold = true;
+            }
+            else if (arg == "--count-syscalls")
+            {
+                options.count_syscalls = true;
+            }
+            else if (arg == "--keep")
+            {
+                options.keep = true;
+            }
+            else if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for " + arg);
+            }
+            else if (arg == "--root")
+            {
+                options.root = argv[++i];
+            }
+            else if (arg == "--tree")
+            {
+                options.tree = argv[++i];
+            }
+            else if (arg == "--fanout")
+            {
+                options.fanout = std::stoi(argv[++i]);
+            }
+            else if (arg == "--depth")
+            {
+                options.depth = std::stoi(argv[++i]);
+            }
+            else if (arg == "--files")
+            {
+                options.files = std::stoi(argv[++i]);
+            }
+            else if (arg == "--size-dist")
+            {
+                options.size_dist = argv[++i];
+            }
+            else if (arg == "--hardlinks")
+            {
+                options.hardlinks = std::stod(argv[++i]);
+            }
+            else if (arg == "--symlinks")
+            {
+                options.symlinks = std::stod(argv[++i]);
+            }
+            else if (arg == "--seed")
+            {
+                options.seed = std::stoull(argv[++i]);
+            }
+            else if (arg == "--jobs")
+            {
+                options.jobs = parse_int_list(argv[++i]);
+            }
+            else if (arg == "--backends")
+            {
+                options.backends = parse_string_list(argv[++i]);
+            }
+            else if (arg == "--orders")
+            {
+                options.orders = parse_string_list(argv[++i]);
+            }
+            else if (arg == "--repeat")
+            {
+                options.repeat = std::stoi(argv[++i]);
+            }
+            else if (arg == "--format")
+            {
+                options.format = argv[++i];
+                if (options.format != "csv" && options.format != "json")
+                {
+                    throw std::invalid_argument("format must be csv or json");
+                }
+            }
+            else if (arg == "--mdu")
+            {
+                options.mdu = argv[++i];
+            }
+            else if (arg == "--baseline")
+            {
+                options.baseline = argv[++i];
+            }
+            else if (arg == "--mdu-args")
+            {
+                std::istringstream words(argv[++i]);
+                options.mdu_args.assign(std::istream_iterator<std::string>(words), std::istream_iterator<std::string>());
+            }
+            else
+            {
+                throw std::invalid_argument("unknown option " + arg);
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: " << e.what() << " ,Usage: mdu-bench [--root DIR | --tree DIR] [--fanout N] "
+                      << "[--depth N] [--files N] [--size-dist fixed:B|uniform:MIN:MAX|lognormal:MU:SIGMA] "
+                      << "[--hardlinks P] [--symlinks P] [--seed N] [--jobs 1,2,4] "
+                      << "[--backends getdents,io_uring] [--orders dfs,bfs,hybrid] [--repeat N] [--cold] "
+                      << "[--count-syscalls] [--format csv|json] [--mdu PATH] [--baseline PATH] [--mdu-args ARGS] "
+                      << "[--keep]\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return options;
+}
+
+TreeInfo generate_tree(const BenchOptions &options)
+{
+    namespace fs = std::filesystem;
+
+    std::mt19937_64 rng(options.seed);
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+    // Parse the size distribution once, then draw from it for every file
+    std::string kind = options.size_dist.substr(0, options.size_dist.find(':'));
+    std::vector<double> params;
+    {
+        std::stringstream stream(options.size_dist.substr(std::min(options.size_dist.size(), kind.size() + 1)));
+        std::string item;
+        while (std::getline(stream, item, ':'))
+        {
+            params.push_back(std::stod(item));
+        }
+    }
+    auto draw_size = [&]() -> std::uint64_t {
+        if (kind == "uniform" && params.size() == 2)
+        {
+            return std::uniform_int_distribution<std::uint64_t>(params[0], params[1])(rng);
+        }
+        if (kind == "lognormal" && params.size() == 2)
+        {
+            double size = std::lognormal_distribution<double>(params[0], params[1])(rng);
+            return static_cast<std::uint64_t>(std::min(size, 1e9));
+        }
+        if (kind == "fixed" && params.size() == 1)
+        {
+            return static_cast<std::uint64_t>(params[0]);
+        }
+        std::cerr << "Bad --size-dist '" << options.size_dist << "'\n";
+        exit(EXIT_FAILURE);
+    };
+
+    std::error_code ec;
+    if (fs::exists(options.root, ec))
+    {
+        if (!fs::exists(fs::path(options.root) / ".mdu-bench"))
+        {
+            std::cerr << options.root << " exists and was not created by mdu-bench, refusing to overwrite\n";
+            exit(EXIT_FAILURE);
+        }
+        fs::remove_all(options.root);
+    }
+    fs::create_directories(options.root);
+    std::ofstream(fs::path(options.root) / ".mdu-bench") << options.seed << '\n';
+
+    // The root and the marker file
+    TreeInfo info;
+    info.dirs = 1;
+    info.files = 1;
+    std::vector<char> zeros(1 << 16, 0);
+    std::vector<std::string> made_files;
+
+    // Breadth first so the same seed gives the same tree regardless of recursion
+    std::vector<std::pair<std::string, int> > level{{options.root, 0}};
+    while (!level.empty())
+    {
+        std::vector<std::pair<std::string, int> > next;
+        for (const auto &[dir, depth] : level)
+        {
+            for (int f = 0; f < options.files; ++f)
+            {
+                std::string file = dir + "/f" + std::to_string(f);
+                if (!made_files.empty() && chance(rng) < options.hardlinks)
+                {
+                    const std::string &target = made_files[rng() % made_files.size()];
+                    if (link(target.c_str(), file.c_str()) == 0)
+                    {
+                        ++info.hardlinks;
+                        continue;
+                    }
+                }
+                if (!made_files.empty() && chance(rng) < options.symlinks)
+                {
+                    const std::string &target = made_files[rng() % made_files.size()];
+                    if (symlink(target.c_str(), file.c_str()) == 0)
+                    {
+                        ++info.symlinks;
+                        continue;
+                    }
+                }
+
+                std::uint64_t size = draw_size();
+                int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (fd < 0)
+                {
+                    std::cerr << "Cannot create '" << file << "': " << std::strerror(errno) << '\n';
+                    exit(EXIT_FAILURE);
+                }
+                for (std::uint64_t left = size; left > 0;)
+                {
+                    ssize_t written = write(fd, zeros.data(), std::min<std::uint64_t>(left, zeros.size()));
+                    if (written <= 0)
+                    {
+                        std::cerr << "Cannot write '" << file << "': " << std::strerror(errno) << '\n';
+                        exit(EXIT_FAILURE);
+                    }
+                    left -= static_cast<std::uint64_t>(written);
+                }
+                close(fd);
+                made_files.push_back(file);
+                ++info.files;
+                info.bytes += size;
+            }
+
+            if (depth < options.depth)
+            {
+                for (int d = 0; d < options.fanout; ++d)
+                {
+                    std::string sub = dir + "/d" + std::to_string(d);
+                    if (mkdir(sub.c_str(), 0755) != 0)
+                    {
+                        std::cerr << "Cannot create '" << sub << "': " << std::strerror(errno) << '\n';
+                        exit(EXIT_FAILURE);
+                    }
+                    ++info.dirs;
+                    next.emplace_back(sub, depth + 1);
+                }
+            }
+        }
+        level = std::move(next);
+    }
+
+    return info;
+}
+
+// nftw() has no user pointer
+static TreeInfo *count_target = nullptr;
+
+TreeInfo count_tree(const std::string &path)
+{
+    TreeInfo info;
+    count_target = &info;
+    nftw(path.c_str(), [](const char *, const struct stat *st, int type, FTW *) {
+        if (type == FTW_D || type == FTW_DNR)
+        {
+            ++count_target->dirs;
+        }
+        else if (type == FTW_SL || type == FTW_SLN)
+        {
+            ++count_target->symlinks;
+        }
+        else
+        {
+            ++count_target->files;
+            count_target->bytes += st->st_size;
+        }
+        return 0;
+    }, 64, FTW_PHYS);
+    count_target = nullptr;
+    return info;
+}
+
+bool drop_caches()
+{
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = write(fd, "3\n", 2) == 2;
+    close(fd);
+    return ok;
+}
+
+void run_mdu(const std::string &mdu, const std::vector<std::string> &args, bool count_syscalls,
+             RunResult &result)
+{
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(mdu.c_str()));
+    for (const std::string &arg : args)
+    {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        std::cerr << "fork: " << std::strerror(errno) << '\n';
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (count_syscalls)
+        {
+            ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+            raise(SIGSTOP);
+        }
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    if (!count_syscalls)
+    {
+        waitpid(pid, &status, 0);
+    }
+    else
+    {
+        // Stopped by the raise() above, trace every thread mdu creates from here on
+        waitpid(pid, &status, 0);
+        ptrace(PTRACE_SETOPTIONS, pid, nullptr,
+               PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+        ptrace(PTRACE_SYSCALL, pid, nullptr, nullptr);
+
+        long long syscalls = 0;
+        while (true)
+        {
+            int thread_status = 0;
+            pid_t tid = waitpid(-1, &thread_status, __WALL);
+            if (tid < 0)
+            {
+                break;
+            }
+            if (WIFEXITED(thread_status) || WIFSIGNALED(thread_status))
+            {
+                if (tid == pid)
+                {
+                    status = thread_status;
+                    break;
+                }
+                continue;
+            }
+
+            int signal = 0;
+            if (WSTOPSIG(thread_status) == (SIGTRAP | 0x80))
+            {
+                __ptrace_syscall_info info{};
+                if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0 &&
+                    info.op == PTRACE_SYSCALL_INFO_ENTRY)
+                {
+                    ++syscalls;
+                }
+            }
+            else if (thread_status >> 16 == 0 && WSTOPSIG(thread_status) != SIGSTOP &&
+                     WSTOPSIG(thread_status) != SIGTRAP)
+            {
+                // A real signal for mdu, pass it on
+                signal = WSTOPSIG(thread_status);
+            }
+            ptrace(PTRACE_SYSCALL, tid, nullptr, signal);
+        }
+        result.syscalls = syscalls;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    result.wall = std::chrono::duration<double>(end - start).count();
+    result.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+void print_results(const BenchOptions &options, const TreeInfo &tree, const std::vector<RunResult> &results)
+{
+    const double entries = static_cast<double>(tree.entries());
+
+    if (options.format == "csv")
+    {
+        std::cout << "build,backend,order,jobs,run,cache,wall_s,entries,entries_per_s,syscalls,syscalls_per_entry,status\n";
+        for (const RunResult &r : results)
+        {
+            std::cout << (r.baseline ? "baseline" : "mdu") << ',' << r.backend << ',' << r.order << ',' << r.jobs << ',';
+            if (r.run < 0)
+            {
+                std::cout << "traced,";
+            }
+            else
+            {
+                std::cout << r.run << ',';
+            }
+            std::cout << (r.cold ? "cold" : "warm") << ',' << r.wall << ',' << tree.entries() << ','
+                      << (r.run < 0 ? 0.0 : entries / r.wall) << ',';
+            if (r.syscalls >= 0)
+            {
+                std::cout << r.syscalls << ',' << r.syscalls / entries;
+            }
+            else
+            {
+                std::cout << ',';
+            }
+            std::cout << ',' << r.status << '\n';
+        }
+        return;
+    }
+
+    std::cout << "{\"tree\":{\"dirs\":" << tree.dirs << ",\"files\":" << tree.files << ",\"hardlinks\":"
+              << tree.hardlinks << ",\"symlinks\":" << tree.symlinks << ",\"bytes\":" << tree.bytes
+              << "},\"runs\":[";
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        const RunResult &r = results[i];
+        std::cout << (i ? "," : "") << "{\"build\":\"" << (r.baseline ? "baseline" : "mdu") << "\",\"backend\":\""
+                  << r.backend << "\",\"order\":\"" << r.order << "\",\"jobs\":" << r.jobs
+                  << ",\"traced\":" << (r.run < 0 ? "true" : "false") << ",\"run\":" << r.run
+                  << ",\"cache\":\"" << (r.cold ? "cold" : "warm") << "\",\"wall_s\":" << r.wall
+                  << ",\"entries\":" << tree.entries() << ",\"entries_per_s\":"
+                  << (r.run < 0 ? 0.0 : entries / r.wall);
+        if (r.syscalls >= 0)
+        {
+            std::cout << ",\"syscalls\":" << r.syscalls << ",\"syscalls_per_entry\":" << r.syscalls / entries;
+        }
+        std::cout << ",\"status\":" << r.status << '}';
+    }
+    std::cout << "]}\n";
+}
@@ -0,0 +1,990 @@
+#include "cluster.h"
+#include "retry.h"
+#include "roots.h"
+
+#ifdef MDU_CLUSTER
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <tuple>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/*
+ * Implementation of the cluster mode of libmdu. The coordinator keeps a
+ * small tree of the directories it listed itself, every subtree it
+ * hands out is a leaf of that tree until its totals come back.
+ *
+ * Every message is a line of space separated fields, a path follows its
+ * line as raw bytes of the length the line gave so it may hold any byte:
+ *
+ *   coordinator: MDU <version> <apparent_size> <count_links> <max_depth>
+ *   coordinator: SCAN <parts>, then for every part
+ *                <part> <depth> <length>, then the path
+ *   worker:      for every part in order
+ *                DONE <part> <files> <dirs> <bytes> <blocks> <errors> <linked>
+ *                     <directories> <errors kept> <errors dropped>
+ *   worker:      D <depth> <size> <length>, then the path, once per directory
+ *   worker:      E <operation> <code> <length>, then the path, once per error
+ *   coordinator: QUIT
+ *
+ * Author: Marcus Lundqvist.
+ */
+
+// Sent in the greeting, a worker of another version refuses to work
+constexpr int protocol_version = 1;
+
+// The coordinator lists a subtree itself rather than handing it out only this far down
+constexpr int max_list_depth = 6;
+
+// Parts handed out in one SCAN at most, small subtrees are not worth a round trip each
+constexpr std::size_t max_batch = 256;
+
+// Where the coordinator listens when no address is given, workers elsewhere have to be let in
+constexpr const char *loopback_address = "127.0.0.1";
+
+// A worker tries to reach the coordinator this many times, 100 ms apart
+constexpr int connect_attempts = 50;
+
+constexpr std::size_t no_part = std::numeric_limits<std::size_t>::max();
+
+/*
+ * One TCP connection of the protocol, buffered so lines and the paths
+ * after them can be read without a syscall each.
+ */
+class Connection
+{
+private:
+    int m_fd{-1};
+    std::string m_in;
+    std::size_t m_pos{0};
+
+    // Reads whatever arrived next, false once the peer is gone
+    bool fill()
+    {
+        m_in.erase(0, m_pos);
+        m_pos = 0;
+        char buffer[64 * 1024];
+        ssize_t n = 0;
+        do
+        {
+            n = recv(m_fd, buffer, sizeof(buffer), 0);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0)
+        {
+            return false;
+        }
+        m_in.append(buffer, static_cast<std::size_t>(n));
+        return true;
+    }
+
+public:
+    explicit Connection(int fd) : m_fd(fd)
+    {
+    }
+
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    ~Connection()
+    {
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+    }
+
+    // The next line without its newline
+    bool read_line(std::string &line)
+    {
+        std::size_t end = 0;
+        while ((end = m_in.find('\n', m_pos)) == std::string::npos)
+        {
+            if (!fill())
+            {
+                return false;
+            }
+        }
+        line.assign(m_in, m_pos, end - m_pos);
+        m_pos = end + 1;
+        return true;
+    }
+
+    bool read_bytes(std::size_t count, std::string &out)
+    {
+        while (m_in.size() - m_pos < count)
+        {
+            if (!fill())
+            {
+                return false;
+            }
+        }
+        out.assign(m_in, m_pos, count);
+        m_pos += count;
+        return true;
+    }
+
+    bool send(std::string_view data)
+    {
+        while (!data.empty())
+        {
+            ssize_t n = ::send(m_fd, data.data(), data.size(), MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            data.remove_prefix(static_cast<std::size_t>(n));
+        }
+        return true;
+    }
+};
+
+// A directory of the coordinator's tree
+typedef struct Part
+{
+    // Index of the parent part, no_part for a root
+    std::size_t parent{no_part};
+    std::uint32_t root{0};
+    int depth{0};
+    std::string path;
+    // Its own entries if the coordinator listed it, then everything below as the children complete
+    Counters totals;
+    // Children not yet complete, plus one until it has been listed or scanned
+    std::size_t pending{1};
+} Part;
+
+// What listing or scanning one part found
+typedef struct PartResult
+{
+    Counters totals;
+    // The directories below it down to Options::max_depth, with depths from the root
+    std::vector<TopEntry> directories;
+    std::vector<int> depths;
+    std::vector<ScanError> errors;
+    std::uint64_t errors_dropped{0};
+} PartResult;
+
+// State of a coordinated scan
+typedef struct Cluster
+{
+    Options options;
+    const ScanCallbacks *callbacks{nullptr};
+    // Everything below is protected by mutex
+    std::mutex mutex;
+    // A part was queued, a root completed or the scan is done
+    std::condition_variable changed;
+    // A deque, so a part never moves while a participant works on it
+    std::deque<Part> parts;
+    std::deque<std::size_t> waiting;
+    // Threads taking parts, the local one and one per connected worker
+    int participants{0};
+    std::size_t roots_left{0};
+    // Roots completed but not yet handed to on_root
+    std::deque<std::uint32_t> completed;
+    ScanResult result;
+    // Hard linked files the coordinator counted itself, by root
+    std::set<std::tuple<std::uint32_t, dev_t, ino_t> > links;
+    bool done{false};
+    // Written to when a root completes, so the accepting thread hands it on right away
+    int wake{-1};
+} Cluster;
+
+/**
+ * list_part() - Reads one directory of the tree on the coordinator.
+ * Counts the directory and its files like a worker would, and gives
+ * back its subdirectories to be queued as parts of their own.
+ *
+ * @cluster: The scan.
+ * @part: Directory to list, its path and depth are not changed by anyone.
+ * @subdirs: Filled with the names of its subdirectories.
+ * @found: Filled with its own totals and errors.
+ *
+ * Returns: Nothing.
+ *
+ */
+void list_part(Cluster &cluster, const Part &part, std::vector<std::string> &subdirs, PartResult &found);
+
+/**
+ * complete_part() - Marks one pending piece of a part as done.
+ * Adds completed parts to their parents and reports them to
+ * on_directory, a completed root is queued for on_root. The caller
+ * holds cluster.mutex.
+ *
+ * @cluster: The scan.
+ * @index: Part that was listed, scanned, or whose child completed.
+ *
+ * Returns: Nothing.
+ *
+ */
+void complete_part(Cluster &cluster, std::size_t index);
+
+/**
+ * participate() - Takes parts off the queue until the scan is done.
+ * Lists a part on the coordinator when it is a root or when there are
+ * fewer parts waiting than participants, and otherwise hands it to
+ * scan whole, along with more of the waiting parts when there are many.
+ *
+ * @cluster: The scan.
+ * @scan: Measures whole parts, false if it could not, the parts are then
+ *        queued again and the participant leaves.
+ *
+ * Returns: Nothing.
+ *
+ */
+void participate(Cluster &cluster,
+                 const std::function<bool(const std::vector<Part *> &, std::vector<PartResult> &)> &scan);
+
+/**
+ * serve_worker() - Runs the coordinator's side of one worker connection.
+ *
+ * @cluster: The scan.
+ * @fd: The accepted socket, owned from here on.
+ *
+ * Returns: Nothing.
+ *
+ */
+void serve_worker(Cluster &cluster, int fd);
+
+/**
+ * exchange() - Has the worker at the other end scan parts.
+ *
+ * @connection: Connection to the worker.
+ * @batch: Parts to scan.
+ * @found: Filled with what the worker found, one per part.
+ *
+ * Returns: false if the worker went away or made no sense.
+ *
+ */
+bool exchange(Connection &connection, const std::vector<Part *> &batch, std::vector<PartResult> &found);
+
+/**
+ * scan_parts() - Scans handed out parts with a Scanner, as one scan.
+ * Runs on the workers, and on the coordinator for its own share.
+ *
+ * @scanner: Scanner whose options came from the coordinator.
+ * @paths: Directories to scan.
+ * @depths: Their depths below their roots, for the depths of their directories.
+ * @found: Filled with what the scan found, one per path.
+ *
+ * Returns: Nothing.
+ *
+ */
+void scan_parts(Scanner &scanner, const std::vector<std::string> &paths, const std::vector<int> &depths,
+                std::vector<PartResult> &found);
+
+/**
+ * part_size() - The size of a part as Options::apparent_size asks for it.
+ *
+ * @options: Options of the scan.
+ * @totals: Totals of the part.
+ *
+ * Returns: bytes or blocks.
+ *
+ */
+std::uint64_t part_size(const Options &options, const Counters &totals);
+
+/**
+ * listen_on() - Opens the coordinator's listening socket.
+ *
+ * @address: Local address to listen on, empty for loopback_address.
+ * @port: Port to listen on.
+ *
+ * Returns: The socket, throws std::system_error if there is none.
+ *
+ */
+int listen_on(const std::string &address, std::uint16_t port);
+
+ScanResult coordinate_scan(const Options &options, const std::string &address, std::uint16_t port,
+                           const std::vector<std::string> &paths, const ScanCallbacks &callbacks)
+{
+    namespace fs = std::filesystem;
+    int listener = listen_on(address, port);
+    int wake[2];
+    if (pipe(wake) != 0)
+    {
+        int code = errno;
+        close(listener);
+        throw std::system_error(code, std::generic_category(), "Cannot create a pipe");
+    }
+
+    // Never blocks while holding the mutex, a full pipe already wakes the loop
+    for (int end : wake)
+    {
+        fcntl(end, F_SETFL, O_NONBLOCK);
+        fcntl(end, F_SETFD, FD_CLOEXEC);
+    }
+
+    Cluster cluster;
+    cluster.options = options;
+    cluster.wake = wake[1];
+    cluster.callbacks = &callbacks;
+    ScanResult &result = cluster.result;
+    result.roots.resize(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        // Sized by size_root() like Scanner::scan() does it, only directories become parts
+        RootResult &root = result.roots[i];
+        root.index = static_cast<std::uint32_t>(i);
+        root.path = paths[i];
+        int code = size_root(root, options.apparent_size);
+        if (code != 0)
+        {
+            result.errors.push_back(ScanError{ScanError::Operation::stat, root.index, paths[i], code});
+        }
+        else if (root.directory)
+        {
+            Part &part = cluster.parts.emplace_back();
+            part.root = root.index;
+            part.path = paths[i];
+            cluster.waiting.push_back(cluster.parts.size() - 1);
+            ++cluster.roots_left;
+        }
+    }
+    for (const RootResult &root : result.roots)
+    {
+        if (!root.directory && callbacks.on_root)
+        {
+            callbacks.on_root(root);
+        }
+    }
+    cluster.done = cluster.roots_left == 0;
+
+    // The coordinator scans too, so it gets done with no workers at all
+    std::vector<std::thread> threads;
+    threads.emplace_back([&cluster]() {
+        Options local = cluster.options;
+        local.top = 0;
+        local.by_owner = local.by_ext = local.histogram = false;
+        local.cache_file.clear();
+        local.export_file.clear();
+        Scanner scanner(local);
+        participate(cluster, [&scanner](const std::vector<Part *> &batch, std::vector<PartResult> &found) {
+            std::vector<std::string> paths;
+            std::vector<int> depths;
+            for (const Part *part : batch)
+            {
+                paths.push_back(part->path);
+                depths.push_back(part->depth);
+            }
+            scan_parts(scanner, paths, depths, found);
+            return true;
+        });
+    });
+
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(cluster.mutex);
+        while (!cluster.completed.empty())
+        {
+            RootResult root = result.roots[cluster.completed.front()];
+            cluster.completed.pop_front();
+            lock.unlock();
+            if (callbacks.on_root)
+            {
+                callbacks.on_root(root);
+            }
+            lock.lock();
+        }
+        if (cluster.done)
+        {
+            break;
+        }
+        lock.unlock();
+
+        pollfd ready[2]{{listener, POLLIN, 0}, {wake[0], POLLIN, 0}};
+        if (poll(ready, 2, -1) <= 0)
+        {
+            continue;
+        }
+        if (ready[1].revents != 0)
+        {
+            char buffer[64];
+            [[maybe_unused]] ssize_t drained = read(wake[0], buffer, sizeof(buffer));
+        }
+        if (ready[0].revents != 0)
+        {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0)
+            {
+                threads.emplace_back([&cluster, fd]() { serve_worker(cluster, fd); });
+            }
+        }
+    }
+    close(listener);
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    close(wake[0]);
+    close(wake[1]);
+
+    std::sort(result.errors.begin(), result.errors.end(), [](const ScanError &a, const ScanError &b) {
+        return a.root != b.root ? a.root < b.root : a.path < b.path;
+    });
+    result.error = result.errors.empty() && result.errors_dropped == 0 ? 0 : 1;
+    for (const RootResult &root : result.roots)
+    {
+        result.error |= root.totals.errors > 0 ? 1 : 0;
+    }
+    return std::move(result);
+}
+
+void run_cluster_worker(const Options &options, const std::string &host, std::uint16_t port)
+{
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses = nullptr;
+    std::string coordinator = "the coordinator at " + host + ":" + std::to_string(port);
+    int found = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses);
+    if (found != 0)
+    {
+        throw std::runtime_error("Cannot look up " + host + ": " + gai_strerror(found));
+    }
+    // Workers are often started along with the coordinator, give it a moment to listen
+    int fd = -1;
+    int code = 0;
+    for (int attempt = 0; attempt < connect_attempts && fd < 0; ++attempt)
+    {
+        if (attempt > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        for (addrinfo *address = addresses; address != nullptr && fd < 0; address = address->ai_next)
+        {
+            fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+            code = errno;
+            if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0)
+            {
+                code = errno;
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0)
+    {
+        throw std::system_error(code, std::generic_category(), "Cannot connect to " + coordinator);
+    }
+    int keepalive = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+    Connection connection(fd);
+
+    std::string line;
+    std::string word;
+    int version = 0;
+    Options own = options;
+    if (!connection.read_line(line))
+    {
+        throw std::runtime_error(coordinator + " closed the connection without a greeting");
+    }
+    std::istringstream hello(line);
+    if (!(hello >> word >> version >> own.apparent_size >> own.count_links >> own.max_depth) || word != "MDU")
+    {
+        throw std::runtime_error(coordinator + " is not an mdu coordinator");
+    }
+    if (version != protocol_version)
+    {
+        throw std::runtime_error(coordinator + " speaks protocol version " + std::to_string(version) +
+                                 ", this worker " + std::to_string(protocol_version));
+    }
+    own.top = 0;
+    own.by_owner = own.by_ext = own.histogram = false;
+    own.cache_file.clear();
+    own.export_file.clear();
+    Scanner scanner(own);
+
+    std::vector<std::uint64_t> ids;
+    std::vector<int> depths;
+    std::vector<std::string> paths;
+    while (connection.read_line(line))
+    {
+        std::istringstream message(line);
+        std::size_t count = 0;
+        if (!(message >> word) || word == "QUIT")
+        {
+            return;
+        }
+        if (word != "SCAN" || !(message >> count) || count == 0)
+        {
+            throw std::runtime_error("Unexpected message from " + coordinator + ": " + line);
+        }
+        ids.resize(count);
+        depths.resize(count);
+        paths.resize(count);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            std::size_t length = 0;
+            if (!connection.read_line(line))
+            {
+                throw std::runtime_error(coordinator + " went away in the middle of a SCAN");
+            }
+            std::istringstream part(line);
+            if (!(part >> ids[i] >> depths[i] >> length))
+            {
+                throw std::runtime_error("Unexpected part from " + coordinator + ": " + line);
+            }
+            if (!connection.read_bytes(length, paths[i]))
+            {
+                throw std::runtime_error(coordinator + " went away in the middle of a SCAN");
+            }
+        }
+
+        std::vector<PartResult> found(count);
+        scan_parts(scanner, paths, depths, found);
+        std::string reply;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            const Counters &totals = found[i].totals;
+            reply.append("DONE ").append(std::to_string(ids[i]));
+            for (std::uint64_t value : {totals.files, totals.dirs, totals.bytes, totals.blocks, totals.errors,
+                                        totals.linked, static_cast<std::uint64_t>(found[i].directories.size()),
+                                        static_cast<std::uint64_t>(found[i].errors.size()), found[i].errors_dropped})
+            {
+                reply.append(" ").append(std::to_string(value));
+            }
+            reply += '\n';
+            for (std::size_t d = 0; d < found[i].directories.size(); ++d)
+            {
+                const TopEntry &dir = found[i].directories[d];
+                reply.append("D ").append(std::to_string(found[i].depths[d])).append(" ");
+                reply.append(std::to_string(dir.size)).append(" ").append(std::to_string(dir.path.size()));
+                reply.append("\n").append(dir.path);
+            }
+            for (const ScanError &error : found[i].errors)
+            {
+                reply.append("E ").append(std::to_string(static_cast<int>(error.operation))).append(" ");
+                reply.append(std::to_string(error.code)).append(" ").append(std::to_string(error.path.size()));
+                reply.append("\n").append(error.path);
+            }
+        }
+        if (!connection.send(reply))
+        {
+            throw std::system_error(errno, std::generic_category(), "Cannot send results to " + coordinator);
+        }
+    }
+    throw std::runtime_error(coordinator + " went away before the scan was done");
+}
+
+void serve_worker(Cluster &cluster, int fd)
+{
+    int keepalive = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+    Connection connection(fd);
+    const Options &options = cluster.options;
+    std::string hello = "MDU " + std::to_string(protocol_version) + " " + std::to_string(options.apparent_size) + " " +
+                        std::to_string(options.count_links) + " " + std::to_string(options.max_depth) + "\n";
+    if (!connection.send(hello))
+    {
+        return;
+    }
+
+    bool lost = false;
+    participate(cluster, [&connection, &lost](const std::vector<Part *> &batch, std::vector<PartResult> &found) {
+        lost = !exchange(connection, batch, found);
+        return !lost;
+    });
+
+    std::lock_guard<std::mutex> lock(cluster.mutex);
+    if (!lost && cluster.done)
+    {
+        connection.send("QUIT\n");
+    }
+}
+
+bool exchange(Connection &connection, const std::vector<Part *> &batch, std::vector<PartResult> &found)
+{
+    // Parts are numbered within the batch, a worker answers them in order
+    std::string request = "SCAN " + std::to_string(batch.size()) + "\n";
+    for (std::size_t i = 0; i < batch.size(); ++i)
+    {
+        request.append(std::to_string(i)).append(" ").append(std::to_string(batch[i]->depth)).append(" ");
+        request.append(std::to_string(batch[i]->path.size())).append("\n").append(batch[i]->path);
+    }
+    if (!connection.send(request))
+    {
+        return false;
+    }
+
+    std::string line;
+    std::string word;
+    for (std::size_t i = 0; i < batch.size(); ++i)
+    {
+        std::uint64_t id = 0;
+        std::uint64_t directories = 0;
+        std::uint64_t errors = 0;
+        Counters &totals = found[i].totals;
+        if (!connection.read_line(line))
+        {
+            return false;
+        }
+        std::istringstream done(line);
+        if (!(done >> word >> id >> totals.files >> totals.dirs >> totals.bytes >> totals.blocks >> totals.errors >>
+              totals.linked >> directories >> errors >> found[i].errors_dropped) ||
+            word != "DONE" || id != i)
+        {
+            return false;
+        }
+        for (std::uint64_t e = 0; e < directories + errors; ++e)
+        {
+            std::size_t length = 0;
+            int first = 0;
+            std::uint64_t second = 0;
+            std::string path;
+            if (!connection.read_line(line))
+            {
+                return false;
+            }
+            std::istringstream entry(line);
+            if (!(entry >> word >> first >> second >> length) || !connection.read_bytes(length, path))
+            {
+                return false;
+            }
+            if (e < directories)
+            {
+                found[i].directories.push_back(TopEntry{second, batch[i]->root, std::move(path)});
+                found[i].depths.push_back(first);
+            }
+            else
+            {
+                found[i].errors.push_back(ScanError{static_cast<ScanError::Operation>(first), batch[i]->root,
+                                                    std::move(path), static_cast<int>(second)});
+            }
+        }
+    }
+    return true;
+}
+
+void participate(Cluster &cluster,
+                 const std::function<bool(const std::vector<Part *> &, std::vector<PartResult> &)> &scan)
+{
+    std::unique_lock<std::mutex> lock(cluster.mutex);
+    ++cluster.participants;
+    while (true)
+    {
+        cluster.changed.wait(lock, [&cluster]() { return cluster.done || !cluster.waiting.empty(); });
+        if (cluster.done)
+        {
+            break;
+        }
+        std::size_t index = cluster.waiting.front();
+        cluster.waiting.pop_front();
+        Part &first = cluster.parts[index];
+        // Too little left to keep everyone busy, split it a level further instead of handing it out whole
+        bool list = first.depth == 0 ||
+                    (cluster.waiting.size() < static_cast<std::size_t>(cluster.participants) &&
+                     first.depth < max_list_depth);
+        std::vector<std::size_t> indices{index};
+        std::vector<Part *> batch{&first};
+        std::size_t share = 1 + cluster.waiting.size() / (4 * static_cast<std::size_t>(cluster.participants));
+        while (!list && batch.size() < std::min(share, max_batch) && !cluster.waiting.empty() &&
+               cluster.parts[cluster.waiting.front()].depth > 0)
+        {
+            indices.push_back(cluster.waiting.front());
+            batch.push_back(&cluster.parts[cluster.waiting.front()]);
+            cluster.waiting.pop_front();
+        }
+        lock.unlock();
+
+        std::vector<PartResult> found(batch.size());
+        std::vector<std::string> subdirs;
+        if (list)
+        {
+            list_part(cluster, first, subdirs, found[0]);
+        }
+        else if (!scan(batch, found))
+        {
+            lock.lock();
+            cluster.waiting.insert(cluster.waiting.begin(), indices.begin(), indices.end());
+            cluster.changed.notify_all();
+            break;
+        }
+        else if (cluster.callbacks->on_directory)
+        {
+            for (std::size_t i = 0; i < batch.size(); ++i)
+            {
+                for (std::size_t d = 0; d < found[i].directories.size(); ++d)
+                {
+                    const TopEntry &dir = found[i].directories[d];
+                    DirectoryResult result{batch[i]->root, dir.path, found[i].depths[d], dir.size};
+                    cluster.callbacks->on_directory(result);
+                }
+            }
+        }
+
+        lock.lock();
+        for (std::size_t i = 0; i < batch.size(); ++i)
+        {
+            Part &part = *batch[i];
+            part.totals += found[i].totals;
+            for (ScanError &error : found[i].errors)
+            {
+                error.root = part.root;
+                cluster.result.errors.push_back(std::move(error));
+            }
+            cluster.result.errors_dropped += found[i].errors_dropped;
+        }
+        for (std::string &name : subdirs)
+        {
+            Part &child = cluster.parts.emplace_back();
+            child.parent = index;
+            child.root = first.root;
+            child.depth = first.depth + 1;
+            child.path = first.path;
+            if (child.path.back() != '/')
+            {
+                child.path += '/';
+            }
+            child.path += name;
+            ++first.pending;
+            cluster.waiting.push_back(cluster.parts.size() - 1);
+        }
+        for (std::size_t part : indices)
+        {
+            complete_part(cluster, part);
+        }
+        cluster.changed.notify_all();
+    }
+    --cluster.participants;
+}
+
+void complete_part(Cluster &cluster, std::size_t index)
+{
+    const ScanCallbacks &callbacks = *cluster.callbacks;
+    while (true)
+    {
+        Part &part = cluster.parts[index];
+        if (--part.pending > 0)
+        {
+            return;
+        }
+        std::uint64_t size = part_size(cluster.options, part.totals);
+        if (part.parent == no_part)
+        {
+            RootResult &root = cluster.result.roots[part.root];
+            root.totals = part.totals;
+            root.size = size;
+            cluster.completed.push_back(part.root);
+            cluster.done = --cluster.roots_left == 0;
+            [[maybe_unused]] ssize_t written = write(cluster.wake, "", 1);
+            return;
+        }
+        if (part.depth <= cluster.options.max_depth && callbacks.on_directory)
+        {
+            callbacks.on_directory(DirectoryResult{part.root, part.path, part.depth, size});
+        }
+        cluster.parts[part.parent].totals += part.totals;
+        index = part.parent;
+    }
+}
+
+void list_part(Cluster &cluster, const Part &part, std::vector<std::string> &subdirs, PartResult &found)
+{
+    Counters &counters = found.totals;
+    auto fail = [&](const std::string &path, ScanError::Operation operation) {
+        found.errors.push_back(ScanError{operation, part.root, path, errno});
+        ++counters.errors;
+    };
+
+    // Retried like Scanner retries its calls, the coordinator keeps no statistics of them
+    std::chrono::microseconds retry_left = retry_budget;
+    std::uint64_t retries = 0;
+    int fd = retry_transient(retry_left, retries, [&]() {
+        return open(part.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | (part.depth > 0 ? O_NOFOLLOW : 0));
+    });
+    DIR *dir = fd >= 0 ? fdopendir(fd) : nullptr;
+    if (dir == nullptr)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        // Deleted since its parent was listed is not an error
+        if (errno != ENOENT || part.depth == 0)
+        {
+            // It still takes space like du counts it, only search permission is needed to size it
+            int code = errno;
+            struct stat st{};
+            if (errno != ENOENT && lstat(part.path.c_str(), &st) == 0)
+            {
+                ++counters.dirs;
+                counters.bytes += st.st_size;
+                counters.blocks += st.st_blocks * 512;
+            }
+            errno = code;
+            fail(part.path, ScanError::Operation::read_directory);
+        }
+        return;
+    }
+    struct stat st{};
+    ++counters.dirs;
+    if (fstat(fd, &st) == 0)
+    {
+        counters.bytes += st.st_size;
+        counters.blocks += st.st_blocks * 512;
+    }
+
+    // errno is cleared before every readdir(), a failed fstatat() must not look like the end failing
+    dirent *entry = nullptr;
+    auto next = [&]() {
+        errno = 0;
+        entry = readdir(dir);
+        return entry == nullptr && errno != 0 ? -1 : 0;
+    };
+    while (retry_transient(retry_left, retries, next) == 0 && entry != nullptr)
+    {
+        const char *name = entry->d_name;
+        if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0)
+        {
+            continue;
+        }
+        if (entry->d_type == DT_DIR)
+        {
+            subdirs.emplace_back(name);
+            continue;
+        }
+        if (retry_transient(retry_left, retries, [&]() { return fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW); }) != 0)
+        {
+            if (errno != ENOENT)
+            {
+                fail(part.path + "/" + name, ScanError::Operation::stat);
+            }
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            subdirs.emplace_back(name);
+            continue;
+        }
+        if (st.st_nlink > 1)
+        {
+            ++counters.linked;
+            std::lock_guard<std::mutex> lock(cluster.mutex);
+            if (!cluster.options.count_links && !cluster.links.emplace(part.root, st.st_dev, st.st_ino).second)
+            {
+                continue;
+            }
+        }
+        ++counters.files;
+        counters.bytes += st.st_size;
+        counters.blocks += st.st_blocks * 512;
+    }
+    if (entry == nullptr && errno != 0)
+    {
+        fail(part.path, ScanError::Operation::read_directory);
+    }
+    closedir(dir);
+}
+
+void scan_parts(Scanner &scanner, const std::vector<std::string> &paths, const std::vector<int> &depths,
+                std::vector<PartResult> &found)
+{
+    std::mutex mutex;
+    int max_depth = scanner.options().max_depth;
+    ScanCallbacks callbacks;
+    if (max_depth > 0)
+    {
+        callbacks.on_directory = [&](const DirectoryResult &dir) {
+            int depth = depths[dir.root] + dir.depth;
+            if (depth <= max_depth)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                found[dir.root].directories.push_back(TopEntry{dir.size, 0, std::string(dir.path)});
+                found[dir.root].depths.push_back(depth);
+            }
+        };
+    }
+    ScanResult result = scanner.scan(paths, callbacks);
+    for (const RootResult &root : result.roots)
+    {
+        // Deleted since the coordinator listed its parent, that is not an error
+        if (root.error != ENOENT)
+        {
+            found[root.index].totals = root.totals;
+        }
+    }
+    for (ScanError &error : result.errors)
+    {
+        if (result.roots[error.root].error != ENOENT)
+        {
+            found[error.root].errors.push_back(std::move(error));
+        }
+    }
+    found[0].errors_dropped = result.errors_dropped;
+}
+
+std::uint64_t part_size(const Options &options, const Counters &totals)
+{
+    return options.apparent_size ? totals.bytes : totals.blocks;
+}
+
+int listen_on(const std::string &address, std::uint16_t port)
+{
+    // There is no authentication, so every interface is only listened on when asked for
+    std::string host = address.empty() ? loopback_address : address;
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *addresses = nullptr;
+    if (int error = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses); error != 0)
+    {
+        throw std::system_error(EINVAL, std::generic_category(), host + ": " + gai_strerror(error));
+    }
+
+    // The first address that works, IPv6 ones usually take IPv4 connections too
+    int fd = -1;
+    int code = 0;
+    for (addrinfo *address = addresses; address != nullptr && fd < 0; address = address->ai_next)
+    {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd < 0)
+        {
+            code = errno;
+            continue;
+        }
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (address->ai_family == AF_INET6)
+        {
+            int off = 0;
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        }
+        if (bind(fd, address->ai_addr, address->ai_addrlen) != 0 || listen(fd, 64) != 0)
+        {
+            code = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0)
+    {
+        throw std::system_error(code, std::generic_category(), "Cannot listen on " + host + " port " + std::to_string(port));
+    }
+    return fd;
+}
+#endif
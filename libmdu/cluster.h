@@ -0,0 +1,52 @@
+#ifndef MDU_CLUSTER_H
+#define MDU_CLUSTER_H
+
+#include "mdu.h"
+
+/*
+ * Scanning one shared filesystem from several hosts. A coordinator lists
+ * the top levels of every root itself and hands the subtrees below them
+ * to worker processes that connect over TCP, so a namespace one metadata
+ * client cannot walk fast enough is walked by many of them at once.
+ * There is no authentication, only run it on a trusted network.
+ *
+ * Author: Marcus Lundqvist.
+ */
+
+#if __has_include(<sys/socket.h>) && __has_include(<dirent.h>)
+#define MDU_CLUSTER 1
+#endif
+
+#ifdef MDU_CLUSTER
+// Coordinator port when none is given
+constexpr std::uint16_t default_cluster_port = 7070;
+
+/*
+ * Measures paths as the coordinator, with workers connecting to port
+ * on address while it runs. An empty address is 127.0.0.1, so only
+ * workers on this host can join unless another address, "::" or
+ * "0.0.0.0" for every interface, is given. Anyone who can reach the
+ * port can join and report totals. It also scans subtrees itself with options.threads
+ * threads, so it finishes without any workers too. A subtree whose
+ * worker goes away is handed to the next one.
+ * Callbacks are as for Scanner::scan(), except that on_file and
+ * on_progress are never called. Options::top, the breakdowns, the
+ * cache file and the export file are not supported, and hard links are
+ * only counted once within each subtree that was handed out.
+ * Throws std::system_error if nothing can listen on address and port.
+ */
+ScanResult coordinate_scan(const Options &options, const std::string &address, std::uint16_t port,
+                           const std::vector<std::string> &paths, const ScanCallbacks &callbacks = {});
+
+/*
+ * Scans subtrees for the coordinator at host:port until it says the scan
+ * is done. The apparent size, link counting and max depth are the
+ * coordinator's, everything else in options is this host's own.
+ * Returns once the scan is done. Throws std::runtime_error or
+ * std::system_error saying why if the coordinator could not be reached,
+ * sent something it does not understand, or went away before that.
+ */
+void run_cluster_worker(const Options &options, const std::string &host, std::uint16_t port);
+#endif
+
+#endif
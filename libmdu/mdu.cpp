@@ -0,0 +1,4193 @@
+#include "mdu.h"
+#include "snapshot.h"
+#include "retry.h"
+#include "roots.h"
+
+#include <deque>
+#include <atomic>
+#include <array>
+#include <unordered_set>
+#include <unordered_map>
+#include <condition_variable>
+#include <filesystem>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <bit>
+#include <fstream>
+#include <sstream>
+#include <limits>
+
+#include <cerrno>
+
+#ifdef MDU_GETDENTS
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#elif defined(MDU_LSTAT)
+#include <sys/stat.h>
+#endif
+
+#ifdef MDU_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+ * Implementation of libmdu, the scanning engine of mdu.
+ * Every worker reads directories off its own work-stealing deque and
+ * sizes their entries, the totals of a root are merged when its last
+ * directory completes.
+ *
+ * Author: Marcus Lundqvist.
+ */
+
+/*
+ * Work-stealing deque (Chase-Lev, with the memory orderings from Le et al.,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models").
+ * The owning thread pushes and pops at the bottom without taking any lock,
+ * other threads steal the oldest item from the top with a single CAS.
+ * T has to be trivially copyable, in practice a pointer.
+ */
+template<typename T>
+class WorkDeque
+{
+private:
+    struct Array
+    {
+        std::int64_t capacity;
+        std::unique_ptr<std::atomic<T>[]> items;
+
+        explicit Array(std::int64_t cap) : capacity{cap}, items{new std::atomic<T>[cap]} {}
+
+        T get(std::int64_t i) const
+        {
+            return items[i & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+
+        void put(std::int64_t i, T item)
+        {
+            items[i & (capacity - 1)].store(item, std::memory_order_relaxed);
+        }
+    };
+
+    alignas(64) std::atomic<std::int64_t> m_top{0};
+    alignas(64) std::atomic<std::int64_t> m_bottom{0};
+    std::atomic<Array *> m_array;
+    // Arrays replaced by grow() are kept until destruction since a thief may still read them
+    std::vector<std::unique_ptr<Array> > m_retired;
+
+    Array *grow(Array *old, std::int64_t bottom, std::int64_t top)
+    {
+        auto *bigger = new Array(old->capacity * 2);
+        for (std::int64_t i = top; i < bottom; ++i)
+        {
+            bigger->put(i, old->get(i));
+        }
+        m_retired.emplace_back(old);
+        m_array.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+public:
+    explicit WorkDeque(std::int64_t capacity = 1024) : m_array{new Array(capacity)} {}
+
+    ~WorkDeque()
+    {
+        delete m_array.load(std::memory_order_relaxed);
+    }
+
+    WorkDeque(const WorkDeque &) = delete;
+    WorkDeque &operator=(const WorkDeque &) = delete;
+
+    // Owner only
+    void push(T item)
+    {
+        std::int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        std::int64_t top = m_top.load(std::memory_order_acquire);
+        Array *array = m_array.load(std::memory_order_relaxed);
+        if (bottom - top > array->capacity - 1)
+        {
+            array = grow(array, bottom, top);
+        }
+        array->put(bottom, item);
+        m_bottom.store(bottom + 1, std::memory_order_release);
+    }
+
+    // Owner only, takes the most recently pushed item
+    bool pop(T &item)
+    {
+        std::int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+        Array *array = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t top = m_top.load(std::memory_order_relaxed);
+
+        if (top > bottom)
+        {
+            // Empty
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        item = array->get(bottom);
+        if (top == bottom)
+        {
+            // Last item, race against thieves for it
+            bool won = m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                                     std::memory_order_relaxed);
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread, takes the oldest item
+    bool steal(T &item)
+    {
+        std::int64_t top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t bottom = m_bottom.load(std::memory_order_acquire);
+
+        if (top >= bottom)
+        {
+            return false;
+        }
+
+        Array *array = m_array.load(std::memory_order_acquire);
+        item = array->get(top);
+        return m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed);
+    }
+
+    bool empty() const
+    {
+        return m_top.load(std::memory_order_acquire) >= m_bottom.load(std::memory_order_acquire);
+    }
+
+    // Only exact for the owner, thieves may be taking items meanwhile
+    std::int64_t size() const
+    {
+        return std::max<std::int64_t>(0, m_bottom.load(std::memory_order_relaxed) -
+                                             m_top.load(std::memory_order_relaxed));
+    }
+};
+
+/*
+ * Bounded multi-producer multi-consumer queue (Vyukov's array queue).
+ * Every cell carries a sequence number telling producers and consumers
+ * whether it is free or full for their lap, so both sides only ever
+ * CAS their own index. push() fails instead of waiting when it is full.
+ * T has to be trivially copyable, in practice a pointer.
+ */
+template<typename T>
+class MpmcRing
+{
+private:
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    std::size_t m_mask;
+    alignas(64) std::atomic<std::size_t> m_head{0};
+    alignas(64) std::atomic<std::size_t> m_tail{0};
+
+public:
+    // capacity has to be a power of two
+    explicit MpmcRing(std::size_t capacity) : m_cells(new Cell[capacity]), m_mask(capacity - 1)
+    {
+        for (std::size_t i = 0; i < capacity; ++i)
+        {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(T value)
+    {
+        std::size_t pos = m_head.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = m_cells[pos & m_mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                // Full, the consumer of the previous lap has not taken this cell yet
+                return false;
+            }
+            else
+            {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T &value)
+    {
+        std::size_t pos = m_tail.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = m_cells[pos & m_mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    value = cell.value;
+                    cell.sequence.store(pos + m_mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool empty() const
+    {
+        std::size_t pos = m_tail.load(std::memory_order_acquire);
+        return m_cells[pos & m_mask].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+};
+
+/*
+ * Set of (root, dev, ino) keys used to count hard linked files once per root.
+ * Only files with more than one link are inserted. The set is split in
+ * shards with a lock each, picked by a hash of the inode, so workers only
+ * wait on each other when they hit the same shard at the same time.
+ */
+class InodeSet
+{
+private:
+    struct Key
+    {
+        std::uint64_t dev;
+        std::uint64_t ino;
+        std::uint32_t root;
+
+        bool operator==(const Key &other) const = default;
+    };
+
+    struct KeyHash
+    {
+        std::size_t operator()(const Key &key) const
+        {
+            // splitmix64 finalizer, inode numbers are often sequential
+            std::uint64_t x = key.ino ^ ((key.dev ^ (std::uint64_t{key.root} << 40)) * 0x9e3779b97f4a7c15ULL);
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return static_cast<std::size_t>(x ^ (x >> 31));
+        }
+    };
+
+    struct alignas(64) Shard
+    {
+        std::mutex mutex;
+        std::unordered_set<Key, KeyHash> inodes;
+    };
+
+    static constexpr std::size_t shard_count = 64;
+    std::array<Shard, shard_count> m_shards;
+
+public:
+    // Returns true the first time an inode is seen in a root
+    bool insert(std::uint32_t root, std::uint64_t dev, std::uint64_t ino)
+    {
+        Key key{dev, ino, root};
+        std::size_t hash = KeyHash{}(key);
+        // The low bits pick the bucket inside the shard, use the high ones for the shard
+        Shard &shard = m_shards[(hash >> 58) % shard_count];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.inodes.insert(key).second;
+    }
+
+    // Root indexes start over with every scan
+    void clear()
+    {
+        for (Shard &shard : m_shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.inodes.clear();
+        }
+    }
+};
+
+/*
+ * Bump allocator for directory names, so a queued directory does not
+ * need a string of its own. Names are never freed one by one, all
+ * chunks are handed back at once when the root has completed.
+ */
+class NameArena
+{
+private:
+    std::vector<std::unique_ptr<char[]> > m_chunks;
+    std::size_t m_used{chunk_size};
+
+public:
+    static constexpr std::size_t chunk_size = 64 * 1024;
+
+    // Copies name with a terminator, nullptr when a new chunk is needed first
+    const char *copy(const char *name, std::size_t length)
+    {
+        if (m_used + length + 1 > chunk_size)
+        {
+            return nullptr;
+        }
+        char *out = m_chunks.back().get() + m_used;
+        std::memcpy(out, name, length);
+        out[length] = '\0';
+        m_used += length + 1;
+        return out;
+    }
+
+    void add_chunk(std::unique_ptr<char[]> chunk)
+    {
+        m_chunks.push_back(std::move(chunk));
+        m_used = 0;
+    }
+
+    // Moves every chunk to spare, nothing may point into them any more
+    void release(std::vector<std::unique_ptr<char[]> > &spare)
+    {
+        for (auto &chunk : m_chunks)
+        {
+            spare.push_back(std::move(chunk));
+        }
+        m_chunks.clear();
+        m_used = chunk_size;
+    }
+};
+
+#ifdef MDU_GETDENTS
+// One directory in the --cache file
+typedef struct CacheRecord
+{
+    std::uint64_t dev;
+    std::uint64_t ino;
+    std::int64_t mtime_sec;
+    std::int64_t ctime_sec;
+    std::uint32_t mtime_nsec;
+    std::uint32_t ctime_nsec;
+    // Entries directly in the directory that are not directories
+    std::uint64_t files;
+    std::uint64_t bytes;
+    std::uint64_t blocks;
+    // Subdirectory names, each NUL terminated, in the name area after the records
+    std::uint64_t names_offset;
+    std::uint64_t names_size;
+    std::uint64_t child_count;
+} CacheRecord;
+
+typedef struct CacheHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t record_size;
+    std::uint64_t record_count;
+    std::uint64_t names_size;
+} CacheHeader;
+
+/*
+ * The --cache file of the previous run, mapped read only. Records are
+ * sorted by (dev, ino) so a lookup is a binary search.
+ * A directory whose mtime and ctime are unchanged is not read again,
+ * its cached file totals are used and only its subdirectories are
+ * visited. A file rewritten in place does not touch the directory, so
+ * its new size shows up once something in that directory is added,
+ * removed or renamed.
+ */
+class ScanCache
+{
+private:
+    void *m_map{MAP_FAILED};
+    std::size_t m_size{0};
+    const CacheRecord *m_records{nullptr};
+    std::size_t m_count{0};
+    const char *m_names{nullptr};
+    std::uint64_t m_names_size{0};
+
+public:
+    static constexpr char magic[8] = {'M', 'D', 'U', 'C', 'A', 'C', 'H', 'E'};
+    static constexpr std::uint32_t version = 1;
+
+    ScanCache() = default;
+    ScanCache(const ScanCache &) = delete;
+    ScanCache &operator=(const ScanCache &) = delete;
+
+    ~ScanCache()
+    {
+        close();
+    }
+
+    void close()
+    {
+        if (m_map != MAP_FAILED)
+        {
+            munmap(m_map, m_size);
+        }
+        m_map = MAP_FAILED;
+        m_size = 0;
+        m_records = nullptr;
+        m_count = 0;
+        m_names = nullptr;
+        m_names_size = 0;
+    }
+
+    // A missing or unusable file leaves the cache empty, the scan then reads everything
+    bool open(const char *path)
+    {
+        close();
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(CacheHeader))
+        {
+            ::close(fd);
+            return false;
+        }
+        std::size_t size = static_cast<std::size_t>(st.st_size);
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+        {
+            return false;
+        }
+
+        const auto *header = static_cast<const CacheHeader *>(map);
+        std::size_t body = size - sizeof(CacheHeader);
+        if (std::memcmp(header->magic, magic, sizeof(magic)) != 0 || header->version != version ||
+            header->record_size != sizeof(CacheRecord) || header->record_count > body / sizeof(CacheRecord) ||
+            header->names_size != body - header->record_count * sizeof(CacheRecord))
+        {
+            munmap(map, size);
+            return false;
+        }
+
+        m_map = map;
+        m_size = size;
+        m_records = reinterpret_cast<const CacheRecord *>(header + 1);
+        m_count = header->record_count;
+        m_names = reinterpret_cast<const char *>(m_records + m_count);
+        m_names_size = header->names_size;
+        return true;
+    }
+
+    // The record for a directory, if it has not changed since it was cached
+    const CacheRecord *find(const struct stat &st) const
+    {
+        std::uint64_t dev = st.st_dev;
+        std::uint64_t ino = st.st_ino;
+        const CacheRecord *end = m_records + m_count;
+        const CacheRecord *record = std::lower_bound(m_records, end, 0, [dev, ino](const CacheRecord &r, int) {
+            return r.dev < dev || (r.dev == dev && r.ino < ino);
+        });
+        if (record == end || record->dev != dev || record->ino != ino ||
+            record->mtime_sec != st.st_mtim.tv_sec || record->mtime_nsec != st.st_mtim.tv_nsec ||
+            record->ctime_sec != st.st_ctim.tv_sec || record->ctime_nsec != st.st_ctim.tv_nsec)
+        {
+            return nullptr;
+        }
+        // Do not trust a damaged file with bounds
+        if (record->names_offset > m_names_size || record->names_size > m_names_size - record->names_offset ||
+            (record->names_size > 0 && m_names[record->names_offset + record->names_size - 1] != '\0'))
+        {
+            return nullptr;
+        }
+        return record;
+    }
+
+    const char *names(const CacheRecord &record) const
+    {
+        return m_names + record.names_offset;
+    }
+};
+#endif
+
+#ifdef MDU_IO_URING
+/*
+ * Minimal io_uring wrapper on top of the raw syscalls, only what the
+ * statx/openat batches need. Not thread safe, every worker has its own.
+ */
+class Ring
+{
+private:
+    int m_fd{-1};
+    unsigned m_entries{0};
+    void *m_sq_ptr{MAP_FAILED};
+    void *m_cq_ptr{MAP_FAILED};
+    std::size_t m_sq_size{0};
+    std::size_t m_cq_size{0};
+    io_uring_sqe *m_sqes{static_cast<io_uring_sqe *>(MAP_FAILED)};
+    std::size_t m_sqes_size{0};
+
+    unsigned *m_sq_head{nullptr};
+    unsigned *m_sq_tail{nullptr};
+    unsigned *m_sq_mask{nullptr};
+    unsigned *m_sq_array{nullptr};
+    unsigned *m_cq_head{nullptr};
+    unsigned *m_cq_tail{nullptr};
+    unsigned *m_cq_mask{nullptr};
+    io_uring_cqe *m_cqes{nullptr};
+
+    // Tail of the prepared but not yet submitted entries
+    unsigned m_tail{0};
+    unsigned m_to_submit{0};
+
+public:
+    Ring() = default;
+    Ring(const Ring &) = delete;
+    Ring &operator=(const Ring &) = delete;
+
+    ~Ring()
+    {
+        if (m_sqes != MAP_FAILED)
+        {
+            munmap(m_sqes, m_sqes_size);
+        }
+        if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+        {
+            munmap(m_cq_ptr, m_cq_size);
+        }
+        if (m_sq_ptr != MAP_FAILED)
+        {
+            munmap(m_sq_ptr, m_sq_size);
+        }
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+    }
+
+    // Returns 0 or the errno from setting up the ring
+    int setup(unsigned entries)
+    {
+        io_uring_params params{};
+        m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (m_fd < 0)
+        {
+            return errno;
+        }
+
+        m_entries = params.sq_entries;
+        m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+        }
+
+        m_sq_ptr = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                        IORING_OFF_SQ_RING);
+        if (m_sq_ptr == MAP_FAILED)
+        {
+            return errno;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            m_cq_ptr = m_sq_ptr;
+        }
+        else
+        {
+            m_cq_ptr = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                            IORING_OFF_CQ_RING);
+            if (m_cq_ptr == MAP_FAILED)
+            {
+                return errno;
+            }
+        }
+
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = static_cast<io_uring_sqe *>(mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+        if (m_sqes == MAP_FAILED)
+        {
+            return errno;
+        }
+
+        auto *sq = static_cast<char *>(m_sq_ptr);
+        auto *cq = static_cast<char *>(m_cq_ptr);
+        m_sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        m_sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        m_sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        m_sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        m_cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        m_cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        m_tail = *m_sq_tail;
+        return 0;
+    }
+
+    unsigned entries() const
+    {
+        return m_entries;
+    }
+
+    unsigned to_submit() const
+    {
+        return m_to_submit;
+    }
+
+    // Returns a zeroed entry, or nullptr when the submission queue is full
+    io_uring_sqe *next_sqe()
+    {
+        unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_tail - head >= m_entries)
+        {
+            return nullptr;
+        }
+        unsigned index = m_tail & *m_sq_mask;
+        io_uring_sqe *sqe = &m_sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        m_sq_array[index] = index;
+        ++m_tail;
+        ++m_to_submit;
+        return sqe;
+    }
+
+    // Submits everything prepared and waits for at least wait_nr completions.
+    // A full completion queue is drained through handler, as reap() would, what it got counts
+    // as the wait and whatever is not submitted yet goes with the next call.
+    template<typename Handler>
+    int submit(unsigned wait_nr, Handler &&handler)
+    {
+        __atomic_store_n(m_sq_tail, m_tail, __ATOMIC_RELEASE);
+        while (true)
+        {
+            long ret = syscall(__NR_io_uring_enter, m_fd, m_to_submit, wait_nr,
+                               wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (ret >= 0)
+            {
+                m_to_submit -= static_cast<unsigned>(ret);
+                return 0;
+            }
+            int code = errno;
+            if (code == EAGAIN || code == EBUSY)
+            {
+                // With nothing to reap the kernel will not make room, calling again would only spin
+                return reap(handler) > 0 ? 0 : code;
+            }
+            if (code != EINTR)
+            {
+                return code;
+            }
+        }
+    }
+
+    // Calls handler(user_data, res) for every completion that has arrived
+    template<typename Handler>
+    unsigned reap(Handler &&handler)
+    {
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+        for (; head != tail; ++head, ++count)
+        {
+            const io_uring_cqe &cqe = m_cqes[head & *m_cq_mask];
+            handler(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+        return count;
+    }
+};
+
+// Waiting a ring whose io_uring_enter() failed may spend on what the kernel already took
+constexpr std::chrono::milliseconds drain_limit(1000);
+
+// Bookkeeping for one request in flight on a worker's ring
+typedef struct RingSlot
+{
+    const char *name{nullptr};
+    bool is_open{false};
+    struct statx stx{};
+} RingSlot;
+#endif
+
+// An open directory, kept alive while subdirectories queued from it still need it for openat()
+typedef struct DirHandle
+{
+    int fd{-1};
+    std::atomic<int> refs{1};
+} DirHandle;
+
+// Where a directory set aside under --max-queue-mem continues reading
+typedef struct DirCursor
+{
+    // Still open, or -1 after it was closed to stay within the fd budget
+    int fd{-1};
+    // getdents64 position to seek back to when fd had to be closed
+    std::int64_t offset{0};
+    // The handle its subdirectories were queued with so far
+    DirHandle *handle{nullptr};
+    bool share_fd{true};
+} DirCursor;
+
+// Files of a huge directory handed to another worker to stat
+typedef struct StatBatch
+{
+    // NUL terminated names, one after another
+    std::vector<char> names;
+    std::size_t count{0};
+} StatBatch;
+
+// A counted file as report_file() gets it, from whichever stat call the backend made
+typedef struct FileStat
+{
+    std::uint64_t bytes{0};
+    std::uint64_t blocks{0};
+    // Owner, mtime and inode are only known where there was an lstat() or statx()
+    bool have_owner{false};
+    std::uint32_t uid{0};
+    std::uint32_t gid{0};
+    std::int64_t mtime{0};
+    std::uint64_t dev{0};
+    std::uint64_t ino{0};
+    std::uint64_t links{0};
+} FileStat;
+
+// Lets the extension table be searched with a string_view, a hit never allocates
+typedef struct ExtensionHash
+{
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view extension) const
+    {
+        return std::hash<std::string_view>{}(extension);
+    }
+} ExtensionHash;
+
+// One worker's part of the Breakdown, only touched by the worker until the scan is done
+typedef struct WorkerBreakdown
+{
+    std::unordered_map<std::uint32_t, Aggregate> uids;
+    std::unordered_map<std::uint32_t, Aggregate> gids;
+    std::unordered_map<std::string, Aggregate, ExtensionHash, std::equal_to<> > extensions;
+    std::array<Aggregate, 65> sizes{};
+    std::array<Aggregate, Breakdown::age_days.size() + 1> ages{};
+} WorkerBreakdown;
+
+// What one read of a directory counted, for the --export snapshot
+typedef struct SnapshotRecord
+{
+    std::uint64_t id;
+    std::uint64_t parent;
+    std::uint32_t root;
+    // Only the first read of a directory names it, a resumed read or a file batch only adds to it
+    bool named;
+    std::uint64_t names_offset;
+    std::uint64_t names_size;
+    std::uint64_t files;
+    std::uint64_t bytes;
+    std::uint64_t blocks;
+} SnapshotRecord;
+
+/*
+ * A directory in the scanned tree, queued until a worker reads it.
+ * When the directory and all its subdirectories are done its size is
+ * added to the parent, so the root ends up with the total.
+ */
+typedef struct DirNode
+{
+    // Last component in the worker's NameArena, the whole argument for a root
+    const char *name{nullptr};
+    std::size_t name_len{0};
+    DirHandle *handle{nullptr};
+    // Already opened by the io_uring engine, counted in ThreadInfo::open_handles
+    int fd{-1};
+    // Set when the directory was only partly read, owned by the node
+    DirCursor *cursor{nullptr};
+    // Set for a part of the parent's files rather than a directory, the handle is the parent's
+    StatBatch *batch{nullptr};
+
+    DirNode *parent{nullptr};
+    // Index of the root argument this directory belongs to
+    std::uint32_t root{0};
+    int depth{0};
+    // Own entries plus every completed subdirectory, only filled in with Options::max_depth
+    std::atomic<std::uintmax_t> size{0};
+    // Names it in the --export snapshot, set before its first subdirectory is queued
+    std::uint64_t snapshot_id{0};
+    // Subdirectories not yet complete, plus one until this directory has been read
+    std::atomic<std::int64_t> pending{1};
+} DirNode;
+
+// Per thread state, the deque holds directories waiting to be read
+typedef struct alignas(64) Worker
+{
+    int id{0};
+    // CPU and NUMA node the thread is pinned to, -1 if it is not
+    int cpu{-1};
+    int node{-1};
+    // The other workers in the order to steal from, the ones on the same node first
+    std::vector<Worker *> victims;
+    WorkDeque<DirNode *> deque;
+    // Indexed by root
+    std::vector<Counters> roots;
+    // On its own cache line, thieves read the deque right above
+    alignas(64) WorkerStats stats;
+    // Copies of stats.entries and the busy time for the -j auto tuner, only stored by the owner
+    std::atomic<std::uint64_t> done_entries{0};
+    std::atomic<std::uint64_t> busy_ns{0};
+    // Names of the queued subdirectories, indexed by root
+    std::vector<NameArena> names;
+    // Scratch for opening directories by path
+    std::string path;
+    // Partly read directories, resumed once the deque runs dry
+    std::vector<DirNode *> suspended;
+    // Min-heap of the largest entries this worker saw, for Options::top
+    std::vector<TopEntry> top;
+    // Files counted by owner, extension, size and age, for Options::by_owner, by_ext and histogram
+    WorkerBreakdown breakdown;
+    // Errors of the running scan, at most Options::max_errors, the rest only counted
+    std::vector<ScanError> errors;
+    std::uint64_t errors_dropped{0};
+    // Waiting on retries the directory being read has left
+    std::chrono::microseconds retry_left{0};
+    // Depth of the directory it read last, where Order::hybrid switches to depth first
+    int last_depth{0};
+    // What file batches stat'ed while reading it counted, they are not its own entries
+    Counters inline_batches;
+    // Directories read in the running scan for the --export snapshot, names_offset into snapshot_names
+    std::vector<SnapshotRecord> snapshot_records;
+    std::vector<char> snapshot_names;
+    std::uint64_t snapshot_serial{0};
+#ifdef MDU_GETDENTS
+    // Records for the next --cache file, with names_offset into cache_names
+    std::vector<CacheRecord> cache_records;
+    std::vector<char> cache_names;
+#endif
+    // getdents64 buffer, allocated by the worker thread itself
+    std::vector<char> dirents;
+#ifdef MDU_IO_URING
+    std::unique_ptr<Ring> ring;
+    bool ring_tried{false};
+    std::vector<RingSlot> slots;
+    std::vector<unsigned> free_slots;
+    // Rings dropped while the kernel still had requests on them, closed with the worker
+    std::vector<std::unique_ptr<Ring> > stuck_rings;
+    // Opens of queued subdirectories for Options::prefetch, user_data indexes prefetch_slots
+    std::unique_ptr<Ring> prefetch_ring;
+    bool prefetch_tried{false};
+    // The subdirectory of every open in flight, nullptr for a free slot
+    std::vector<DirNode *> prefetch_slots;
+    std::vector<unsigned> free_prefetch;
+    // Why a ring could not be set up in the running scan, for ScanResult
+    int ring_error{0};
+    int prefetch_error{0};
+#endif
+    // Subdirectories whose prefetched open is not reaped yet, they are pushed once it is
+    unsigned prefetching{0};
+} Worker;
+
+// Struct for the threads to read from and write to
+typedef struct ThreadInfo
+{
+    Options options;
+    // Fill in DirNode::size, for the directories on_directory reports
+    bool track_sizes{false};
+    // Any of Options::by_owner, by_ext and histogram
+    bool breakdown{false};
+    // Of the running scan, set before its roots are injected
+    const ScanCallbacks *callbacks{nullptr};
+    // Every file of the running scan has to be seen, so no directory is taken from the cache
+    bool file_details{false};
+    // The add_directory() instantiation select_kernel() picked for the running scan
+    int (*read_directory)(ThreadInfo &, Worker &, DirNode &){nullptr};
+    // Start of the running scan in seconds since the epoch, what the histogram's ages count from
+    std::int64_t scan_time{0};
+    // The running scan was stopped, workers drop what is still queued
+    std::atomic<bool> cancelled{false};
+    std::vector<std::unique_ptr<Worker> > workers;
+    // Workers that are set up on their own thread, with Options::numa they are created there
+    std::atomic<int> placed{0};
+    // Number of threads sleeping on wake_epoch, and of those looking for work to steal
+    std::atomic<int> idle{0};
+    std::atomic<int> searching{0};
+    // Bumped for every wakeup, the sleepers futex wait for it to change
+    std::atomic<std::uint32_t> wake_epoch{0};
+    // Size of injected, so finding work does not take the mutex to see it is empty
+    std::atomic<std::size_t> injected_count{0};
+    std::atomic<bool> no_more_work{false};
+    // Workers with an id from here on are parked by the -j auto tuner
+    std::atomic<int> active_limit{std::numeric_limits<int>::max()};
+    // File batches from the -j threads for the --stat-threads ones, nullptr without them
+    std::unique_ptr<MpmcRing<DirNode *> > stat_queue;
+    // Number of stat threads sleeping on stat_epoch
+    std::atomic<int> stat_idle{0};
+    std::atomic<std::uint32_t> stat_epoch{0};
+    std::atomic<int> error{0};
+    // Directory handles kept open for queued subdirectories, capped at max_handles
+    std::atomic<int> open_handles{0};
+    int max_handles{0};
+    // Queued directories a worker may have before it reads depth first, 0 for no limit
+    std::int64_t max_queued{0};
+    // Hard linked files already counted, per root
+    InodeSet inodes;
+#ifdef MDU_GETDENTS
+    // Previous --cache file, read only once the threads run
+    ScanCache cache;
+#endif
+    // Everything below is protected by mutex
+    std::deque<DirNode *> injected;
+    // Indexed by root, and the roots in the order they completed
+    std::vector<char> root_done;
+    std::vector<Counters> totals;
+    std::deque<std::uint32_t> completed;
+    // NameArena chunks of completed roots, ready for reuse
+    std::vector<std::unique_ptr<char[]> > spare_chunks;
+    std::mutex mutex;
+    // Raised active_limit, or shutdown, for the workers parked by the tuner
+    std::condition_variable tuned;
+    std::condition_variable threads_complete;
+} ThreadInfo;
+
+/*
+ * What a scan does for every entry, as constants. The functions that run
+ * per entry are templates on it and select_kernel() picks the
+ * instantiation once per scan, so the loops of a plain scan have no
+ * branch for a feature it does not use.
+ */
+template<bool Dedup, bool Report, bool Apparent>
+struct ScanKernel
+{
+    // Hard linked files are counted once per root, Options::count_links is off
+    static constexpr bool dedup = Dedup;
+    // Counted files go to report_file(), ThreadInfo::file_details
+    static constexpr bool report = Report;
+    // Which report_file() sizes by st_size, Options::apparent_size
+    static constexpr bool apparent = Apparent;
+};
+
+/**
+ * select_kernel() - Picks the add_directory() instantiation for a scan.
+ * Must be called once the scan's callbacks and file_details are set.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ *
+ * Returns: The instantiation for ThreadInfo::read_directory.
+ *
+ */
+auto select_kernel(const ThreadInfo &threadInfo) -> int (*)(ThreadInfo &, Worker &, DirNode &);
+
+/**
+ * add_directory() - loops trough directory.
+ * Subdirectories are pushed onto the calling worker's own deque.
+ * With the getdents64 backend the directory is opened relative to its
+ * parent and every non-directory entry costs a single fstatat().
+ * A file batch goes to stat_batch() instead.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker reading the directory.
+ * @node: Directory to read.
+ *
+ * Returns: 0 if successful, 1 if error occurred.
+ *
+ */
+template<typename Kernel>
+int add_directory(ThreadInfo &threadInfo, Worker &worker, DirNode &node);
+
+#ifdef MDU_GETDENTS
+/**
+ * set_handle_budget() - Decides how many directory fds may be kept open.
+ * Raises the soft RLIMIT_NOFILE to the hard limit and keeps a margin
+ * for the fds the workers have open while reading.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ *
+ * Returns: Nothing.
+ *
+ */
+void set_handle_budget(ThreadInfo &threadInfo);
+
+/**
+ * release_handle() - Drops one reference to a directory handle.
+ * Closes the fd when the last reference is gone.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @handle: Handle to release, may be nullptr.
+ *
+ * Returns: Nothing.
+ *
+ */
+void release_handle(ThreadInfo &threadInfo, DirHandle *handle);
+
+/**
+ * stat_entry() - Sizes one directory entry with fstatat().
+ * Files are counted, hard linked ones once per root.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker doing the stat.
+ * @dir: Directory the entry is in.
+ * @fd: Open fd of dir.
+ * @name: Name of the entry.
+ * @counters: The worker's totals for the root.
+ *
+ * Returns: 1 for a directory, 0 for anything else and -1 on error.
+ *
+ */
+template<typename Kernel>
+int stat_entry(ThreadInfo &threadInfo, Worker &worker, const DirNode &dir, int fd, const char *name,
+               Counters &counters);
+
+/**
+ * stat_batch() - Sizes a batch of files split off a huge directory.
+ * Runs on whichever worker took the batch, the directory itself is
+ * still being read meanwhile.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker doing the stats.
+ * @node: The batch, a child of the directory the files are in.
+ *
+ * Returns: 0 if successful, 1 if error occurred.
+ *
+ */
+template<typename Kernel>
+int stat_batch(ThreadInfo &threadInfo, Worker &worker, DirNode &node);
+
+/**
+ * write_cache() - Writes the --cache file for the next run.
+ * Merges the records of all workers sorted by (dev, ino) and replaces
+ * the old file through a rename, so a failed write keeps the old one.
+ * Must be called after the threads are joined.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ *
+ * Returns: 0 if the file was written, otherwise the errno.
+ *
+ */
+int write_cache(const ThreadInfo &threadInfo);
+#endif
+
+#ifdef MDU_IO_URING
+/**
+ * start_ring() - Sets up the worker's io_uring on first use.
+ * Falls back to plain fstatat() if the kernel refuses, the scan's
+ * ScanResult::ring_error says why.
+ *
+ * @worker: The worker that wants a ring.
+ *
+ * Returns: true if the ring can be used.
+ *
+ */
+bool start_ring(Worker &worker);
+
+/**
+ * stat_entries_uring() - Sizes one getdents64 buffer through io_uring.
+ * Submits IORING_OP_STATX for files and IORING_OP_OPENAT for
+ * subdirectories in batches, the opened fds are handed to the queued
+ * subdirectories. All requests are reaped before returning since they
+ * point into the buffer. If io_uring_enter() fails, whatever the kernel
+ * completes within drain_limit is still used, the rest is done with
+ * fstatat() and the ring is dropped, ScanResult::ring_error says why.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker reading the directory.
+ * @node: The directory being read.
+ * @fd: Its open fd.
+ * @nread: Bytes filled in worker.dirents.
+ * @counters: The worker's totals for this root.
+ *
+ * Returns: 0 if successful, 1 if error occurred.
+ *
+ */
+template<typename Kernel>
+int stat_entries_uring(ThreadInfo &threadInfo, Worker &worker, DirNode &node, int fd, long nread,
+                       Counters &counters);
+
+/**
+ * start_prefetch() - Sets up the worker's ring for Options::prefetch on first use.
+ * Leaves the opens to the readers if the kernel refuses, the scan's
+ * ScanResult::prefetch_error says why.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker that wants a ring.
+ *
+ * Returns: true if the ring can be used.
+ *
+ */
+bool start_prefetch(ThreadInfo &threadInfo, Worker &worker);
+
+/**
+ * prefetch_directory() - Starts opening a subdirectory before it is queued.
+ * Submits IORING_OP_OPENAT relative to child->handle, which keeps the
+ * parent open until reap_prefetch() pushes the child with its fd. Nothing
+ * is started while Options::prefetch opens are in flight or the fd
+ * budget is used up.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker reading the parent.
+ * @child: Subdirectory about to be queued, with a handle of its parent.
+ *
+ * Returns: true if the child now belongs to the ring, false to push it as it is.
+ *
+ */
+bool prefetch_directory(ThreadInfo &threadInfo, Worker &worker, DirNode *child);
+
+/**
+ * reap_prefetch() - Pushes the subdirectories whose prefetched open completed.
+ * A child whose open failed is pushed with its parent's handle, so
+ * add_directory() tries again and reports what went wrong. If
+ * io_uring_enter() fails, the opens the kernel completes within
+ * drain_limit are still used, the ring is dropped and every child
+ * still in it is pushed the same way, ScanResult::prefetch_error says why.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker owning the ring.
+ * @wait_nr: Completions to wait for, after submitting what is prepared.
+ *
+ * Returns: Nothing.
+ *
+ */
+void reap_prefetch(ThreadInfo &threadInfo, Worker &worker, unsigned wait_nr);
+#endif
+
+#ifndef MDU_GETDENTS
+/**
+ * file_usage() - Size of one entry for the portable backend.
+ * Uses lstat() where it exists so allocated blocks can be reported
+ * and hard linked files are only counted once.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker reading the directory.
+ * @node: Directory the entry is in.
+ * @name: Name of the entry, nullptr for node itself.
+ * @path: Entry to measure.
+ * @counters: The worker's totals for this root.
+ *
+ * Returns: 0 if successful, 1 if error occurred.
+ *
+ */
+template<typename Kernel>
+int file_usage(ThreadInfo &threadInfo, Worker &worker, const DirNode &node, const char *name,
+               const std::filesystem::path &path, Counters &counters);
+#endif
+
+/**
+ * new_child() - Creates the node for a subdirectory.
+ * Counts it as pending in the parent before anyone can see it.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker reading the parent, its arena keeps the name.
+ * @parent: Directory being read, owned by the calling thread.
+ * @name: Name of the subdirectory.
+ * @length: Length of name.
+ *
+ * Returns: The new node.
+ *
+ */
+DirNode *new_child(ThreadInfo &threadInfo, Worker &worker, DirNode &parent, const char *name, std::size_t length);
+
+/**
+ * store_name() - Copies a name into the worker's arena for a root.
+ * Takes a spare chunk from a completed root before allocating a new one.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker owning the arena.
+ * @root: Root the name belongs to.
+ * @name: Name to copy.
+ * @length: Length of name.
+ *
+ * Returns: The copy, valid until the root has completed.
+ *
+ */
+const char *store_name(ThreadInfo &threadInfo, Worker &worker, std::uint32_t root, const char *name,
+                       std::size_t length);
+
+/**
+ * build_path() - Puts together the full path of a directory.
+ * Only done for messages, printing and opening by path, the nodes
+ * themselves just keep their last component.
+ *
+ * @node: Directory whose parents are all still alive.
+ * @out: Replaced with the path.
+ *
+ * Returns: Nothing.
+ *
+ */
+void build_path(const DirNode &node, std::string &out);
+
+/**
+ * node_path() - Full path of a directory or of an entry in it.
+ *
+ * @node: Directory whose parents are all still alive.
+ * @name: Entry in the directory, or nullptr for the directory itself.
+ *
+ * Returns: The path.
+ *
+ */
+std::string node_path(const DirNode &node, const char *name = nullptr);
+
+/**
+ * finish_directory() - Marks one pending part of a directory as done.
+ * Rolls completed directories up into their parents without any lock,
+ * reports them through on_directory and wakes the thread running the
+ * scan when the root is complete.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker that read it.
+ * @node: Directory that was read, or whose subdirectory completed.
+ *
+ * Returns: Nothing.
+ *
+ */
+void finish_directory(ThreadInfo &threadInfo, Worker &worker, DirNode *node);
+
+/**
+ * start_snapshot() - Gives a directory its id in the --export snapshot.
+ * Has to happen before its first subdirectory is queued, the
+ * subdirectories name their parent by it.
+ *
+ * @worker: The worker reading it for the first time.
+ * @node: The directory.
+ *
+ * Returns: Nothing.
+ *
+ */
+void start_snapshot(Worker &worker, DirNode &node);
+
+/**
+ * record_snapshot() - Keeps what one read of a directory counted.
+ * The records of all workers become the --export snapshot once the
+ * scan is done.
+ *
+ * @worker: The worker that read it.
+ * @dir: The directory.
+ * @named: The first read of the directory, the record names it.
+ * @before: The worker's totals for the root before the read.
+ * @after: Them after it.
+ *
+ * Returns: Nothing.
+ *
+ */
+void record_snapshot(Worker &worker, const DirNode &dir, bool named, const Counters &before, const Counters &after);
+
+/**
+ * write_export() - Writes the --export snapshot of the scan just done.
+ * Must be called after the root completed, when no worker adds records.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ *
+ * Returns: 0 if the file was written, otherwise the errno.
+ *
+ */
+int write_export(const ThreadInfo &threadInfo);
+
+/**
+ * abandon_directory() - Drops a queued directory of a cancelled scan.
+ * Gives back the fds it holds without reading it, finish_directory()
+ * still has to be called for it.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @node: Directory or file batch that will not be read.
+ *
+ * Returns: Nothing.
+ *
+ */
+void abandon_directory(ThreadInfo &threadInfo, DirNode &node);
+
+/**
+ * record_error() - Keeps an error for ScanResult::errors.
+ * Only the worker's own buffer is touched, so a tree full of
+ * unreadable entries never has the workers queue up on a lock or on
+ * stderr. The path is not even built once the buffer is full.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker that hit it.
+ * @dir: The directory itself, or the one the entry is in.
+ * @name: Name of the entry, nullptr for dir itself.
+ * @operation: What failed.
+ * @code: The errno it failed with.
+ *
+ * Returns: Nothing.
+ *
+ */
+void record_error(const ThreadInfo &threadInfo, Worker &worker, const DirNode &dir, const char *name,
+                  ScanError::Operation operation, int code);
+
+/**
+ * retry_transient() - Repeats a call while it fails with a transient error.
+ * Waits out of the Worker::retry_left the directory being read still
+ * has, and counts the retries in its stats.
+ *
+ * @worker: The worker making the call.
+ * @call: Returns a negative value and sets errno when it fails.
+ *
+ * Returns: What the last attempt returned, with errno from it.
+ *
+ */
+template<typename Call>
+auto retry_transient(Worker &worker, Call call) -> decltype(call());
+
+/**
+ * report_file() - Hands a counted file to on_file, --top and the breakdowns, if asked for.
+ * Compiles to nothing for a kernel that does not report files.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker that counted it.
+ * @dir: Directory the file is in.
+ * @name: Name of the file.
+ * @file: What the stat call said about it.
+ *
+ * Returns: Nothing.
+ *
+ */
+template<typename Kernel>
+void report_file(const ThreadInfo &threadInfo, Worker &worker, const DirNode &dir, const char *name,
+                 const FileStat &file);
+
+/**
+ * count_breakdown() - Adds a counted file to the worker's breakdown tables.
+ * Costs a hash lookup or an array index per table, nothing is allocated
+ * unless an owner or extension is new to this worker.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker that counted it.
+ * @name: Name of the file.
+ * @file: What the stat call said about it.
+ * @size: Its size as the scan measures it.
+ *
+ * Returns: Nothing.
+ *
+ */
+void count_breakdown(const ThreadInfo &threadInfo, Worker &worker, const char *name, const FileStat &file,
+                     std::uint64_t size);
+
+/**
+ * merge_breakdown() - Adds the workers' breakdown tables together.
+ * Must be called once every root of the scan has completed.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ *
+ * Returns: The breakdown of the scan, owners and extensions largest first.
+ *
+ */
+Breakdown merge_breakdown(ThreadInfo &threadInfo);
+
+/**
+ * offer_top() - Keeps an entry in the worker's heap if it is among the largest.
+ * The heap is a min-heap of at most Options::top entries, so most
+ * entries cost one compare with its smallest and never build a path.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker owning the heap.
+ * @dir: The directory itself, or the one the file is in.
+ * @name: Name of the file, nullptr for dir itself.
+ * @size: Size of the entry.
+ *
+ * Returns: Nothing.
+ *
+ */
+void offer_top(const ThreadInfo &threadInfo, Worker &worker, const DirNode &dir, const char *name, std::uint64_t size);
+
+/**
+ * merge_top() - Puts the workers' heaps together into the largest entries.
+ * Must be called once every root of the scan has completed.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ *
+ * Returns: At most Options::top entries, largest first.
+ *
+ */
+std::vector<TopEntry> merge_top(ThreadInfo &threadInfo);
+
+/**
+ * complete_root() - Takes a completed root off the workers.
+ * Hands its names back to the spare chunks and frees it.
+ * Runs on the thread running the scan.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @root: Root whose last directory completed.
+ * @result: Filled in with its totals.
+ *
+ * Returns: Nothing.
+ *
+ */
+void complete_root(ThreadInfo &threadInfo, DirNode *root, RootResult &result);
+
+/**
+ * push_directory() - Queues a directory on the worker's deque.
+ * Wakes a sleeping thread only if there is one and no thread is already
+ * searching for work, that one will take the directory instead.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker owning the deque.
+ * @item: Heap allocated directory, ownership passes to the queue.
+ *
+ * Returns: Nothing.
+ *
+ */
+void push_directory(ThreadInfo &threadInfo, Worker &worker, DirNode *item);
+
+/**
+ * wake_worker() - Wakes one sleeping worker, if any.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ *
+ * Returns: Nothing.
+ *
+ */
+void wake_worker(ThreadInfo &threadInfo);
+
+/**
+ * find_work() - Gets the next directory for a worker.
+ * Tries the worker's own deque, in Options::order, its prefetched opens
+ * and its set aside directories, then steals from the other workers and
+ * last takes roots injected by scan().
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker looking for work.
+ *
+ * Returns: Directory to read, or nullptr if no work was found.
+ *
+ */
+DirNode *find_work(ThreadInfo &threadInfo, Worker &worker);
+
+/**
+ * run_directory() - Reads a directory or file batch a worker took.
+ * A directory only partly read is set aside, anything else is finished.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker that took it.
+ * @item: The directory or batch.
+ *
+ * Returns: Nothing.
+ *
+ */
+void run_directory(ThreadInfo &threadInfo, Worker &worker, DirNode *item);
+
+/**
+ * read_inline() - Runs a scan on the calling thread while the pool is not started.
+ * Stops after about budget entries, whatever is left stays queued on
+ * the worker for its thread to go on with.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The first worker, whose thread does not run yet.
+ * @budget: Entries to read at most, a directory is always read to its end.
+ *
+ * Returns: true if the scan is done, false if the pool has to finish it.
+ *
+ */
+bool read_inline(ThreadInfo &threadInfo, Worker &worker, std::uint64_t budget);
+
+/**
+ * threadFunction() - Function run by every thread.
+ * Processes folders until there is no more work to do.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker this thread runs as.
+ *
+ * Returns: Nothing.
+ *
+ */
+void thread_function(ThreadInfo &threadInfo, Worker &worker);
+
+#ifdef MDU_GETDENTS
+/**
+ * stat_function() - Loop of a --stat-threads thread.
+ * Takes file batches off threadInfo.stat_queue and sleeps when the
+ * enumerating threads have none ready.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The stat thread's own state.
+ *
+ * Returns: Nothing.
+ *
+ */
+void stat_function(ThreadInfo &threadInfo, Worker &worker);
+
+/**
+ * push_stat_batch() - Hands a file batch to the stat threads.
+ * Stats it right away when the queue is full, so a slow stat stage
+ * holds the enumeration back instead of growing the queue.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The enumerating worker.
+ * @item: The batch node.
+ *
+ * Returns: 0 if successful, 1 if the batch was stat'ed here with an error.
+ *
+ */
+int push_stat_batch(ThreadInfo &threadInfo, Worker &worker, DirNode *item);
+#endif
+
+/**
+ * cpu_topology() - The CPUs this process may run on and their NUMA nodes.
+ * The nodes come from /sys/devices/system/node, a CPU missing there is
+ * taken to be on node 0.
+ *
+ * Returns: (cpu, node) pairs in CPU order, empty where it cannot tell.
+ *
+ */
+std::vector<std::pair<int, int> > cpu_topology();
+
+/**
+ * plan_placement() - Picks the CPU and node every thread is pinned to.
+ * Options::affinity hands out the CPUs in order. Options::numa takes
+ * the nodes in turn, so the threads are spread over all sockets, and
+ * the CPUs in order within each node.
+ *
+ * @options: Which of the two, if any.
+ * @count: Number of threads.
+ *
+ * Returns: (cpu, node) for every thread, (-1, -1) for one left unpinned.
+ *
+ */
+std::vector<std::pair<int, int> > plan_placement(const Options &options, int count);
+
+/**
+ * place_worker() - Sets the calling thread up as one of the workers.
+ * Pins it first, so with Options::numa the Worker it then creates is
+ * first touched, and thus allocated, on the thread's own node. Waits
+ * until every worker exists and orders its steal victims with the
+ * workers on the same node first.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @index: Index of the worker.
+ * @where: CPU and node from plan_placement().
+ *
+ * Returns: The worker.
+ *
+ */
+Worker &place_worker(ThreadInfo &threadInfo, int index, std::pair<int, int> where);
+
+/**
+ * tune_threads() - Loop of the -j auto tuner thread.
+ * Hill climbs on the entries per second of the active workers every
+ * 250 ms, stepping the active count up while throughput improves and
+ * back when it drops. When throughput stays flat, a rise in busy time
+ * per entry (the stat latency) turns it around too.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @pool: Number of workers started, the most that can be active.
+ *
+ * Returns: Nothing.
+ *
+ */
+void tune_threads(ThreadInfo &threadInfo, int pool);
+
+/**
+ * timed_lock() - Locks threadInfo.mutex from a worker.
+ * The time spent waiting is added to the worker's stats.
+ *
+ * @threadInfo: Struct containing information for the threads.
+ * @worker: The worker taking the lock.
+ *
+ * Returns: The held lock.
+ *
+ */
+std::unique_lock<std::mutex> timed_lock(ThreadInfo &threadInfo, Worker &worker);
+
+Scanner::Scanner(const Options &options) : m_info(std::make_unique<ThreadInfo>())
+{
+    ThreadInfo &threadInfo = *m_info;
+    threadInfo.options = options;
+    threadInfo.options.threads = std::max(1, options.threads);
+    threadInfo.track_sizes = options.max_depth >= 0 || (options.top > 0 && !options.top_files);
+    threadInfo.breakdown = options.by_owner || options.by_ext || options.histogram;
+    int threads = threadInfo.options.threads;
+    m_threads.reserve(threads + options.stat_threads); // Preallocate memory
+
+    if (options.max_queue_mem > 0)
+    {
+        // A queued directory costs its node, its name and a deque slot, split evenly between the workers
+        std::uint64_t per_worker = options.max_queue_mem / static_cast<std::uint64_t>(threads);
+        threadInfo.max_queued = std::max<std::int64_t>(64, static_cast<std::int64_t>(per_worker / (sizeof(DirNode) + 32)));
+    }
+
+    int stat_threads = 0;
+#ifdef MDU_GETDENTS
+    if (options.stat_threads > 0 && !options.io_uring)
+    {
+        stat_threads = options.stat_threads;
+        threadInfo.stat_queue = std::make_unique<MpmcRing<DirNode *> >(256);
+    }
+#endif
+
+    // One deque per thread, the stat threads come last and their deques just stay empty.
+    // With numa every thread creates its own, place_worker() keeps them from stealing until all exist
+    threadInfo.workers.resize(threads + stat_threads);
+    for (int t = 0; t < threads + stat_threads && !options.numa; ++t)
+    {
+        threadInfo.workers[t] = std::make_unique<Worker>();
+        threadInfo.workers[t]->id = t;
+    }
+#ifdef MDU_GETDENTS
+    // Needs the final number of workers to reserve their fds
+    set_handle_budget(threadInfo);
+#endif
+
+    if (options.auto_threads)
+    {
+        // Start from the core count, at least two so there is a direction to compare against
+        int cores = static_cast<int>(std::thread::hardware_concurrency());
+        threadInfo.active_limit.store(std::clamp(cores, 2, threads), std::memory_order_relaxed);
+    }
+
+    // With numa the workers only exist once their threads made them
+    if (options.inline_entries == 0 || options.numa)
+    {
+        start_threads();
+    }
+}
+
+void Scanner::start_threads()
+{
+    ThreadInfo &threadInfo = *m_info;
+    const Options &options = threadInfo.options;
+    int threads = options.threads;
+    int stat_threads = static_cast<int>(threadInfo.workers.size()) - threads;
+    std::vector<std::pair<int, int> > placement = plan_placement(options, threads + stat_threads);
+
+    // Create threads
+    for (int t = 0; t < threads; ++t)
+    {
+        m_threads.emplace_back([&threadInfo, t, where = placement[t]]() {
+            thread_function(threadInfo, place_worker(threadInfo, t, where));
+        });
+    }
+#ifdef MDU_GETDENTS
+    for (int t = threads; t < threads + stat_threads; ++t)
+    {
+        m_threads.emplace_back([&threadInfo, t, where = placement[t]]() {
+            stat_function(threadInfo, place_worker(threadInfo, t, where));
+        });
+    }
+#endif
+
+    // scan(), stats() and the tuner need every worker
+    int total = threads + stat_threads;
+    for (int placed = threadInfo.placed.load(); placed < total; placed = threadInfo.placed.load())
+    {
+        threadInfo.placed.wait(placed);
+    }
+    if (options.auto_threads)
+    {
+        m_tuner = std::thread([&threadInfo, threads]() { tune_threads(threadInfo, threads); });
+    }
+}
+
+Scanner::~Scanner()
+{
+    shutdown();
+}
+
+ScanResult Scanner::scan(const std::vector<std::string> &paths, const ScanCallbacks &callbacks, std::stop_token stop)
+{
+    namespace fs = std::filesystem;
+    using Clock = std::chrono::steady_clock;
+
+    std::lock_guard<std::mutex> scan_lock(m_scan_mutex);
+    ThreadInfo &threadInfo = *m_info;
+    auto start = Clock::now();
+
+    ScanResult result;
+    result.roots.resize(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        RootResult &root = result.roots[i];
+        root.index = static_cast<std::uint32_t>(i);
+        root.path = paths[i];
+        int code = size_root(root, threadInfo.options.apparent_size);
+        if (code != 0)
+        {
+            ScanError &error = result.errors.emplace_back();
+            error.operation = ScanError::Operation::stat;
+            error.root = root.index;
+            error.path = paths[i];
+            error.code = code;
+        }
+    }
+
+#ifdef MDU_GETDENTS
+    if (!threadInfo.options.cache_file.empty())
+    {
+        threadInfo.cache.open(threadInfo.options.cache_file.c_str());
+    }
+#endif
+
+    // The workers are all idle, nothing of theirs can be in use between scans
+    threadInfo.callbacks = &callbacks;
+    threadInfo.file_details = callbacks.on_file || (threadInfo.options.top > 0 && threadInfo.options.top_files) ||
+                              threadInfo.breakdown;
+    threadInfo.read_directory = select_kernel(threadInfo);
+    threadInfo.scan_time = std::chrono::duration_cast<std::chrono::seconds>(
+                               std::chrono::system_clock::now().time_since_epoch()).count();
+    threadInfo.cancelled.store(false, std::memory_order_relaxed);
+    // Only a path that could not be looked up has failed so far
+    threadInfo.error.store(result.errors.empty() ? 0 : 1, std::memory_order_relaxed);
+    threadInfo.inodes.clear();
+    std::uint64_t entries_before = 0;
+    for (auto &worker : threadInfo.workers)
+    {
+        worker->roots.assign(paths.size(), Counters{});
+        worker->names.resize(paths.size());
+        worker->errors.clear();
+        worker->errors_dropped = 0;
+#ifdef MDU_IO_URING
+        worker->ring_error = 0;
+        worker->prefetch_error = 0;
+#endif
+        worker->snapshot_records.clear();
+        worker->snapshot_names.clear();
+#ifdef MDU_GETDENTS
+        worker->cache_records.clear();
+        worker->cache_names.clear();
+#endif
+        entries_before += worker->done_entries.load(std::memory_order_relaxed);
+    }
+
+    // Seed every directory at once so the pool never drains between roots
+    std::vector<DirNode *> roots(paths.size(), nullptr);
+    std::size_t root_count = 0;
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        if (result.roots[i].directory)
+        {
+            // The paths outlive the scan, so a root can point straight at its own
+            roots[i] = new DirNode{};
+            roots[i]->name = paths[i].c_str();
+            roots[i]->name_len = paths[i].size();
+            roots[i]->root = static_cast<std::uint32_t>(i);
+            ++root_count;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(threadInfo.mutex);
+        threadInfo.root_done.assign(roots.size(), 0);
+        threadInfo.totals.assign(roots.size(), Counters{});
+        threadInfo.completed.clear();
+        for (DirNode *root : roots)
+        {
+            if (root != nullptr)
+            {
+                threadInfo.injected.push_back(root);
+            }
+        }
+        threadInfo.injected_count.store(threadInfo.injected.size(), std::memory_order_relaxed);
+    }
+    // Signal to threads that work is available, every root is work for one of them
+    threadInfo.wake_epoch.fetch_add(1, std::memory_order_seq_cst);
+    threadInfo.wake_epoch.notify_all();
+
+    // The workers only look at a flag, the token itself is the caller's
+    std::stop_callback on_stop(stop, [&threadInfo]() { threadInfo.cancelled.store(true, std::memory_order_relaxed); });
+
+    // Files are done already
+    for (const RootResult &root : result.roots)
+    {
+        if (!root.directory && callbacks.on_root)
+        {
+            callbacks.on_root(root);
+        }
+    }
+
+    // A small tree is done before the threads could even have started, a larger one goes on in the pool
+    if (m_threads.empty() && root_count > 0 &&
+        !read_inline(threadInfo, *threadInfo.workers[0], threadInfo.options.inline_entries))
+    {
+        start_threads();
+    }
+
+    auto report_progress = [&](std::size_t done) {
+        Progress progress;
+        for (const auto &worker : threadInfo.workers)
+        {
+            progress.entries += worker->done_entries.load(std::memory_order_relaxed);
+        }
+        progress.entries -= entries_before;
+        progress.roots_done = done;
+        progress.roots = root_count;
+        progress.elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        callbacks.on_progress(progress);
+    };
+
+    for (std::size_t done = 0; done < root_count; ++done)
+    {
+        std::unique_lock<std::mutex> lock(threadInfo.mutex);
+        auto ready = [&threadInfo]() { return !threadInfo.completed.empty(); };
+        if (callbacks.on_progress)
+        {
+            while (!threadInfo.threads_complete.wait_for(lock, callbacks.progress_interval, ready))
+            {
+                lock.unlock();
+                report_progress(done);
+                lock.lock();
+            }
+        }
+        else
+        {
+            threadInfo.threads_complete.wait(lock, ready);
+        }
+        std::uint32_t index = threadInfo.completed.front();
+        threadInfo.completed.pop_front();
+        lock.unlock();
+
+        complete_root(threadInfo, roots[index], result.roots[index]);
+        if (callbacks.on_root)
+        {
+            callbacks.on_root(result.roots[index]);
+        }
+    }
+    if (callbacks.on_progress)
+    {
+        report_progress(root_count);
+    }
+
+    // The last root completing was the last thing any worker did for this scan
+    threadInfo.callbacks = nullptr;
+    result.cancelled = threadInfo.cancelled.load(std::memory_order_relaxed);
+    if (threadInfo.options.top > 0)
+    {
+        result.top = merge_top(threadInfo);
+    }
+    if (threadInfo.breakdown)
+    {
+        result.breakdown = merge_breakdown(threadInfo);
+    }
+    for (auto &worker : threadInfo.workers)
+    {
+        std::move(worker->errors.begin(), worker->errors.end(), std::back_inserter(result.errors));
+        worker->errors.clear();
+        result.errors_dropped += worker->errors_dropped;
+#ifdef MDU_IO_URING
+        result.ring_error = result.ring_error != 0 ? result.ring_error : worker->ring_error;
+        result.prefetch_error = result.prefetch_error != 0 ? result.prefetch_error : worker->prefetch_error;
+#endif
+    }
+    std::sort(result.errors.begin(), result.errors.end(), [](const ScanError &a, const ScanError &b) {
+        return a.root != b.root ? a.root < b.root : a.path < b.path;
+    });
+#ifdef MDU_GETDENTS
+    // A cancelled scan did not see everything, the old file is still better
+    if (!threadInfo.options.cache_file.empty() && !result.cancelled)
+    {
+        if (int code = write_cache(threadInfo); code != 0)
+        {
+            ScanError &error = result.errors.emplace_back();
+            error.operation = ScanError::Operation::write_cache;
+            error.path = threadInfo.options.cache_file;
+            error.code = code;
+            threadInfo.error.store(1, std::memory_order_relaxed);
+        }
+    }
+#endif
+    if (!threadInfo.options.export_file.empty() && !result.cancelled)
+    {
+        if (int code = write_export(threadInfo); code != 0)
+        {
+            ScanError &error = result.errors.emplace_back();
+            error.operation = ScanError::Operation::write_snapshot;
+            error.path = threadInfo.options.export_file;
+            error.code = code;
+            threadInfo.error.store(1, std::memory_order_relaxed);
+        }
+    }
+    result.error = threadInfo.error.load(std::memory_order_relaxed);
+    return result;
+}
+
+void Scanner::shutdown()
+{
+    std::lock_guard<std::mutex> scan_lock(m_scan_mutex);
+    ThreadInfo &threadInfo = *m_info;
+
+    // Signal that there is no more work to do
+    {
+        std::lock_guard<std::mutex> lock(threadInfo.mutex);
+        threadInfo.no_more_work.store(true, std::memory_order_seq_cst);
+        threadInfo.tuned.notify_all();
+    }
+    threadInfo.wake_epoch.fetch_add(1, std::memory_order_seq_cst);
+    threadInfo.wake_epoch.notify_all();
+    threadInfo.stat_epoch.fetch_add(1, std::memory_order_seq_cst);
+    threadInfo.stat_epoch.notify_all();
+
+    // Wait for threads to finish
+    for (std::thread &th : m_threads)
+    {
+        th.join();
+    }
+    m_threads.clear();
+    if (m_tuner.joinable())
+    {
+        m_tuner.join();
+    }
+}
+
+ScanStats Scanner::stats() const
+{
+    const ThreadInfo &threadInfo = *m_info;
+    ScanStats stats;
+    for (const auto &worker : threadInfo.workers)
+    {
+        const WorkerStats &own = worker->stats;
+        WorkerStats &sum = stats.total;
+        sum.entries += own.entries;
+        sum.stat_calls += own.stat_calls;
+        sum.syscalls += own.syscalls;
+        sum.ring_ops += own.ring_ops;
+        sum.steals += own.steals;
+        sum.failed_steals += own.failed_steals;
+        sum.parks += own.parks;
+        sum.cache_hits += own.cache_hits;
+        sum.suspends += own.suspends;
+        sum.retries += own.retries;
+        sum.vanished += own.vanished;
+        sum.prefetches += own.prefetches;
+        sum.ring_failures += own.ring_failures;
+        sum.peak_depth = std::max(sum.peak_depth, own.peak_depth);
+        sum.busy += own.busy;
+        sum.idle += own.idle;
+        sum.lock_wait += own.lock_wait;
+
+        ThreadStats thread{worker->id, worker->cpu, worker->node, 0, own};
+        for (const Counters &root : worker->roots)
+        {
+            thread.dirs += root.dirs;
+        }
+        stats.threads.push_back(thread);
+    }
+    stats.active_threads = std::min(threadInfo.active_limit.load(std::memory_order_relaxed), threadInfo.options.threads);
+    return stats;
+}
+
+const Options &Scanner::options() const
+{
+    return m_info->options;
+}
+
+int size_root(RootResult &root, bool apparent_size)
+{
+    std::error_code ec;
+#if defined(MDU_GETDENTS) || defined(MDU_LSTAT)
+    struct stat st{};
+    if (stat(root.path.c_str(), &st) != 0)
+    {
+        ec.assign(errno, std::generic_category());
+    }
+    root.directory = !ec && S_ISDIR(st.st_mode);
+    if (!root.directory && !ec)
+    {
+        root.totals.files = 1;
+        root.totals.bytes = S_ISREG(st.st_mode) ? st.st_size : 0;
+        root.totals.blocks = st.st_blocks * 512;
+        root.size = apparent_size ? root.totals.bytes : root.totals.blocks;
+    }
+#else
+    namespace fs = std::filesystem;
+    fs::file_status status = fs::status(root.path, ec);
+    root.directory = !ec && fs::is_directory(status);
+    if (!root.directory && !ec)
+    {
+        // Only a regular file has a size to ask for, anything else takes no space of its own
+        root.size = fs::is_regular_file(status) ? fs::file_size(root.path, ec) : 0;
+        root.totals.files = 1;
+        root.totals.bytes = root.size;
+        root.totals.blocks = root.size;
+    }
+#endif
+    if (ec)
+    {
+        root.error = ec.value();
+        root.size = 0;
+        root.totals = Counters{};
+        root.totals.errors = 1;
+    }
+    return root.error;
+}
+
+void complete_root(ThreadInfo &threadInfo, DirNode *root, RootResult &result)
+{
+    std::uint32_t index = root->root;
+    {
+        std::lock_guard<std::mutex> lock(threadInfo.mutex);
+        result.totals = threadInfo.totals[index];
+        // Every directory of the root is done, so no worker still uses its names
+        for (auto &worker : threadInfo.workers)
+        {
+            worker->names[index].release(threadInfo.spare_chunks);
+        }
+    }
+    result.size = threadInfo.options.apparent_size ? result.totals.bytes : result.totals.blocks;
+    delete root;
+}
+
+DirNode *new_child(ThreadInfo &threadInfo, Worker &worker, DirNode &parent, const char *name, std::size_t length)
+{
+    auto *child = new DirNode{};
+    child->name = store_name(threadInfo, worker, parent.root, name, length);
+    child->name_len = length;
+    child->parent = &parent;
+#ifdef MDU_GETDENTS
+    if (!threadInfo.options.cache_file.empty())
+    {
+        worker.cache_names.insert(worker.cache_names.end(), name, name + length);
+        worker.cache_names.push_back('\0');
+    }
+#endif
+    child->root = parent.root;
+    child->depth = parent.depth + 1;
+
+    // Counted before it becomes visible so the parent cannot complete early
+    parent.pending.fetch_add(1, std::memory_order_relaxed);
+    return child;
+}
+
+const char *store_name(ThreadInfo &threadInfo, Worker &worker, std::uint32_t root, const char *name,
+                       std::size_t length)
+{
+    NameArena &arena = worker.names[root];
+    const char *copy = arena.copy(name, length);
+    if (copy != nullptr)
+    {
+        return copy;
+    }
+
+    std::unique_ptr<char[]> chunk;
+    {
+        std::unique_lock<std::mutex> lock = timed_lock(threadInfo, worker);
+        if (!threadInfo.spare_chunks.empty())
+        {
+            chunk = std::move(threadInfo.spare_chunks.back());
+            threadInfo.spare_chunks.pop_back();
+        }
+    }
+    if (chunk == nullptr)
+    {
+        chunk = std::make_unique_for_overwrite<char[]>(NameArena::chunk_size);
+    }
+    arena.add_chunk(std::move(chunk));
+    return arena.copy(name, length);
+}
+
+void build_path(const DirNode &node, std::string &out)
+{
+    // Only a root can end with '/', names from the directories never contain one
+    auto separated = [](const DirNode &n) {
+        return n.parent != nullptr && n.parent->name[n.parent->name_len - 1] != '/';
+    };
+
+    // Sized first and filled from the end, the nodes only link to their parents
+    std::size_t length = 0;
+    for (const DirNode *n = &node; n != nullptr; n = n->parent)
+    {
+        length += n->name_len + (separated(*n) ? 1 : 0);
+    }
+    out.resize(length);
+    for (const DirNode *n = &node; n != nullptr; n = n->parent)
+    {
+        length -= n->name_len;
+        std::memcpy(out.data() + length, n->name, n->name_len);
+        if (separated(*n))
+        {
+            out[--length] = '/';
+        }
+    }
+}
+
+std::string node_path(const DirNode &node, const char *name)
+{
+    std::string path;
+    build_path(node, path);
+    if (name != nullptr)
+    {
+        if (path.back() != '/')
+        {
+            path += '/';
+        }
+        path += name;
+    }
+    return path;
+}
+
+void finish_directory(ThreadInfo &threadInfo, Worker &worker, DirNode *node)
+{
+    while (node->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        DirNode *parent = node->parent;
+        if (parent == nullptr)
+        {
+            // Everything in the root happened before this point, so every worker's counters are final
+            Counters total;
+            for (const auto &worker : threadInfo.workers)
+            {
+                total += worker->roots[node->root];
+            }
+
+            // Last directory of the root, wake up the thread running the scan
+            std::unique_lock<std::mutex> lock = timed_lock(threadInfo, worker);
+            threadInfo.totals[node->root] = total;
+            threadInfo.root_done[node->root] = 1;
+            threadInfo.completed.push_back(node->root);
+            threadInfo.threads_complete.notify_one();
+            return;
+        }
+
+        if (threadInfo.track_sizes)
+        {
+            parent->size.fetch_add(node->size.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        if (node->batch != nullptr)
+        {
+            // Only a part of its parent, nothing to report
+            delete node->batch;
+        }
+        else
+        {
+            // The parents are still pending, so the whole path is alive
+            std::uint64_t size = node->size.load(std::memory_order_relaxed);
+            if (node->depth <= threadInfo.options.max_depth && threadInfo.callbacks->on_directory)
+            {
+                build_path(*node, worker.path);
+                DirectoryResult dir{node->root, worker.path, node->depth, size};
+                threadInfo.callbacks->on_directory(dir);
+            }
+            if (threadInfo.options.top > 0 && !threadInfo.options.top_files)
+            {
+                offer_top(threadInfo, worker, *node, nullptr, size);
+            }
+        }
+        delete node;
+        node = parent;
+    }
+}
+
+void abandon_directory(ThreadInfo &threadInfo, DirNode &node)
+{
+#ifdef MDU_GETDENTS
+    if (node.cursor != nullptr)
+    {
+        if (node.cursor->handle != nullptr)
+        {
+            // Queued subdirectories hold their own references
+            release_handle(threadInfo, node.cursor->handle);
+        }
+        else if (node.cursor->fd >= 0)
+        {
+            close(node.cursor->fd);
+            threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+        }
+        delete node.cursor;
+        node.cursor = nullptr;
+        // node.handle was already given back when the directory was opened
+        return;
+    }
+    if (node.fd >= 0)
+    {
+        close(node.fd);
+        threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+        node.fd = -1;
+    }
+    release_handle(threadInfo, node.handle);
+    node.handle = nullptr;
+#else
+    (void)threadInfo;
+    (void)node;
+#endif
+}
+
+void start_snapshot(Worker &worker, DirNode &node)
+{
+    // The worker's id on top keeps them unique without a shared counter
+    node.snapshot_id = (static_cast<std::uint64_t>(worker.id) << 48) | ++worker.snapshot_serial;
+}
+
+void record_snapshot(Worker &worker, const DirNode &dir, bool named, const Counters &before, const Counters &after)
+{
+    SnapshotRecord record{};
+    record.id = dir.snapshot_id;
+    record.parent = dir.parent != nullptr ? dir.parent->snapshot_id : 0;
+    record.root = dir.root;
+    record.named = named;
+    record.names_offset = worker.snapshot_names.size();
+    if (named)
+    {
+        worker.snapshot_names.insert(worker.snapshot_names.end(), dir.name, dir.name + dir.name_len);
+        record.names_size = dir.name_len;
+    }
+    record.files = after.files - before.files;
+    record.bytes = after.bytes - before.bytes;
+    record.blocks = after.blocks - before.blocks;
+    worker.snapshot_records.push_back(record);
+}
+
+int write_export(const ThreadInfo &threadInfo)
+{
+    std::vector<SnapshotEntry> entries;
+    for (const auto &worker : threadInfo.workers)
+    {
+        for (const SnapshotRecord &record : worker->snapshot_records)
+        {
+            std::string_view name(worker->snapshot_names.data() + record.names_offset, record.names_size);
+            entries.push_back(SnapshotEntry{record.id, record.parent, record.root, record.named, name, record.files,
+                                            record.bytes, record.blocks});
+        }
+    }
+    return write_snapshot(threadInfo.options.export_file, entries);
+}
+
+void record_error(const ThreadInfo &threadInfo, Worker &worker, const DirNode &dir, const char *name,
+                  ScanError::Operation operation, int code)
+{
+    if (worker.errors.size() >= threadInfo.options.max_errors)
+    {
+        ++worker.errors_dropped;
+        return;
+    }
+    ScanError &error = worker.errors.emplace_back();
+    error.operation = operation;
+    error.root = dir.root;
+    error.code = code;
+    build_path(dir, error.path);
+    if (name != nullptr)
+    {
+        if (error.path.back() != '/')
+        {
+            error.path += '/';
+        }
+        error.path += name;
+    }
+}
+
+template<typename Call>
+auto retry_transient(Worker &worker, Call call) -> decltype(call())
+{
+    return retry_transient(worker.retry_left, worker.stats.retries, call);
+}
+
+auto select_kernel(const ThreadInfo &threadInfo) -> int (*)(ThreadInfo &, Worker &, DirNode &)
+{
+    // Nothing but report_file() looks at which size it is, a scan that reports no files has one choice less
+    bool dedup = !threadInfo.options.count_links;
+    if (!threadInfo.file_details)
+    {
+        return dedup ? &add_directory<ScanKernel<true, false, false> > : &add_directory<ScanKernel<false, false, false> >;
+    }
+    if (threadInfo.options.apparent_size)
+    {
+        return dedup ? &add_directory<ScanKernel<true, true, true> > : &add_directory<ScanKernel<false, true, true> >;
+    }
+    return dedup ? &add_directory<ScanKernel<true, true, false> > : &add_directory<ScanKernel<false, true, false> >;
+}
+
+template<typename Kernel>
+void report_file(const ThreadInfo &threadInfo, Worker &worker, const DirNode &dir, const char *name,
+                 const FileStat &file)
+{
+    if constexpr (!Kernel::report)
+    {
+        return;
+    }
+    const ScanCallbacks &callbacks = *threadInfo.callbacks;
+    std::uint64_t size = Kernel::apparent ? file.bytes : file.blocks;
+    if (callbacks.on_file)
+    {
+        std::string path = node_path(dir, name);
+        callbacks.on_file(FileResult{dir.root, path, size, file.bytes, file.blocks, file.dev, file.ino, file.links});
+    }
+    if (threadInfo.options.top > 0 && threadInfo.options.top_files)
+    {
+        offer_top(threadInfo, worker, dir, name, size);
+    }
+    if (threadInfo.breakdown)
+    {
+        count_breakdown(threadInfo, worker, name, file, size);
+    }
+}
+
+void count_breakdown(const ThreadInfo &threadInfo, Worker &worker, const char *name, const FileStat &file,
+                     std::uint64_t size)
+{
+    WorkerBreakdown &tables = worker.breakdown;
+    auto add = [size](Aggregate &row) {
+        ++row.files;
+        row.size += size;
+    };
+
+    if (threadInfo.options.by_owner && file.have_owner)
+    {
+        add(tables.uids[file.uid]);
+        add(tables.gids[file.gid]);
+    }
+    if (threadInfo.options.by_ext)
+    {
+        // A leading dot makes a hidden file, not an extension
+        const char *dot = std::strrchr(name, '.');
+        std::string_view extension = dot != nullptr && dot != name ? std::string_view(dot + 1) : std::string_view();
+        auto row = tables.extensions.find(extension);
+        if (row == tables.extensions.end())
+        {
+            row = tables.extensions.emplace(std::string(extension), Aggregate{}).first;
+        }
+        add(row->second);
+    }
+    if (threadInfo.options.histogram)
+    {
+        add(tables.sizes[std::bit_width(file.bytes)]);
+        if (file.have_owner)
+        {
+            // Modified in the future counts as new
+            std::int64_t age = threadInfo.scan_time - file.mtime;
+            std::size_t bucket = 0;
+            while (bucket < Breakdown::age_days.size() &&
+                   age >= static_cast<std::int64_t>(Breakdown::age_days[bucket]) * 86400)
+            {
+                ++bucket;
+            }
+            add(tables.ages[bucket]);
+        }
+    }
+}
+
+Breakdown merge_breakdown(ThreadInfo &threadInfo)
+{
+    Breakdown breakdown;
+    WorkerBreakdown sum;
+    auto add = [](Aggregate &to, const Aggregate &from) {
+        to.files += from.files;
+        to.size += from.size;
+    };
+    for (auto &worker : threadInfo.workers)
+    {
+        WorkerBreakdown &tables = worker->breakdown;
+        for (const auto &[uid, row] : tables.uids)
+        {
+            add(sum.uids[uid], row);
+        }
+        for (const auto &[gid, row] : tables.gids)
+        {
+            add(sum.gids[gid], row);
+        }
+        for (const auto &[extension, row] : tables.extensions)
+        {
+            add(sum.extensions[extension], row);
+        }
+        for (std::size_t b = 0; b < tables.sizes.size(); ++b)
+        {
+            add(breakdown.sizes[b], tables.sizes[b]);
+        }
+        for (std::size_t b = 0; b < tables.ages.size(); ++b)
+        {
+            add(breakdown.ages[b], tables.ages[b]);
+        }
+        tables = WorkerBreakdown{};
+    }
+
+    auto largest = [](const auto &a, const auto &b) {
+        return a.second.size != b.second.size ? a.second.size > b.second.size : a.first < b.first;
+    };
+    breakdown.uids.assign(sum.uids.begin(), sum.uids.end());
+    std::sort(breakdown.uids.begin(), breakdown.uids.end(), largest);
+    breakdown.gids.assign(sum.gids.begin(), sum.gids.end());
+    std::sort(breakdown.gids.begin(), breakdown.gids.end(), largest);
+    breakdown.extensions.assign(sum.extensions.begin(), sum.extensions.end());
+    std::sort(breakdown.extensions.begin(), breakdown.extensions.end(), largest);
+    return breakdown;
+}
+
+void offer_top(const ThreadInfo &threadInfo, Worker &worker, const DirNode &dir, const char *name, std::uint64_t size)
+{
+    std::vector<TopEntry> &top = worker.top;
+    auto larger = [](const TopEntry &a, const TopEntry &b) { return a.size > b.size; };
+    if (top.size() == threadInfo.options.top)
+    {
+        if (size <= top.front().size)
+        {
+            return;
+        }
+        // The smallest makes room, its path string is reused
+        std::pop_heap(top.begin(), top.end(), larger);
+    }
+    else
+    {
+        top.emplace_back();
+    }
+
+    TopEntry &entry = top.back();
+    entry.size = size;
+    entry.root = dir.root;
+    build_path(dir, entry.path);
+    if (name != nullptr)
+    {
+        if (entry.path.back() != '/')
+        {
+            entry.path += '/';
+        }
+        entry.path += name;
+    }
+    std::push_heap(top.begin(), top.end(), larger);
+}
+
+std::vector<TopEntry> merge_top(ThreadInfo &threadInfo)
+{
+    std::vector<TopEntry> top;
+    for (auto &worker : threadInfo.workers)
+    {
+        std::move(worker->top.begin(), worker->top.end(), std::back_inserter(top));
+        worker->top.clear();
+    }
+    std::size_t count = std::min(top.size(), threadInfo.options.top);
+    std::partial_sort(top.begin(), top.begin() + count, top.end(),
+                      [](const TopEntry &a, const TopEntry &b) { return a.size > b.size; });
+    top.resize(count);
+    return top;
+}
+
+void push_directory(ThreadInfo &threadInfo, Worker &worker, DirNode *item)
+{
+    worker.deque.push(item);
+    worker.stats.peak_depth = std::max(worker.stats.peak_depth, worker.deque.size());
+
+    // Pairs with the fence in thread_function, either we see the sleeper or it sees the item.
+    // A searching thread is about to find the item itself and wakes the next one if it does
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (threadInfo.searching.load(std::memory_order_relaxed) == 0)
+    {
+        wake_worker(threadInfo);
+    }
+}
+
+void wake_worker(ThreadInfo &threadInfo)
+{
+    if (threadInfo.idle.load(std::memory_order_relaxed) > 0)
+    {
+        threadInfo.wake_epoch.fetch_add(1, std::memory_order_seq_cst);
+        threadInfo.wake_epoch.notify_one();
+    }
+}
+
+#ifdef MDU_GETDENTS
+int push_stat_batch(ThreadInfo &threadInfo, Worker &worker, DirNode *item)
+{
+    if (!threadInfo.stat_queue->push(item))
+    {
+        // The stat threads are behind, help them out rather than wait
+        const Counters &counters = worker.roots[item->root];
+        const Counters before = counters;
+        int error = threadInfo.read_directory(threadInfo, worker, *item);
+        worker.inline_batches.files += counters.files - before.files;
+        worker.inline_batches.bytes += counters.bytes - before.bytes;
+        worker.inline_batches.blocks += counters.blocks - before.blocks;
+        finish_directory(threadInfo, worker, item);
+        return error;
+    }
+
+    // Pairs with the fence in stat_function, like push_directory
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (threadInfo.stat_idle.load(std::memory_order_relaxed) > 0)
+    {
+        threadInfo.stat_epoch.fetch_add(1, std::memory_order_seq_cst);
+        threadInfo.stat_epoch.notify_one();
+    }
+    return 0;
+}
+#endif
+
+std::unique_lock<std::mutex> timed_lock(ThreadInfo &threadInfo, Worker &worker)
+{
+    std::unique_lock<std::mutex> lock(threadInfo.mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        // Only pay for the clock when there actually is contention
+        auto start = std::chrono::steady_clock::now();
+        lock.lock();
+        worker.stats.lock_wait += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return lock;
+}
+
+DirNode *find_work(ThreadInfo &threadInfo, Worker &worker)
+{
+#ifdef MDU_IO_URING
+    if (worker.prefetching > 0)
+    {
+        // Opens that completed while the last directory was read, and submits the ones it prepared
+        reap_prefetch(threadInfo, worker, 0);
+    }
+#endif
+
+    // Breadth first takes the oldest the way a thief would, losing that race still leaves the newest
+    DirNode *item = nullptr;
+    const Options &options = threadInfo.options;
+    bool oldest = options.order == Order::bfs ||
+                  (options.order == Order::hybrid && worker.last_depth < options.bfs_levels);
+    if ((oldest && worker.deque.steal(item)) || worker.deque.pop(item))
+    {
+        return item;
+    }
+
+#ifdef MDU_IO_URING
+    // Its own subdirectories are still being opened, wait for one rather than take other work
+    if (worker.prefetching > 0)
+    {
+        reap_prefetch(threadInfo, worker, 1);
+        if (worker.deque.pop(item))
+        {
+            return item;
+        }
+    }
+#endif
+
+    // The subdirectories of a set aside directory are done, read some more of it
+    if (!worker.suspended.empty())
+    {
+        item = worker.suspended.back();
+        worker.suspended.pop_back();
+        return item;
+    }
+
+    // Steal from the other workers, in the order place_worker() picked
+    for (Worker *other : worker.victims)
+    {
+        Worker &victim = *other;
+        if (victim.deque.empty())
+        {
+            continue;
+        }
+        if (victim.deque.steal(item))
+        {
+            ++worker.stats.steals;
+            return item;
+        }
+        ++worker.stats.failed_steals;
+    }
+
+    // Nothing to read, help the stat threads instead
+    if (threadInfo.stat_queue != nullptr && threadInfo.stat_queue->pop(item))
+    {
+        return item;
+    }
+
+    if (threadInfo.injected_count.load(std::memory_order_relaxed) == 0)
+    {
+        return nullptr;
+    }
+    std::unique_lock<std::mutex> lock = timed_lock(threadInfo, worker);
+    if (!threadInfo.injected.empty())
+    {
+        item = threadInfo.injected.front();
+        threadInfo.injected.pop_front();
+        threadInfo.injected_count.store(threadInfo.injected.size(), std::memory_order_relaxed);
+        return item;
+    }
+    return nullptr;
+}
+
+void run_directory(ThreadInfo &threadInfo, Worker &worker, DirNode *item)
+{
+    worker.last_depth = item->depth;
+
+    int error = 0;
+    if (threadInfo.cancelled.load(std::memory_order_relaxed))
+    {
+        // Only drained, so the roots still complete and the scan can return
+        abandon_directory(threadInfo, *item);
+    }
+    else
+    {
+        error = threadInfo.read_directory(threadInfo, worker, *item);
+    }
+
+    if (error == 1)
+    {
+        threadInfo.error.store(error, std::memory_order_relaxed);
+    }
+
+    if (item->cursor != nullptr)
+    {
+        // Only partly read, it is not done before the rest of it is
+        worker.suspended.push_back(item);
+    }
+    else
+    {
+        finish_directory(threadInfo, worker, item);
+    }
+}
+
+bool read_inline(ThreadInfo &threadInfo, Worker &worker, std::uint64_t budget)
+{
+    using Clock = std::chrono::steady_clock;
+    auto busy_since = Clock::now();
+    std::uint64_t stop_at = worker.stats.entries + budget;
+    bool done = false;
+    while (!done && worker.stats.entries < stop_at)
+    {
+        // No other worker runs yet, so nothing found means nothing is left
+        DirNode *item = find_work(threadInfo, worker);
+        done = item == nullptr;
+        if (!done)
+        {
+            run_directory(threadInfo, worker, item);
+        }
+    }
+    worker.stats.busy += std::chrono::duration<double>(Clock::now() - busy_since).count();
+    worker.done_entries.store(worker.stats.entries, std::memory_order_relaxed);
+    return done;
+}
+
+void thread_function(ThreadInfo &threadInfo, Worker &worker)
+{
+    using Clock = std::chrono::steady_clock;
+    using Second = std::chrono::duration<double>;
+    auto idle_since = Clock::now();
+    // Counted in threadInfo.searching, pushers leave the wakeups to us
+    bool searching = false;
+
+    while (true)
+    {
+        // Parked by the tuner. Its deque can still be stolen from, set aside or prefetching directories cannot
+        if (worker.id >= threadInfo.active_limit.load(std::memory_order_relaxed) && worker.suspended.empty() &&
+            worker.prefetching == 0)
+        {
+            if (searching)
+            {
+                searching = false;
+                if (threadInfo.searching.fetch_sub(1, std::memory_order_seq_cst) == 1)
+                {
+                    wake_worker(threadInfo);
+                }
+            }
+            std::unique_lock<std::mutex> lock = timed_lock(threadInfo, worker);
+            ++worker.stats.parks;
+            threadInfo.tuned.wait(lock, [&threadInfo, &worker]() {
+                return threadInfo.no_more_work ||
+                       worker.id < threadInfo.active_limit.load(std::memory_order_relaxed);
+            });
+            if (threadInfo.no_more_work)
+            {
+                worker.stats.idle += Second(Clock::now() - idle_since).count();
+                return;
+            }
+            continue;
+        }
+
+        DirNode *item = find_work(threadInfo, worker);
+
+        if (item == nullptr)
+        {
+            if (!searching)
+            {
+                searching = true;
+                threadInfo.searching.fetch_add(1, std::memory_order_seq_cst);
+            }
+            // Spin a little before sleeping, the other threads are likely about to push
+            for (int spin = 0; spin < 64 && item == nullptr; ++spin)
+            {
+                std::this_thread::yield();
+                item = find_work(threadInfo, worker);
+            }
+        }
+
+        if (item != nullptr && searching)
+        {
+            // The last searcher hands the search over, there may be more work than it took
+            searching = false;
+            if (threadInfo.searching.fetch_sub(1, std::memory_order_seq_cst) == 1)
+            {
+                wake_worker(threadInfo);
+            }
+        }
+
+        if (item == nullptr)
+        {
+            ++worker.stats.parks;
+            std::uint32_t epoch = threadInfo.wake_epoch.load(std::memory_order_seq_cst);
+            // Idle before not searching, a pusher never sees this thread as neither
+            threadInfo.idle.fetch_add(1, std::memory_order_seq_cst);
+            searching = false;
+            threadInfo.searching.fetch_sub(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            // Check if any deque got work while we were registering as idle
+            bool has_work = threadInfo.injected_count.load(std::memory_order_relaxed) != 0 ||
+                            (threadInfo.stat_queue != nullptr && !threadInfo.stat_queue->empty());
+            for (const auto &other : threadInfo.workers)
+            {
+                has_work = has_work || !other->deque.empty();
+            }
+
+            if (!has_work && !threadInfo.no_more_work.load(std::memory_order_relaxed))
+            {
+                threadInfo.wake_epoch.wait(epoch, std::memory_order_seq_cst);
+            }
+            threadInfo.idle.fetch_sub(1, std::memory_order_relaxed);
+
+            if (threadInfo.no_more_work.load(std::memory_order_relaxed))
+            {
+                worker.stats.idle += Second(Clock::now() - idle_since).count();
+                return;
+            }
+            // Woken for work, count as searching so the pushers do not wake a second thread for it
+            searching = true;
+            threadInfo.searching.fetch_add(1, std::memory_order_seq_cst);
+            continue;
+        }
+
+        auto busy_since = Clock::now();
+        worker.stats.idle += Second(busy_since - idle_since).count();
+        run_directory(threadInfo, worker, item);
+
+        idle_since = Clock::now();
+        worker.stats.busy += Second(idle_since - busy_since).count();
+        worker.done_entries.store(worker.stats.entries, std::memory_order_relaxed);
+        worker.busy_ns.store(static_cast<std::uint64_t>(worker.stats.busy * 1e9), std::memory_order_relaxed);
+    }
+}
+
+#ifdef MDU_GETDENTS
+void stat_function(ThreadInfo &threadInfo, Worker &worker)
+{
+    using Clock = std::chrono::steady_clock;
+    using Second = std::chrono::duration<double>;
+    auto idle_since = Clock::now();
+
+    while (true)
+    {
+        DirNode *item = nullptr;
+        bool found = threadInfo.stat_queue->pop(item);
+        for (int spin = 0; spin < 64 && !found; ++spin)
+        {
+            std::this_thread::yield();
+            found = threadInfo.stat_queue->pop(item);
+        }
+
+        if (!found)
+        {
+            ++worker.stats.parks;
+            std::uint32_t epoch = threadInfo.stat_epoch.load(std::memory_order_seq_cst);
+            threadInfo.stat_idle.fetch_add(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (threadInfo.stat_queue->empty() && !threadInfo.no_more_work.load(std::memory_order_relaxed))
+            {
+                threadInfo.stat_epoch.wait(epoch, std::memory_order_seq_cst);
+            }
+            threadInfo.stat_idle.fetch_sub(1, std::memory_order_relaxed);
+
+            if (threadInfo.no_more_work.load(std::memory_order_relaxed))
+            {
+                worker.stats.idle += Second(Clock::now() - idle_since).count();
+                return;
+            }
+            continue;
+        }
+
+        auto busy_since = Clock::now();
+        worker.stats.idle += Second(busy_since - idle_since).count();
+
+        if (threadInfo.cancelled.load(std::memory_order_relaxed))
+        {
+            abandon_directory(threadInfo, *item);
+        }
+        else if (threadInfo.read_directory(threadInfo, worker, *item) == 1)
+        {
+            threadInfo.error.store(1, std::memory_order_relaxed);
+        }
+        finish_directory(threadInfo, worker, item);
+
+        idle_since = Clock::now();
+        worker.stats.busy += Second(idle_since - busy_since).count();
+    }
+}
+#endif
+
+#ifdef MDU_GETDENTS
+void set_handle_budget(ThreadInfo &threadInfo)
+{
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // Every thread needs one fd for the directory it is reading, plus stdio and some slack
+    rlim_t reserve = threadInfo.workers.size() + 64;
+    rlim_t budget = limit.rlim_cur > reserve * 2 ? limit.rlim_cur - reserve : limit.rlim_cur / 2;
+    threadInfo.max_handles = static_cast<int>(std::min<rlim_t>(budget, 1 << 20));
+}
+
+void release_handle(ThreadInfo &threadInfo, DirHandle *handle)
+{
+    if (handle != nullptr && handle->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        close(handle->fd);
+        delete handle;
+        threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+template<typename Kernel>
+int stat_entry(ThreadInfo &threadInfo, Worker &worker, const DirNode &dir, int fd, const char *name,
+               Counters &counters)
+{
+    struct stat st{};
+    ++worker.stats.stat_calls;
+    int result = retry_transient(worker, [&]() {
+        ++worker.stats.syscalls;
+        return fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW);
+    });
+    if (result != 0)
+    {
+        if (errno == ENOENT)
+        {
+            // Deleted since the directory was read, there is nothing left to count
+            ++worker.stats.vanished;
+            return 0;
+        }
+        record_error(threadInfo, worker, dir, name, ScanError::Operation::stat, errno);
+        ++counters.errors;
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        return 1;
+    }
+
+    if (st.st_nlink > 1)
+    {
+        ++counters.linked;
+        if (Kernel::dedup && !threadInfo.inodes.insert(dir.root, st.st_dev, st.st_ino))
+        {
+            // Another link to this file was already counted
+            return 0;
+        }
+    }
+    ++counters.files;
+    counters.bytes += st.st_size;
+    counters.blocks += st.st_blocks * 512;
+    FileStat file{static_cast<std::uint64_t>(st.st_size), static_cast<std::uint64_t>(st.st_blocks) * 512, true,
+                  st.st_uid, st.st_gid, st.st_mtime, st.st_dev, st.st_ino, st.st_nlink};
+    report_file<Kernel>(threadInfo, worker, dir, name, file);
+    return 0;
+}
+
+template<typename Kernel>
+int stat_batch(ThreadInfo &threadInfo, Worker &worker, DirNode &node)
+{
+    int error = 0;
+    worker.retry_left = retry_budget;
+    Counters &counters = worker.roots[node.root];
+    const Counters before = counters;
+    const std::vector<char> &names = node.batch->names;
+    for (std::size_t offset = 0; offset < names.size();)
+    {
+        const char *name = names.data() + offset;
+        offset += std::strlen(name) + 1;
+        // Was not a directory when it was read, one that appeared since is left for the next scan
+        if (stat_entry<Kernel>(threadInfo, worker, *node.parent, node.handle->fd, name, counters) < 0)
+        {
+            error = 1;
+        }
+    }
+    release_handle(threadInfo, node.handle);
+    node.handle = nullptr;
+    if (!threadInfo.options.export_file.empty())
+    {
+        record_snapshot(worker, *node.parent, false, before, counters);
+    }
+
+    if (threadInfo.track_sizes)
+    {
+        std::uint64_t size = threadInfo.options.apparent_size ? counters.bytes - before.bytes
+                                                              : counters.blocks - before.blocks;
+        node.size.fetch_add(size, std::memory_order_relaxed);
+    }
+    return error;
+}
+
+int write_cache(const ThreadInfo &threadInfo)
+{
+    struct Entry
+    {
+        const CacheRecord *record;
+        const char *names;
+    };
+
+    std::vector<Entry> entries;
+    for (const auto &worker : threadInfo.workers)
+    {
+        for (const CacheRecord &record : worker->cache_records)
+        {
+            entries.push_back({&record, worker->cache_names.data() + record.names_offset});
+        }
+    }
+    auto key = [](const Entry &entry) { return std::pair(entry.record->dev, entry.record->ino); };
+    std::sort(entries.begin(), entries.end(), [&key](const Entry &a, const Entry &b) { return key(a) < key(b); });
+    // A directory reached through two roots is only stored once
+    entries.erase(std::unique(entries.begin(), entries.end(),
+                              [&key](const Entry &a, const Entry &b) { return key(a) == key(b); }),
+                  entries.end());
+
+    CacheHeader header{};
+    std::memcpy(header.magic, ScanCache::magic, sizeof(header.magic));
+    header.version = ScanCache::version;
+    header.record_size = sizeof(CacheRecord);
+    header.record_count = entries.size();
+    for (const Entry &entry : entries)
+    {
+        header.names_size += entry.record->names_size;
+    }
+
+    const std::string &path = threadInfo.options.cache_file;
+    std::string tmp = path + ".tmp";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    std::uint64_t offset = 0;
+    for (const Entry &entry : entries)
+    {
+        CacheRecord record = *entry.record;
+        record.names_offset = offset;
+        offset += record.names_size;
+        out.write(reinterpret_cast<const char *>(&record), sizeof(record));
+    }
+    for (const Entry &entry : entries)
+    {
+        out.write(entry.names, static_cast<std::streamsize>(entry.record->names_size));
+    }
+    out.close();
+
+    if (!out || std::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        int code = errno != 0 ? errno : EIO;
+        std::remove(tmp.c_str());
+        return code;
+    }
+    return 0;
+}
+
+template<typename Kernel>
+int add_directory(ThreadInfo &threadInfo, Worker &worker, DirNode &node)
+{
+    constexpr int open_flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    int error = 0;
+    Counters &counters = worker.roots[node.root];
+    const Counters before = counters;
+
+    if (node.batch != nullptr)
+    {
+        return stat_batch<Kernel>(threadInfo, worker, node);
+    }
+    worker.retry_left = retry_budget;
+    worker.inline_batches = Counters{};
+
+    WorkerStats &stats = worker.stats;
+    // Shared with the subdirectories once the first one is found, if the fd budget allows it
+    DirHandle *handle = nullptr;
+    bool share_fd = true;
+
+    // A directory that cannot be opened still takes space like du counts it, only search permission is needed
+    struct stat own_st{};
+    bool have_own = false;
+    auto stat_unopened = [&](int dirfd, const char *name) {
+        int code = errno;
+        if (code != ENOENT && code != ESTALE)
+        {
+            ++stats.stat_calls;
+            ++stats.syscalls;
+            have_own = fstatat(dirfd, name, &own_st, AT_SYMLINK_NOFOLLOW) == 0;
+        }
+        errno = code;
+    };
+
+    DirCursor *cursor = node.cursor;
+    bool resumed = cursor != nullptr;
+    node.cursor = nullptr;
+    int fd = node.fd;
+    if (resumed)
+    {
+        // Set aside under --max-queue-mem, continue where the last getdents64 call stopped
+        fd = cursor->fd;
+        handle = cursor->handle;
+        share_fd = cursor->share_fd;
+        if (fd >= 0 && handle == nullptr)
+        {
+            // Counted while it was set aside, the handle counts it otherwise
+            threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+        }
+        else if (fd < 0)
+        {
+            build_path(node, worker.path);
+            fd = open(worker.path.c_str(), open_flags);
+            stats.syscalls += 2;
+            if (fd >= 0 && lseek(fd, cursor->offset, SEEK_SET) < 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        delete cursor;
+    }
+    else if (fd >= 0)
+    {
+        // Opened ahead by the io_uring engine, the fd now belongs to this call
+        threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        bool by_path = node.handle == nullptr;
+        if (!by_path)
+        {
+            int parent = node.handle->fd;
+            fd = retry_transient(worker, [&]() {
+                ++stats.syscalls;
+                return openat(parent, node.name, open_flags);
+            });
+            // The parent's own handle went stale, the whole path may still be found again
+            by_path = fd < 0 && errno == ESTALE;
+            if (fd < 0)
+            {
+                stat_unopened(parent, node.name);
+            }
+            int code = errno;
+            release_handle(threadInfo, node.handle);
+            node.handle = nullptr;
+            errno = code;
+        }
+        if (by_path)
+        {
+            build_path(node, worker.path);
+            fd = retry_transient(worker, [&]() {
+                ++stats.syscalls;
+                return open(worker.path.c_str(), open_flags);
+            });
+            if (fd < 0)
+            {
+                stat_unopened(AT_FDCWD, worker.path.c_str());
+            }
+        }
+    }
+
+    if (fd < 0)
+    {
+        if (errno == ENOENT && node.parent != nullptr)
+        {
+            // Deleted since its parent was read
+            ++stats.vanished;
+            return 0;
+        }
+        int code = errno;
+        if (have_own)
+        {
+            ++counters.dirs;
+            counters.bytes += own_st.st_size;
+            counters.blocks += own_st.st_blocks * 512;
+            if (threadInfo.track_sizes)
+            {
+                node.size.fetch_add(threadInfo.options.apparent_size ? own_st.st_size : own_st.st_blocks * 512,
+                                    std::memory_order_relaxed);
+            }
+            // The snapshot lists it with its own size, so it agrees with the scan
+            if (!threadInfo.options.export_file.empty())
+            {
+                start_snapshot(worker, node);
+                record_snapshot(worker, node, true, before, counters);
+            }
+        }
+        record_error(threadInfo, worker, node, nullptr, ScanError::Operation::read_directory, code);
+        ++counters.errors;
+        return 1;
+    }
+
+    // The directory itself takes space too, like du counts it
+    struct stat dir_st{};
+    bool have_stat = false;
+    if (!resumed)
+    {
+        if (!threadInfo.options.export_file.empty())
+        {
+            start_snapshot(worker, node);
+        }
+        ++counters.dirs;
+        ++stats.stat_calls;
+        ++stats.syscalls;
+        have_stat = fstat(fd, &dir_st) == 0;
+        if (have_stat)
+        {
+            counters.bytes += dir_st.st_size;
+            counters.blocks += dir_st.st_blocks * 512;
+        }
+        if (threadInfo.callbacks->on_open)
+        {
+            std::string path = node_path(node);
+            threadInfo.callbacks->on_open(OpenedDirectory{node.root, path, node.depth, fd});
+        }
+    }
+
+    // What was counted from here on is the directory's own entries, which is what the cache keeps.
+    // A directory read in several goes is never cached, none of its passes sees all of it
+    // A scan that has to see every file does not take its entries from the cache, it still writes one
+
+    const Counters own = counters;
+    const std::size_t names_start = worker.cache_names.size();
+    const CacheRecord *cached = have_stat && !threadInfo.file_details ? threadInfo.cache.find(dir_st) : nullptr;
+
+    if (worker.dirents.empty())
+    {
+        worker.dirents.resize(128 * 1024);
+    }
+
+#ifdef MDU_IO_URING
+    bool use_ring = threadInfo.options.io_uring && start_ring(worker);
+    bool prefetch = threadInfo.options.prefetch > 0 && start_prefetch(threadInfo, worker);
+#endif
+
+    auto share_handle = [&]() {
+        if (handle == nullptr && share_fd)
+        {
+            if (threadInfo.open_handles.fetch_add(1, std::memory_order_relaxed) < threadInfo.max_handles)
+            {
+                handle = new DirHandle{fd};
+            }
+            else
+            {
+                // Out of fds, the subdirectories will be opened by path instead
+                threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+                share_fd = false;
+            }
+        }
+        return handle != nullptr;
+    };
+
+    auto queue_child = [&](const char *name, std::size_t length) {
+        DirNode *child = new_child(threadInfo, worker, node, name, length);
+        if (share_handle())
+        {
+            handle->refs.fetch_add(1, std::memory_order_relaxed);
+            child->handle = handle;
+#ifdef MDU_IO_URING
+            if (prefetch && prefetch_directory(threadInfo, worker, child))
+            {
+                return;
+            }
+#endif
+        }
+        push_directory(threadInfo, worker, child);
+    };
+
+    // Past split_threshold entries the files go out in batches for the idle workers to stat
+    constexpr std::size_t batch_entries = 1024;
+    StatBatch *batch = nullptr;
+    bool split = false;
+    std::int64_t seen = 0;
+    auto queue_batch = [&]() {
+        auto *item = new DirNode{};
+        item->parent = &node;
+        item->root = node.root;
+        item->depth = node.depth + 1;
+        item->batch = batch;
+        handle->refs.fetch_add(1, std::memory_order_relaxed);
+        item->handle = handle;
+        node.pending.fetch_add(1, std::memory_order_relaxed);
+        if (threadInfo.stat_queue != nullptr)
+        {
+            error |= push_stat_batch(threadInfo, worker, item);
+        }
+        else
+        {
+            push_directory(threadInfo, worker, item);
+        }
+        batch = nullptr;
+        split = true;
+    };
+
+    if (cached != nullptr)
+    {
+        // Unchanged since the last run, only the subdirectories need a look
+        ++stats.cache_hits;
+        counters.files += cached->files;
+        counters.bytes += cached->bytes;
+        counters.blocks += cached->blocks;
+        const char *names = threadInfo.cache.names(*cached);
+        for (std::uint64_t offset = 0; offset < cached->names_size;)
+        {
+            std::size_t length = std::strlen(names + offset);
+            queue_child(names + offset, length);
+            offset += length + 1;
+        }
+    }
+
+    bool suspend = false;
+    // A short read means the directory is most likely done, only a full buffer is worth setting aside for
+    long last_read = 0;
+    std::size_t full_read = worker.dirents.size() - 2 * sizeof(dirent64);
+    while (cached == nullptr)
+    {
+        // Over the queue budget, the subdirectories go first and the rest of this one waits
+        if (static_cast<std::size_t>(last_read) >= full_read && threadInfo.max_queued > 0 &&
+            worker.deque.size() > threadInfo.max_queued)
+        {
+            suspend = true;
+            break;
+        }
+
+        if (threadInfo.cancelled.load(std::memory_order_relaxed))
+        {
+            break;
+        }
+
+        // A failed call does not move the position, so retrying it cannot skip or repeat entries
+        long nread = retry_transient(worker, [&]() {
+            ++stats.syscalls;
+            return syscall(SYS_getdents64, fd, worker.dirents.data(), worker.dirents.size());
+        });
+        if (nread < 0 && errno == ENOENT)
+        {
+            // Removed while it was being read, what was read so far still counts
+            ++stats.vanished;
+            break;
+        }
+        if (nread < 0)
+        {
+            record_error(threadInfo, worker, node, nullptr, ScanError::Operation::read_directory, errno);
+            ++counters.errors;
+            error = 1;
+            break;
+        }
+        if (nread == 0)
+        {
+            break;
+        }
+        last_read = nread;
+
+#ifdef MDU_IO_URING
+        if (use_ring)
+        {
+            error |= stat_entries_uring<Kernel>(threadInfo, worker, node, fd, nread, counters);
+            // Dropped if it failed, the rest is read the plain way
+            use_ring = worker.ring != nullptr;
+            continue;
+        }
+#endif
+
+        // The pipeline sends every file to the stat threads
+        bool split_now = (threadInfo.stat_queue != nullptr ||
+                          (threadInfo.options.split_threshold > 0 && threadInfo.workers.size() > 1 &&
+                           (resumed || seen >= threadInfo.options.split_threshold))) &&
+                         share_handle();
+        for (long offset = 0; offset < nread;)
+        {
+            auto *entry = reinterpret_cast<dirent64 *>(worker.dirents.data() + offset);
+            offset += entry->d_reclen;
+
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            {
+                continue;
+            }
+            ++stats.entries;
+            ++seen;
+
+            if (split_now && entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+            {
+                if (batch == nullptr)
+                {
+                    batch = new StatBatch{};
+                }
+                batch->names.insert(batch->names.end(), name, name + std::strlen(name) + 1);
+                if (++batch->count == batch_entries)
+                {
+                    queue_batch();
+                }
+                continue;
+            }
+
+            // d_type tells us about directories for free, everything else needs one stat
+            if (entry->d_type != DT_DIR)
+            {
+                int type = stat_entry<Kernel>(threadInfo, worker, node, fd, name, counters);
+                if (type < 0)
+                {
+                    error = 1;
+                }
+                if (type != 1)
+                {
+                    continue;
+                }
+            }
+
+            queue_child(name, std::strlen(name));
+        }
+
+        if (batch != nullptr)
+        {
+            queue_batch();
+        }
+    }
+
+    if (suspend)
+    {
+        ++stats.suspends;
+        cursor = new DirCursor{fd, 0, handle, share_fd};
+        if (handle == nullptr &&
+            threadInfo.open_handles.fetch_add(1, std::memory_order_relaxed) >= threadInfo.max_handles)
+        {
+            // Out of fds, keep only the position and reopen it later
+            std::int64_t offset = lseek(fd, 0, SEEK_CUR);
+            ++stats.syscalls;
+            if (offset >= 0)
+            {
+                threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+                close(fd);
+                ++stats.syscalls;
+                cursor->fd = -1;
+                cursor->offset = offset;
+            }
+        }
+        node.cursor = cursor;
+    }
+    else if (handle != nullptr)
+    {
+        release_handle(threadInfo, handle);
+    }
+    else
+    {
+        close(fd);
+        ++stats.syscalls;
+    }
+
+    if (!threadInfo.options.cache_file.empty())
+    {
+        // Split directories have their file totals spread over the workers, a suspended one was only partly read
+        if (have_stat && !split && !suspend && counters.errors == before.errors && counters.linked == own.linked)
+        {
+            CacheRecord record{};
+            record.dev = dir_st.st_dev;
+            record.ino = dir_st.st_ino;
+            record.mtime_sec = dir_st.st_mtim.tv_sec;
+            record.mtime_nsec = static_cast<std::uint32_t>(dir_st.st_mtim.tv_nsec);
+            record.ctime_sec = dir_st.st_ctim.tv_sec;
+            record.ctime_nsec = static_cast<std::uint32_t>(dir_st.st_ctim.tv_nsec);
+            record.files = counters.files - own.files;
+            record.bytes = counters.bytes - own.bytes;
+            record.blocks = counters.blocks - own.blocks;
+            record.names_offset = names_start;
+            record.names_size = worker.cache_names.size() - names_start;
+            record.child_count = static_cast<std::uint64_t>(
+                std::count(worker.cache_names.begin() + names_start, worker.cache_names.end(), '\0'));
+            worker.cache_records.push_back(record);
+        }
+        else
+        {
+            // Read again next time
+            worker.cache_names.resize(names_start);
+        }
+    }
+    // File batches stat'ed right here are already counted for themselves
+    Counters start = before;
+    start += worker.inline_batches;
+    if (!threadInfo.options.export_file.empty())
+    {
+        record_snapshot(worker, node, !resumed, start, counters);
+    }
+
+    if (threadInfo.track_sizes)
+    {
+        std::uint64_t size = threadInfo.options.apparent_size ? counters.bytes - start.bytes
+                                                              : counters.blocks - start.blocks;
+        node.size.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    return error;
+}
+#endif
+
+#ifdef MDU_IO_URING
+bool start_ring(Worker &worker)
+{
+    constexpr unsigned ring_entries = 256;
+
+    if (!worker.ring_tried)
+    {
+        worker.ring_tried = true;
+        auto ring = std::make_unique<Ring>();
+        int err = ring->setup(ring_entries);
+        if (err == 0)
+        {
+            worker.slots.resize(ring->entries());
+            for (unsigned i = 0; i < ring->entries(); ++i)
+            {
+                worker.free_slots.push_back(i);
+            }
+            worker.ring = std::move(ring);
+        }
+        else
+        {
+            worker.ring_error = err;
+        }
+    }
+    return worker.ring != nullptr;
+}
+
+template<typename Kernel>
+int stat_entries_uring(ThreadInfo &threadInfo, Worker &worker, DirNode &node, int fd, long nread,
+                       Counters &counters)
+{
+    constexpr unsigned stat_mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_BLOCKS |
+                                   STATX_UID | STATX_GID | STATX_MTIME;
+    constexpr int open_flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    Ring &ring = *worker.ring;
+    int error = 0;
+    unsigned in_flight = 0;
+    // errno of a failed io_uring_enter, what is left is then done without the ring
+    int failed = 0;
+
+    // The synchronous way, for a subdirectory or for a file to stat
+    auto stat_now = [&](const char *name, bool is_dir) {
+        int type = is_dir ? 1 : stat_entry<Kernel>(threadInfo, worker, node, fd, name, counters);
+        if (type < 0)
+        {
+            error = 1;
+        }
+        if (type == 1)
+        {
+            push_directory(threadInfo, worker, new_child(threadInfo, worker, node, name, std::strlen(name)));
+        }
+    };
+
+    auto complete = [&](std::uint64_t user_data, int res) {
+        RingSlot &slot = worker.slots[user_data];
+        --in_flight;
+        worker.free_slots.push_back(static_cast<unsigned>(user_data));
+
+        if (res < 0 && slot.is_open)
+        {
+            threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+        }
+        if (res == -ENOENT)
+        {
+            // Deleted since the directory was read
+            ++worker.stats.vanished;
+        }
+        else if (res < 0 && (transient_error(-res) || slot.is_open))
+        {
+            // Retried the synchronous way, which waits between the attempts and sizes a directory it cannot open
+            stat_now(slot.name, slot.is_open);
+        }
+        else if (res < 0)
+        {
+            record_error(threadInfo, worker, node, slot.name,
+                         slot.is_open ? ScanError::Operation::read_directory : ScanError::Operation::stat, -res);
+            ++counters.errors;
+            error = 1;
+        }
+        else if (slot.is_open)
+        {
+            DirNode *child = new_child(threadInfo, worker, node, slot.name, std::strlen(slot.name));
+            child->fd = res;
+            push_directory(threadInfo, worker, child);
+        }
+        else if (S_ISDIR(slot.stx.stx_mode))
+        {
+            // The filesystem gave no d_type, open it the slow way
+            push_directory(threadInfo, worker, new_child(threadInfo, worker, node, slot.name, std::strlen(slot.name)));
+        }
+        else
+        {
+            if (slot.stx.stx_nlink > 1)
+            {
+                ++counters.linked;
+                if (Kernel::dedup &&
+                    !threadInfo.inodes.insert(node.root, makedev(slot.stx.stx_dev_major, slot.stx.stx_dev_minor),
+                                              slot.stx.stx_ino))
+                {
+                    // Another link to this file was already counted
+                    return;
+                }
+            }
+            ++counters.files;
+            counters.bytes += slot.stx.stx_size;
+            counters.blocks += slot.stx.stx_blocks * 512;
+            FileStat file{slot.stx.stx_size, slot.stx.stx_blocks * 512, true, slot.stx.stx_uid, slot.stx.stx_gid,
+                          slot.stx.stx_mtime.tv_sec, makedev(slot.stx.stx_dev_major, slot.stx.stx_dev_minor),
+                          slot.stx.stx_ino, slot.stx.stx_nlink};
+            report_file<Kernel>(threadInfo, worker, node, slot.name, file);
+        }
+    };
+
+    auto wait_for = [&](unsigned wait_nr) {
+        ++worker.stats.syscalls;
+        failed = ring.submit(wait_nr, complete);
+        if (failed == 0)
+        {
+            ring.reap(complete);
+        }
+    };
+
+    for (long offset = 0; offset < nread;)
+    {
+        auto *entry = reinterpret_cast<dirent64 *>(worker.dirents.data() + offset);
+        offset += entry->d_reclen;
+
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        {
+            continue;
+        }
+        ++worker.stats.entries;
+        if (failed != 0)
+        {
+            stat_now(name, entry->d_type == DT_DIR);
+            continue;
+        }
+
+        bool open_dir = false;
+        if (entry->d_type == DT_DIR)
+        {
+            open_dir = threadInfo.open_handles.fetch_add(1, std::memory_order_relaxed) < threadInfo.max_handles;
+            if (!open_dir)
+            {
+                // Out of fds, let whoever reads it open it by path
+                threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+                push_directory(threadInfo, worker, new_child(threadInfo, worker, node, name, std::strlen(name)));
+                continue;
+            }
+        }
+
+        while (worker.free_slots.empty() && failed == 0)
+        {
+            wait_for(1);
+        }
+        if (failed != 0)
+        {
+            if (open_dir)
+            {
+                threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+            }
+            stat_now(name, open_dir);
+            continue;
+        }
+        unsigned index = worker.free_slots.back();
+        worker.free_slots.pop_back();
+        RingSlot &slot = worker.slots[index];
+        slot.name = name;
+        slot.is_open = open_dir;
+
+        io_uring_sqe *sqe = ring.next_sqe();
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<std::uint64_t>(name);
+        sqe->user_data = index;
+        if (open_dir)
+        {
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->open_flags = open_flags;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_STATX;
+            ++worker.stats.stat_calls;
+            sqe->len = stat_mask;
+            sqe->off = reinterpret_cast<std::uint64_t>(&slot.stx);
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        }
+        ++in_flight;
+        ++worker.stats.ring_ops;
+
+        // Hand a full batch to the kernel while we keep parsing
+        if (ring.to_submit() >= ring.entries() / 2)
+        {
+            wait_for(0);
+        }
+    }
+
+    while (in_flight > 0 && failed == 0)
+    {
+        wait_for(1);
+    }
+
+    if (failed != 0)
+    {
+        // What the kernel took still completes, those are used as they come so no fd it opens is lost
+        auto deadline = std::chrono::steady_clock::now() + drain_limit;
+        while (in_flight > ring.to_submit() && std::chrono::steady_clock::now() < deadline)
+        {
+            if (ring.reap(complete) == 0)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        // Whatever it still has is done again without it
+        std::vector<bool> idle(worker.slots.size(), false);
+        for (unsigned index : worker.free_slots)
+        {
+            idle[index] = true;
+        }
+        for (unsigned index = 0; index < worker.slots.size(); ++index)
+        {
+            const RingSlot &slot = worker.slots[index];
+            if (idle[index])
+            {
+                continue;
+            }
+            if (slot.is_open)
+            {
+                threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+            }
+            stat_now(slot.name, slot.is_open);
+        }
+        // The slots stay, a request the kernel still finishes may write to one
+        if (in_flight > ring.to_submit())
+        {
+            worker.stuck_rings.push_back(std::move(worker.ring));
+        }
+        worker.ring.reset();
+        worker.free_slots.clear();
+        worker.ring_error = failed;
+        ++worker.stats.ring_failures;
+    }
+
+    return error;
+}
+
+bool start_prefetch(ThreadInfo &threadInfo, Worker &worker)
+{
+    if (!worker.prefetch_tried)
+    {
+        worker.prefetch_tried = true;
+        auto ring = std::make_unique<Ring>();
+        int err = ring->setup(static_cast<unsigned>(std::min(threadInfo.options.prefetch, 4096)));
+        if (err == 0)
+        {
+            worker.prefetch_slots.assign(ring->entries(), nullptr);
+            for (unsigned i = 0; i < ring->entries(); ++i)
+            {
+                worker.free_prefetch.push_back(i);
+            }
+            worker.prefetch_ring = std::move(ring);
+        }
+        else
+        {
+            worker.prefetch_error = err;
+        }
+    }
+    return worker.prefetch_ring != nullptr;
+}
+
+bool prefetch_directory(ThreadInfo &threadInfo, Worker &worker, DirNode *child)
+{
+    constexpr int open_flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    if (worker.prefetch_ring == nullptr)
+    {
+        // Dropped after it failed
+        return false;
+    }
+    unsigned limit = std::min(static_cast<unsigned>(threadInfo.options.prefetch), worker.prefetch_ring->entries());
+    if (worker.prefetching >= limit)
+    {
+        reap_prefetch(threadInfo, worker, 0);
+        if (worker.prefetch_ring == nullptr || worker.prefetching >= limit)
+        {
+            // Further ahead than asked for, this one is opened when it is read
+            return false;
+        }
+    }
+    if (threadInfo.open_handles.fetch_add(1, std::memory_order_relaxed) >= threadInfo.max_handles)
+    {
+        threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // At most entries() are in flight, so there is always room for one more
+    unsigned index = worker.free_prefetch.back();
+    worker.free_prefetch.pop_back();
+    worker.prefetch_slots[index] = child;
+    io_uring_sqe *sqe = worker.prefetch_ring->next_sqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = child->handle->fd;
+    sqe->addr = reinterpret_cast<std::uint64_t>(child->name);
+    sqe->open_flags = open_flags;
+    sqe->user_data = index;
+    ++worker.prefetching;
+    ++worker.stats.ring_ops;
+    ++worker.stats.prefetches;
+    return true;
+}
+
+void reap_prefetch(ThreadInfo &threadInfo, Worker &worker, unsigned wait_nr)
+{
+    Ring &ring = *worker.prefetch_ring;
+    int failed = 0;
+    auto complete = [&](std::uint64_t user_data, int res) {
+        DirNode *child = worker.prefetch_slots[user_data];
+        worker.prefetch_slots[user_data] = nullptr;
+        worker.free_prefetch.push_back(static_cast<unsigned>(user_data));
+        --worker.prefetching;
+        if (res >= 0)
+        {
+            // Opened, it no longer needs the parent the way a plain child does
+            child->fd = res;
+            release_handle(threadInfo, child->handle);
+            child->handle = nullptr;
+        }
+        else
+        {
+            threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+        }
+        push_directory(threadInfo, worker, child);
+    };
+    if (wait_nr > 0 || ring.to_submit() > 0)
+    {
+        ++worker.stats.syscalls;
+        failed = ring.submit(wait_nr, complete);
+    }
+    ring.reap(complete);
+
+    if (failed != 0)
+    {
+        // What the kernel took still completes, those are used as they come so no fd it opens is lost
+        auto deadline = std::chrono::steady_clock::now() + drain_limit;
+        while (worker.prefetching > ring.to_submit() && std::chrono::steady_clock::now() < deadline)
+        {
+            if (ring.reap(complete) == 0)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        // The opens it still had are left to add_directory(), which has the parent's handle to open them with
+        for (DirNode *&child : worker.prefetch_slots)
+        {
+            if (child != nullptr)
+            {
+                threadInfo.open_handles.fetch_sub(1, std::memory_order_relaxed);
+                push_directory(threadInfo, worker, child);
+                child = nullptr;
+            }
+        }
+        if (worker.prefetching > ring.to_submit())
+        {
+            worker.stuck_rings.push_back(std::move(worker.prefetch_ring));
+        }
+        worker.prefetching = 0;
+        worker.free_prefetch.clear();
+        worker.prefetch_ring.reset();
+        worker.prefetch_error = failed;
+        ++worker.stats.ring_failures;
+    }
+}
+#endif
+
+#ifndef MDU_GETDENTS
+template<typename Kernel>
+int file_usage(ThreadInfo &threadInfo, Worker &worker, const DirNode &node, const char *name,
+               const std::filesystem::path &path, Counters &counters)
+{
+#ifdef MDU_LSTAT
+    struct stat st{};
+    if (retry_transient(worker, [&]() { return lstat(path.c_str(), &st); }) != 0)
+    {
+        if (errno == ENOENT && name != nullptr)
+        {
+            // Deleted since the directory was read
+            ++worker.stats.vanished;
+            return 0;
+        }
+        record_error(threadInfo, worker, node, name, ScanError::Operation::stat, errno);
+        ++counters.errors;
+        return 1;
+    }
+    if (!S_ISDIR(st.st_mode) && st.st_nlink > 1 && Kernel::dedup &&
+        !threadInfo.inodes.insert(node.root, st.st_dev, st.st_ino))
+    {
+        return 0;
+    }
+    ++(S_ISDIR(st.st_mode) ? counters.dirs : counters.files);
+    counters.bytes += st.st_size;
+    counters.blocks += st.st_blocks * 512;
+    if (!S_ISDIR(st.st_mode))
+    {
+        FileStat file{static_cast<std::uint64_t>(st.st_size), static_cast<std::uint64_t>(st.st_blocks) * 512, true,
+                      st.st_uid, st.st_gid, st.st_mtime, st.st_dev, st.st_ino, st.st_nlink};
+        report_file<Kernel>(threadInfo, worker, node, name, file);
+    }
+#else
+    // No way to ask for allocated blocks or inodes, the apparent size is the best we have
+    std::error_code ec;
+    if (std::filesystem::is_directory(path, ec))
+    {
+        ++counters.dirs;
+        return 0;
+    }
+    std::uintmax_t size = std::filesystem::file_size(path, ec);
+    if (ec)
+    {
+        if (ec == std::errc::no_such_file_or_directory && name != nullptr)
+        {
+            ++worker.stats.vanished;
+            return 0;
+        }
+        record_error(threadInfo, worker, node, name, ScanError::Operation::stat, ec.value());
+        ++counters.errors;
+        return 1;
+    }
+    ++counters.files;
+    counters.bytes += size;
+    counters.blocks += size;
+    report_file<Kernel>(threadInfo, worker, node, name, FileStat{size, size});
+#endif
+    return 0;
+}
+
+template<typename Kernel>
+int add_directory(ThreadInfo &threadInfo, Worker &worker, DirNode &node)
+{
+    namespace fs = std::filesystem;
+    int error = 0;
+    Counters &counters = worker.roots[node.root];
+    const Counters before = counters;
+    worker.retry_left = retry_budget;
+    std::string path = node_path(node);
+    // The iterator already reads names, so this comes first
+    if (threadInfo.callbacks->on_open)
+    {
+        threadInfo.callbacks->on_open(OpenedDirectory{node.root, path, node.depth, -1});
+    }
+
+    std::error_code ec;
+    fs::directory_iterator it(path, ec);
+    if (ec)
+    {
+        if (ec == std::errc::no_such_file_or_directory && node.parent != nullptr)
+        {
+            // Deleted since its parent was read
+            ++worker.stats.vanished;
+            return 0;
+        }
+        // It still takes space like du counts it, only search permission is needed to size it
+        file_usage<Kernel>(threadInfo, worker, node, nullptr, path, counters);
+        if (!threadInfo.options.export_file.empty())
+        {
+            start_snapshot(worker, node);
+            record_snapshot(worker, node, true, before, counters);
+        }
+        if (threadInfo.track_sizes)
+        {
+            std::uint64_t size = threadInfo.options.apparent_size ? counters.bytes - before.bytes
+                                                                  : counters.blocks - before.blocks;
+            node.size.fetch_add(size, std::memory_order_relaxed);
+        }
+        record_error(threadInfo, worker, node, nullptr, ScanError::Operation::read_directory, ec.value());
+        ++counters.errors;
+        return 1;
+    }
+    error |= file_usage<Kernel>(threadInfo, worker, node, nullptr, path, counters);
+    if (!threadInfo.options.export_file.empty())
+    {
+        start_snapshot(worker, node);
+    }
+
+    for (; it != fs::directory_iterator(); it.increment(ec))
+    {
+        if (threadInfo.cancelled.load(std::memory_order_relaxed))
+        {
+            break;
+        }
+        ++worker.stats.entries;
+        const fs::directory_entry &entry = *it;
+        std::string name = entry.path().filename().string();
+        if (entry.is_symlink(ec))
+        {
+            // Do not add symbolic links to stack
+#ifdef MDU_LSTAT
+            error |= file_usage<Kernel>(threadInfo, worker, node, name.c_str(), entry.path(), counters);
+#else
+            // A dangling link has no size to follow, it still counts as a file
+            std::uintmax_t size = fs::file_size(entry.path(), ec);
+            size = ec ? 0 : size;
+            ++counters.files;
+            counters.bytes += size;
+            counters.blocks += size;
+#endif
+            continue;
+        }
+
+        if (entry.is_directory(ec))
+        {
+            push_directory(threadInfo, worker, new_child(threadInfo, worker, node, name.c_str(), name.size()));
+        }
+        else
+        {
+            error |= file_usage<Kernel>(threadInfo, worker, node, name.c_str(), entry.path(), counters);
+        }
+    }
+    if (ec)
+    {
+        record_error(threadInfo, worker, node, nullptr, ScanError::Operation::read_directory, ec.value());
+        ++counters.errors;
+        error = 1;
+    }
+    if (!threadInfo.options.export_file.empty())
+    {
+        record_snapshot(worker, node, true, before, counters);
+    }
+
+    if (threadInfo.track_sizes)
+    {
+        std::uint64_t size = threadInfo.options.apparent_size ? counters.bytes - before.bytes
+                                                              : counters.blocks - before.blocks;
+        node.size.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    return error;
+}
+#endif
+
+std::vector<std::pair<int, int> > cpu_topology()
+{
+    std::vector<std::pair<int, int> > cpus;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return cpus;
+    }
+    std::vector<int> nodes(CPU_SETSIZE, 0);
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec))
+    {
+        std::string name = entry.path().filename().string();
+        if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+            name.find_first_not_of("0123456789", 4) != std::string::npos)
+        {
+            continue;
+        }
+        // A list of ranges like 0-7,16-23
+        std::ifstream list(entry.path() / "cpulist");
+        std::string range;
+        while (std::getline(list, range, ','))
+        {
+            int first = 0;
+            char dash = 0;
+            int last = 0;
+            std::istringstream in(range);
+            if (!(in >> first))
+            {
+                continue;
+            }
+            if (!(in >> dash >> last))
+            {
+                last = first;
+            }
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+            {
+                nodes[cpu] = std::stoi(name.substr(4));
+            }
+        }
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            cpus.emplace_back(cpu, nodes[cpu]);
+        }
+    }
+#endif
+    return cpus;
+}
+
+std::vector<std::pair<int, int> > plan_placement(const Options &options, int count)
+{
+    std::vector<std::pair<int, int> > placement(count, {-1, -1});
+    std::vector<std::pair<int, int> > cpus;
+    if (options.affinity || options.numa)
+    {
+        cpus = cpu_topology();
+    }
+    if (cpus.empty())
+    {
+        return placement;
+    }
+
+    if (options.numa)
+    {
+        // Deal the CPUs out one node at a time, stable so every node keeps its CPU order
+        std::stable_sort(cpus.begin(), cpus.end(), [](const auto &a, const auto &b) { return a.second < b.second; });
+        std::vector<std::pair<int, int> > interleaved;
+        std::vector<std::size_t> next;
+        std::vector<std::pair<std::size_t, std::size_t> > nodes;
+        for (std::size_t i = 0; i < cpus.size(); ++i)
+        {
+            if (i == 0 || cpus[i].second != cpus[i - 1].second)
+            {
+                nodes.emplace_back(i, i);
+            }
+            nodes.back().second = i + 1;
+        }
+        while (interleaved.size() < cpus.size())
+        {
+            for (auto &[first, end] : nodes)
+            {
+                if (first < end)
+                {
+                    interleaved.push_back(cpus[first++]);
+                }
+            }
+        }
+        cpus = std::move(interleaved);
+    }
+    for (int t = 0; t < count; ++t)
+    {
+        placement[t] = cpus[t % cpus.size()];
+    }
+    return placement;
+}
+
+Worker &place_worker(ThreadInfo &threadInfo, int index, std::pair<int, int> where)
+{
+#ifdef __linux__
+    if (where.first >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(where.first, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        {
+            where = {-1, -1};
+        }
+    }
+#endif
+    if (threadInfo.options.numa)
+    {
+        // Pinned already, so the pages get touched first from this node
+        threadInfo.workers[index] = std::make_unique<Worker>();
+        threadInfo.workers[index]->id = index;
+    }
+    Worker &worker = *threadInfo.workers[index];
+    worker.cpu = where.first;
+    worker.node = where.second;
+
+    int total = static_cast<int>(threadInfo.workers.size());
+    threadInfo.placed.fetch_add(1);
+    threadInfo.placed.notify_all();
+    for (int placed = threadInfo.placed.load(); placed < total; placed = threadInfo.placed.load())
+    {
+        threadInfo.placed.wait(placed);
+    }
+
+    // Starting with the next one so thieves spread out, then the same node first
+    for (int i = 1; i < total; ++i)
+    {
+        worker.victims.push_back(threadInfo.workers[(index + i) % total].get());
+    }
+    if (worker.node >= 0)
+    {
+        std::stable_partition(worker.victims.begin(), worker.victims.end(),
+                              [&worker](const Worker *victim) { return victim->node == worker.node; });
+    }
+    return worker;
+}
+
+void tune_threads(ThreadInfo &threadInfo, int pool)
+{
+    using Clock = std::chrono::steady_clock;
+    using Second = std::chrono::duration<double>;
+    constexpr auto interval = std::chrono::milliseconds(250);
+
+    int limit = threadInfo.active_limit.load(std::memory_order_relaxed);
+    int direction = 1;
+    int flat = 0;
+    double last_rate = -1;
+    double last_latency = 0;
+    std::uint64_t last_entries = 0;
+    std::uint64_t last_busy = 0;
+    auto last_time = Clock::now();
+
+    std::unique_lock<std::mutex> lock(threadInfo.mutex);
+    while (!threadInfo.tuned.wait_for(lock, interval, [&threadInfo]() { return threadInfo.no_more_work.load(); }))
+    {
+        lock.unlock();
+        std::uint64_t entries = 0;
+        std::uint64_t busy = 0;
+        for (int i = 0; i < pool; ++i)
+        {
+            entries += threadInfo.workers[i]->done_entries.load(std::memory_order_relaxed);
+            busy += threadInfo.workers[i]->busy_ns.load(std::memory_order_relaxed);
+        }
+        auto now = Clock::now();
+        double rate = (entries - last_entries) / Second(now - last_time).count();
+        double latency = entries > last_entries ? double(busy - last_busy) / double(entries - last_entries) : 0;
+        last_entries = entries;
+        last_busy = busy;
+        last_time = now;
+
+        // Nothing finished, the workers are idle or all stuck, so there is nothing to learn
+        int step = 0;
+        if (rate > 0)
+        {
+            if (last_rate < 0 || rate > last_rate * 1.05)
+            {
+                // Better than before, keep going the same way
+                step = direction;
+                flat = 0;
+            }
+            else if (rate < last_rate * 0.95)
+            {
+                direction = -direction;
+                step = direction;
+                flat = 0;
+            }
+            else if (latency > last_latency * 1.2)
+            {
+                // Same throughput for slower stats, the filesystem is saturated
+                direction = -1;
+                step = direction;
+                flat = 0;
+            }
+            else if (++flat == 4)
+            {
+                // Held long enough, probe a little further
+                step = direction;
+                flat = 0;
+            }
+            last_rate = rate;
+            last_latency = latency;
+        }
+        int next = std::clamp(limit + step * std::max(1, limit / 4), 1, pool);
+
+        lock.lock();
+        if (next != limit)
+        {
+            threadInfo.active_limit.store(next, std::memory_order_relaxed);
+            if (next > limit)
+            {
+                threadInfo.tuned.notify_all();
+            }
+            limit = next;
+        }
+    }
+}
+
@@ -0,0 +1,370 @@
+#ifndef MDU_H
+#define MDU_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <utility>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <array>
+#include <chrono>
+
+/*
+ * libmdu, the multithreaded disk usage scanner behind mdu.
+ * A Scanner starts its thread pool once and can then measure any number
+ * of path sets, one scan() at a time, so embedding it costs no process
+ * spawn and keeps the threads warm between scans.
+ *
+ * Author: Marcus Lundqvist.
+ */
+
+// The getdents64 backend is used on Linux unless the build asks for the portable one
+#if defined(__linux__) && !defined(MDU_USE_STD_FILESYSTEM)
+#define MDU_GETDENTS 1
+#elif __has_include(<sys/stat.h>)
+// The portable backend still asks lstat() for allocated blocks where there is one
+#define MDU_LSTAT 1
+#endif
+
+// The io_uring engine sits on top of the getdents64 backend
+#if defined(MDU_IO_URING) && !defined(MDU_GETDENTS)
+#undef MDU_IO_URING
+#endif
+
+/*
+ * Totals one worker collected for one root. Workers only ever write their
+ * own copy, aligned to a cache line so neighbours don't share one, and
+ * the copies are merged when the root completes.
+ */
+typedef struct alignas(64) Counters
+{
+    std::uint64_t files{0};
+    std::uint64_t dirs{0};
+    // Apparent size, st_size
+    std::uint64_t bytes{0};
+    // Allocated size, st_blocks * 512
+    std::uint64_t blocks{0};
+    std::uint64_t errors{0};
+    // Files with more than one link, a directory holding any is never cached
+    std::uint64_t linked{0};
+
+    Counters &operator+=(const Counters &other)
+    {
+        files += other.files;
+        dirs += other.dirs;
+        bytes += other.bytes;
+        blocks += other.blocks;
+        errors += other.errors;
+        linked += other.linked;
+        return *this;
+    }
+} Counters;
+
+// Scheduler and I/O statistics, only written by the owning worker
+typedef struct WorkerStats
+{
+    std::uint64_t entries{0};
+    std::uint64_t stat_calls{0};
+    std::uint64_t syscalls{0};
+    // Requests submitted through io_uring
+    std::uint64_t ring_ops{0};
+    std::uint64_t steals{0};
+    std::uint64_t failed_steals{0};
+    std::uint64_t parks{0};
+    // Directories not read again thanks to the cache file
+    std::uint64_t cache_hits{0};
+    // Directories set aside half read to stay within max_queue_mem
+    std::uint64_t suspends{0};
+    // Calls repeated after ESTALE, EIO or EINTR
+    std::uint64_t retries{0};
+    // Entries deleted between being listed and being looked at, not counted as errors
+    std::uint64_t vanished{0};
+    // Subdirectories opened through io_uring ahead of the worker reading them, for Options::prefetch
+    std::uint64_t prefetches{0};
+    // Rings dropped after io_uring_enter failed, the worker went on without them
+    std::uint64_t ring_failures{0};
+    std::int64_t peak_depth{0};
+    double busy{0};
+    double idle{0};
+    // Time spent waiting for the scanner's mutex
+    double lock_wait{0};
+} WorkerStats;
+
+// The order every worker reads its own queued directories in, thieves always take the oldest
+enum class Order
+{
+    // Newest first, a worker stays below the directory it just read
+    dfs,
+    // Oldest first, every level before the next
+    bfs,
+    // Oldest first down to Options::bfs_levels, newest first below
+    hybrid
+};
+
+// Scanner settings, fixed for the lifetime of a Scanner
+typedef struct Options
+{
+    // Threads reading directories, at least 1
+    int threads{1};
+    // Sum st_size instead of the allocated st_blocks * 512
+    bool apparent_size{false};
+    // Count hard linked files once per link instead of once per root
+    bool count_links{false};
+    // Batch statx/openat through io_uring
+    bool io_uring{false};
+    // Report every directory down to this depth through on_directory, -1 reports none
+    int max_depth{-1};
+    // Reuse unchanged directories from this file and write it back after every scan
+    std::string cache_file;
+    // Rough cap on memory for queued directories, 0 for no cap
+    std::uint64_t max_queue_mem{0};
+    // Entries after which a directory's files are stat'ed by several workers, 0 never splits
+    std::int64_t split_threshold{4096};
+    // Threads that only stat the files the reading threads find, 0 keeps both in one loop
+    int stat_threads{0};
+    // The number of active threads follows the measured throughput, threads is the most
+    bool auto_threads{false};
+    // Collect this many of the largest directories below the roots, or files with top_files
+    std::size_t top{0};
+    bool top_files{false};
+    // Break the counted files down by uid and gid, by extension, and by size and age
+    bool by_owner{false};
+    bool by_ext{false};
+    bool histogram{false};
+    // Errors kept with their path per worker and scan, any more are only counted
+    std::size_t max_errors{1000};
+    // Pin every thread to a CPU of its own, in CPU order. Linux only
+    bool affinity{false};
+    // Pin them spread over the NUMA nodes and keep every worker's memory on its node
+    bool numa{false};
+    // Write the tree of directories with their totals to this snapshot file after every scan
+    std::string export_file;
+    Order order{Order::dfs};
+    // Levels below the roots Order::hybrid reads breadth first
+    int bfs_levels{3};
+    // Queued subdirectories per worker whose opens run ahead through io_uring, 0 opens them when read.
+    // Only the getdents64 backend built with io_uring does this
+    int prefetch{0};
+    // Entries a scan reads on the calling thread before the pool is started, 0 starts it with the Scanner.
+    // A tree smaller than this never starts a thread at all. Not done with numa
+    std::uint64_t inline_entries{0};
+} Options;
+
+// One scanned path, a directory with everything below it or a single file
+typedef struct RootResult
+{
+    // Position in the paths given to scan()
+    std::uint32_t index{0};
+    std::string path;
+    bool directory{true};
+    Counters totals;
+    // bytes or blocks, whichever Options::apparent_size asks for, a file argument too
+    std::uint64_t size{0};
+    // errno of looking the path up, it was not measured at all if set
+    int error{0};
+} RootResult;
+
+// A directory that completed, with all of its subdirectories
+typedef struct DirectoryResult
+{
+    std::uint32_t root{0};
+    std::string_view path;
+    int depth{0};
+    std::uint64_t size{0};
+} DirectoryResult;
+
+// A counted file, hard links already left out unless Options::count_links is set
+typedef struct FileResult
+{
+    std::uint32_t root{0};
+    std::string_view path;
+    std::uint64_t size{0};
+    // Both sizes, size is the one Options::apparent_size asks for
+    std::uint64_t bytes{0};
+    std::uint64_t blocks{0};
+    // Only known where there was an lstat() or statx(), 0 otherwise
+    std::uint64_t dev{0};
+    std::uint64_t ino{0};
+    std::uint64_t links{0};
+} FileResult;
+
+// A directory a worker is about to read, none of its names have been looked at yet
+typedef struct OpenedDirectory
+{
+    std::uint32_t root{0};
+    std::string_view path;
+    int depth{0};
+    // Open for the length of the call, -1 with the portable backend, which opens it only after
+    int fd{-1};
+} OpenedDirectory;
+
+// One of the largest directories or files of a scan
+typedef struct TopEntry
+{
+    std::uint64_t size{0};
+    std::uint32_t root{0};
+    std::string path;
+} TopEntry;
+
+// Counted files falling into one row of a Breakdown
+typedef struct Aggregate
+{
+    std::uint64_t files{0};
+    // bytes or blocks, as for RootResult::size
+    std::uint64_t size{0};
+} Aggregate;
+
+/*
+ * The files of a whole scan broken down the ways Options asked for.
+ * Every worker fills its own tables from the stat it did anyway, they
+ * are only added together once the scan is done.
+ */
+typedef struct Breakdown
+{
+    // Largest first
+    std::vector<std::pair<std::uint32_t, Aggregate> > uids;
+    std::vector<std::pair<std::uint32_t, Aggregate> > gids;
+    // Without the dot, files without one are under ""
+    std::vector<std::pair<std::string, Aggregate> > extensions;
+    // Bucket b holds apparent sizes of [2^(b-1), 2^b), bucket 0 the empty files
+    std::array<Aggregate, 65> sizes{};
+    // Modified within age_days[b] days of the scan, the last bucket everything older
+    static constexpr std::array<int, 6> age_days{1, 7, 30, 90, 365, 1095};
+    std::array<Aggregate, age_days.size() + 1> ages{};
+} Breakdown;
+
+// Something the scan could not read, it went on with everything else
+typedef struct ScanError
+{
+    enum class Operation
+    {
+        read_directory,
+        stat,
+        write_cache,
+        write_snapshot,
+        // Directories that will not be kept current by watch_paths()
+        watch_directory
+    };
+
+    Operation operation{Operation::stat};
+    std::uint32_t root{0};
+    std::string path;
+    // The errno it failed with, after any retries
+    int code{0};
+} ScanError;
+
+typedef struct Progress
+{
+    // Directory entries read so far in this scan
+    std::uint64_t entries{0};
+    std::size_t roots_done{0};
+    std::size_t roots{0};
+    double elapsed{0};
+} Progress;
+
+/*
+ * What a scan reports while it runs. Every callback is optional, the
+ * ones left empty cost nothing. on_open, on_directory and on_file run
+ * on the worker threads and have to be thread safe, the others on the
+ * thread that called scan().
+ */
+typedef struct ScanCallbacks
+{
+    // Each root as it completes, files first
+    std::function<void(const RootResult &)> on_root;
+    // Every directory once, the roots too, so a change made while it is read can be watched for.
+    // The portable backend calls it for a directory it then fails to open as well
+    std::function<void(const OpenedDirectory &)> on_open;
+    // Directories down to Options::max_depth, not the roots
+    std::function<void(const DirectoryResult &)> on_directory;
+    std::function<void(const FileResult &)> on_file;
+    std::function<void(const Progress &)> on_progress;
+    std::chrono::milliseconds progress_interval{100};
+} ScanCallbacks;
+
+typedef struct ScanResult
+{
+    // In the order of the paths given to scan()
+    std::vector<RootResult> roots;
+    // The Options::top largest entries, largest first
+    std::vector<TopEntry> top;
+    // Only filled in for Options::by_owner, by_ext and histogram
+    Breakdown breakdown;
+    // By root and path, at most Options::max_errors of them per worker
+    std::vector<ScanError> errors;
+    // Errors left out of errors once a worker had max_errors
+    std::uint64_t errors_dropped{0};
+    // Stopped through the stop token, the totals only cover what was read until then
+    bool cancelled{false};
+    // errno of an io_uring for Options::io_uring or prefetch that could not be used, the scan went on without it
+    int ring_error{0};
+    int prefetch_error{0};
+    // 1 if any entry could not be read
+    int error{0};
+} ScanResult;
+
+typedef struct ThreadStats
+{
+    int id{0};
+    // Where Options::affinity or numa pinned it, -1 if it was not
+    int cpu{-1};
+    int node{-1};
+    // Directories read in the last scan
+    std::uint64_t dirs{0};
+    WorkerStats stats;
+} ThreadStats;
+
+// Statistics of all scans since the Scanner was created
+typedef struct ScanStats
+{
+    WorkerStats total;
+    std::vector<ThreadStats> threads;
+    // Threads the auto_threads tuner left active
+    int active_threads{0};
+} ScanStats;
+
+struct ThreadInfo;
+
+class Scanner
+{
+private:
+    std::unique_ptr<ThreadInfo> m_info;
+    std::vector<std::thread> m_threads;
+    std::thread m_tuner;
+    // Scans run one at a time, they share the workers' per root state
+    std::mutex m_scan_mutex;
+
+    // Starts the threads and the -j auto tuner, once
+    void start_threads();
+
+public:
+    // Starts the thread pool, or leaves that to the first scan that outgrows Options::inline_entries
+    explicit Scanner(const Options &options);
+    Scanner(const Scanner &) = delete;
+    Scanner &operator=(const Scanner &) = delete;
+    ~Scanner();
+
+    /*
+     * Measures paths and returns when all of them are done, or soon after
+     * stop is requested. Nothing that goes wrong on the way throws, an
+     * unreadable path or entry ends up in ScanResult::errors and the
+     * rest is still measured.
+     */
+    ScanResult scan(const std::vector<std::string> &paths, const ScanCallbacks &callbacks = {},
+                    std::stop_token stop = {});
+
+    // Stops and joins the thread pool, no scan may follow
+    void shutdown();
+
+    // Only consistent after shutdown(), the idle workers keep counting before that
+    ScanStats stats() const;
+
+    const Options &options() const;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef MDU_RETRY_H
+#define MDU_RETRY_H
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+/*
+ * Retrying failed filesystem calls, shared by the scanner and the
+ * coordinator of a cluster scan so both give up on the same errors.
+ *
+ * Author: Marcus Lundqvist.
+ */
+
+// Waiting on retries one directory may spend before its errors are final
+constexpr std::chrono::microseconds retry_budget(100000);
+
+/**
+ * transient_error() - Whether a failed call is worth repeating.
+ * ESTALE and EIO come and go on NFS and on busy disks, EINTR and
+ * EAGAIN just mean the call was interrupted.
+ *
+ * @code: The errno it failed with.
+ *
+ * Returns: true if it may well work the next time.
+ *
+ */
+inline bool transient_error(int code)
+{
+    return code == ESTALE || code == EIO || code == EINTR || code == EAGAIN;
+}
+
+/**
+ * retry_transient() - Repeats a call while it fails with a transient error.
+ * The first retry is immediate, the next ones wait 1, 2 and 4 ms out
+ * of the budget the directory being read still has. Once that is spent
+ * the errors are final after the immediate retry, so a dying mount
+ * costs a bounded time per directory instead of stalling the caller.
+ *
+ * @budget: Waiting left for the directory, reduced by what is spent.
+ * @retries: Counts every repeated call.
+ * @call: Returns a negative value and sets errno when it fails.
+ *
+ * Returns: What the last attempt returned, with errno from it.
+ *
+ */
+template<typename Call>
+auto retry_transient(std::chrono::microseconds &budget, std::uint64_t &retries, Call call) -> decltype(call())
+{
+    constexpr int max_retries = 4;
+    auto result = call();
+    std::chrono::microseconds delay(1000);
+    for (int retry = 0; retry < max_retries && result < 0 && transient_error(errno); ++retry)
+    {
+        // An interrupted call goes again at once, the others give the server or disk a moment after that
+        if (retry > 0 && errno != EINTR)
+        {
+            if (budget < delay)
+            {
+                break;
+            }
+            budget -= delay;
+            std::this_thread::sleep_for(delay);
+            delay *= 2;
+        }
+        ++retries;
+        result = call();
+    }
+    return result;
+}
+
+#endif
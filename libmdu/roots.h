@@ -0,0 +1,29 @@
+#ifndef MDU_ROOTS_H
+#define MDU_ROOTS_H
+
+#include "mdu.h"
+
+/*
+ * Looking up the paths given to a scan, shared by Scanner::scan() and
+ * the coordinator of a cluster scan so a file argument is sized the
+ * same way by both.
+ *
+ * Author: Marcus Lundqvist.
+ */
+
+/**
+ * size_root() - Looks up root.path and sizes it if it is not a directory.
+ * One stat() sizes a file the way the workers size one, it follows a
+ * link given as an argument. A directory is only marked as one, its
+ * totals are left to the scan.
+ *
+ * @root: The root, with its path set.
+ * @apparent_size: Whether root.size is to be bytes rather than blocks.
+ *
+ * Returns: 0, or the errno it could not be looked up with, which
+ *          root.error and one error in root.totals are set to.
+ *
+ */
+int size_root(RootResult &root, bool apparent_size);
+
+#endif
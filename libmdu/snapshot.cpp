@@ -0,0 +1,451 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <tuple>
+
+#if __has_include(<sys/mman.h>)
+#define MDU_SNAPSHOT_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Implementation of the snapshot files of libmdu, the layout is
+ * described in snapshot.h.
+ *
+ * Author: Marcus Lundqvist.
+ */
+
+// Bytes per entry over all columns but the names, a section has at least this many per entry
+constexpr std::uint64_t entry_bytes = 4 + 8 + 4 * 8;
+
+/**
+ * padded() - Rounds a column size up to the 8 byte alignment.
+ *
+ * @size: Size of the column in bytes.
+ *
+ * Returns: The size with its padding.
+ *
+ */
+std::uint64_t padded(std::uint64_t size);
+
+/**
+ * section_body() - Size of a section without its header.
+ *
+ * @count: Entries in the section.
+ * @names_size: Size of its names column.
+ *
+ * Returns: The size in bytes.
+ *
+ */
+std::uint64_t section_body(std::uint64_t count, std::uint64_t names_size);
+
+/**
+ * write_section() - Writes the entries of one root as a section.
+ *
+ * @out: The snapshot file.
+ * @entries: Entries of the root sorted by id, one per directory.
+ * @count: Number of entries.
+ *
+ * Returns: Nothing, errors are left in the state of out.
+ *
+ */
+void write_section(std::ofstream &out, const SnapshotEntry *entries, std::size_t count);
+
+std::string_view SnapshotRoot::name_of(std::uint32_t dir) const
+{
+    if (dir >= count || name[dir] > name[dir + 1] || name[dir + 1] > names_size)
+    {
+        return {};
+    }
+    return std::string_view(names + name[dir], name[dir + 1] - name[dir]);
+}
+
+std::pair<std::uint32_t, std::uint32_t> SnapshotRoot::children(std::uint32_t dir) const
+{
+    // The root is its own parent, not its own child
+    auto [first, last] = std::equal_range(parent + 1, parent + count, dir);
+    return {static_cast<std::uint32_t>(first - parent), static_cast<std::uint32_t>(last - parent)};
+}
+
+std::optional<std::uint32_t> SnapshotRoot::find(std::string_view relative) const
+{
+    std::uint32_t dir = 0;
+    while (!relative.empty())
+    {
+        if (relative.front() == '/')
+        {
+            relative.remove_prefix(1);
+            continue;
+        }
+        std::string_view component = relative.substr(0, relative.find('/'));
+        relative.remove_prefix(component.size());
+        if (component == ".")
+        {
+            continue;
+        }
+
+        // Siblings are sorted by name
+        auto [first, end] = children(dir);
+        std::uint32_t last = end;
+        while (first < last)
+        {
+            std::uint32_t middle = first + (last - first) / 2;
+            if (name_of(middle) < component)
+            {
+                first = middle + 1;
+            }
+            else
+            {
+                last = middle;
+            }
+        }
+        if (first == end || name_of(first) != component)
+        {
+            return std::nullopt;
+        }
+        dir = first;
+    }
+    return dir;
+}
+
+std::string SnapshotRoot::path(std::uint32_t dir) const
+{
+    // A damaged parent column never points forward, that would loop
+    std::vector<std::string_view> components;
+    while (dir != 0 && dir < count && parent[dir] < dir)
+    {
+        components.push_back(name_of(dir));
+        dir = parent[dir];
+    }
+    std::string path(name_of(0));
+    for (auto component = components.rbegin(); component != components.rend(); ++component)
+    {
+        if (path.empty() || path.back() != '/')
+        {
+            path += '/';
+        }
+        path.append(*component);
+    }
+    return path;
+}
+
+Snapshot::~Snapshot()
+{
+    close();
+}
+
+void Snapshot::close()
+{
+#ifdef MDU_SNAPSHOT_MMAP
+    if (m_map != nullptr)
+    {
+        munmap(m_map, m_size);
+    }
+#endif
+    m_map = nullptr;
+    m_size = 0;
+    m_buffer.clear();
+    m_roots.clear();
+}
+
+int Snapshot::open(const std::string &path)
+{
+    close();
+    const char *data = nullptr;
+#ifdef MDU_SNAPSHOT_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return errno;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) != 0)
+    {
+        int code = errno;
+        ::close(fd);
+        return code;
+    }
+    if (st.st_size > 0)
+    {
+        void *map = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            int code = errno;
+            ::close(fd);
+            return code;
+        }
+        m_map = map;
+        m_size = static_cast<std::size_t>(st.st_size);
+    }
+    ::close(fd);
+    data = static_cast<const char *>(m_map);
+#else
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+    {
+        return errno != 0 ? errno : ENOENT;
+    }
+    m_size = static_cast<std::size_t>(in.tellg());
+    // Read into 64 bit words so the columns are aligned like in a mapping
+    m_buffer.resize((m_size + 7) / 8);
+    in.seekg(0);
+    in.read(reinterpret_cast<char *>(m_buffer.data()), static_cast<std::streamsize>(m_size));
+    if (!in)
+    {
+        close();
+        return EIO;
+    }
+    data = reinterpret_cast<const char *>(m_buffer.data());
+#endif
+
+    std::uint64_t offset = 0;
+    while (offset < m_size)
+    {
+        if (m_size - offset < sizeof(SnapshotHeader))
+        {
+            close();
+            return EINVAL;
+        }
+        const auto *header = reinterpret_cast<const SnapshotHeader *>(data + offset);
+        std::uint64_t left = m_size - offset - sizeof(SnapshotHeader);
+        // Sizes are checked one at a time so nothing overflows on a damaged file
+        if (std::memcmp(header->magic, magic, sizeof(magic)) != 0 || header->version != version ||
+            header->count == 0 || header->count > std::numeric_limits<std::uint32_t>::max() ||
+            header->count > left / entry_bytes || header->names_size > left ||
+            header->section_size != sizeof(SnapshotHeader) + section_body(header->count, header->names_size) ||
+            header->section_size - sizeof(SnapshotHeader) > left)
+        {
+            close();
+            return EINVAL;
+        }
+
+        SnapshotRoot &root = m_roots.emplace_back();
+        std::uint64_t count = header->count;
+        const char *column = data + offset + sizeof(SnapshotHeader);
+        root.count = count;
+        root.parent = reinterpret_cast<const std::uint32_t *>(column);
+        column += padded(4 * count);
+        root.name = reinterpret_cast<const std::uint64_t *>(column);
+        column += 8 * (count + 1);
+        for (const std::uint64_t **totals : {&root.bytes, &root.blocks, &root.files, &root.dirs})
+        {
+            *totals = reinterpret_cast<const std::uint64_t *>(column);
+            column += 8 * count;
+        }
+        root.names = column;
+        root.names_size = header->names_size;
+        offset += header->section_size;
+    }
+    if (m_roots.empty())
+    {
+        close();
+        return EINVAL;
+    }
+    return 0;
+}
+
+const std::vector<SnapshotRoot> &Snapshot::roots() const
+{
+    return m_roots;
+}
+
+std::optional<std::pair<const SnapshotRoot *, std::uint32_t> > Snapshot::find(std::string_view path) const
+{
+    for (const SnapshotRoot &root : m_roots)
+    {
+        // /usr holds /usr/lib but not /usrx
+        std::string_view name = root.name_of(0);
+        if (!path.starts_with(name))
+        {
+            continue;
+        }
+        std::string_view rest = path.substr(name.size());
+        if (!rest.empty() && rest.front() != '/' && !name.ends_with('/'))
+        {
+            continue;
+        }
+        if (std::optional<std::uint32_t> dir = root.find(rest))
+        {
+            return std::pair(&root, *dir);
+        }
+    }
+    return std::nullopt;
+}
+
+int write_snapshot(const std::string &path, std::vector<SnapshotEntry> &entries)
+{
+    // A directory read in several goes has an entry per go, they add up into the one that names it
+    std::sort(entries.begin(), entries.end(), [](const SnapshotEntry &a, const SnapshotEntry &b) {
+        return std::tuple(a.root, a.id, !a.named) < std::tuple(b.root, b.id, !b.named);
+    });
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < entries.size();)
+    {
+        SnapshotEntry merged = entries[i];
+        std::size_t j = i + 1;
+        for (; j < entries.size() && entries[j].root == merged.root && entries[j].id == merged.id; ++j)
+        {
+            merged.files += entries[j].files;
+            merged.bytes += entries[j].bytes;
+            merged.blocks += entries[j].blocks;
+        }
+        if (merged.named)
+        {
+            entries[kept++] = merged;
+        }
+        i = j;
+    }
+    entries.resize(kept);
+
+    std::string tmp = path + ".tmp";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    for (std::size_t begin = 0; begin < entries.size() && out;)
+    {
+        std::size_t end = begin + 1;
+        while (end < entries.size() && entries[end].root == entries[begin].root)
+        {
+            ++end;
+        }
+        write_section(out, entries.data() + begin, end - begin);
+        begin = end;
+    }
+    out.close();
+
+    if (!out || std::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        int code = errno != 0 ? errno : EIO;
+        std::remove(tmp.c_str());
+        return code;
+    }
+    return 0;
+}
+
+void write_section(std::ofstream &out, const SnapshotEntry *entries, std::size_t count)
+{
+    constexpr std::uint32_t none = std::numeric_limits<std::uint32_t>::max();
+    auto position = [&](std::uint64_t id) {
+        const SnapshotEntry *entry = std::lower_bound(entries, entries + count, id,
+                                                      [](const SnapshotEntry &e, std::uint64_t id) { return e.id < id; });
+        return entry != entries + count && entry->id == id ? static_cast<std::uint32_t>(entry - entries) : none;
+    };
+
+    // Children of every entry as one array, kids[first[i], first[i + 1]) are those of entry i
+    std::uint32_t root = none;
+    std::vector<std::uint32_t> parents(count, none);
+    std::vector<std::uint32_t> first(count + 1, 0);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        if (entries[i].parent == 0)
+        {
+            root = static_cast<std::uint32_t>(i);
+        }
+        else if ((parents[i] = position(entries[i].parent)) != none)
+        {
+            ++first[parents[i] + 1];
+        }
+    }
+    if (root == none)
+    {
+        return;
+    }
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        first[i + 1] += first[i];
+    }
+    std::vector<std::uint32_t> kids(first[count]);
+    std::vector<std::uint32_t> next(first.begin(), first.end() - 1);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        if (parents[i] != none)
+        {
+            kids[next[parents[i]]++] = static_cast<std::uint32_t>(i);
+        }
+    }
+
+    // Breadth first with siblings by name, an entry whose parent is missing is never reached
+    std::vector<std::uint32_t> order{root};
+    std::vector<std::uint32_t> moved(count, none);
+    moved[root] = 0;
+    for (std::size_t k = 0; k < order.size(); ++k)
+    {
+        auto begin = kids.begin() + first[order[k]];
+        auto end = kids.begin() + first[order[k] + 1];
+        std::sort(begin, end, [entries](std::uint32_t a, std::uint32_t b) {
+            return entries[a].name < entries[b].name;
+        });
+        for (auto kid = begin; kid != end; ++kid)
+        {
+            moved[*kid] = static_cast<std::uint32_t>(order.size());
+            order.push_back(*kid);
+        }
+    }
+
+    std::size_t size = order.size();
+    std::vector<std::uint32_t> parent(size, 0);
+    std::vector<std::uint64_t> name(size + 1, 0);
+    std::vector<std::uint64_t> bytes(size);
+    std::vector<std::uint64_t> blocks(size);
+    std::vector<std::uint64_t> files(size);
+    std::vector<std::uint64_t> dirs(size, 1);
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        const SnapshotEntry &entry = entries[order[i]];
+        parent[i] = i == 0 ? 0 : moved[parents[order[i]]];
+        name[i + 1] = name[i] + entry.name.size();
+        bytes[i] = entry.bytes;
+        blocks[i] = entry.blocks;
+        files[i] = entry.files;
+    }
+    // Children come after their parents, so one pass from the end rolls everything up
+    for (std::size_t i = size - 1; i > 0; --i)
+    {
+        bytes[parent[i]] += bytes[i];
+        blocks[parent[i]] += blocks[i];
+        files[parent[i]] += files[i];
+        dirs[parent[i]] += dirs[i];
+    }
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, Snapshot::magic, sizeof(header.magic));
+    header.version = Snapshot::version;
+    header.count = size;
+    header.names_size = name[size];
+    header.section_size = sizeof(SnapshotHeader) + section_body(size, header.names_size);
+
+    const char padding[8] = {};
+    auto column = [&out, &padding](const auto &values) {
+        std::uint64_t length = values.size() * sizeof(values[0]);
+        out.write(reinterpret_cast<const char *>(values.data()), static_cast<std::streamsize>(length));
+        out.write(padding, static_cast<std::streamsize>(padded(length) - length));
+    };
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    column(parent);
+    column(name);
+    column(bytes);
+    column(blocks);
+    column(files);
+    column(dirs);
+    for (std::uint32_t index : order)
+    {
+        out.write(entries[index].name.data(), static_cast<std::streamsize>(entries[index].name.size()));
+    }
+    out.write(padding, static_cast<std::streamsize>(padded(header.names_size) - header.names_size));
+}
+
+std::uint64_t padded(std::uint64_t size)
+{
+    return (size + 7) & ~std::uint64_t{7};
+}
+
+std::uint64_t section_body(std::uint64_t count, std::uint64_t names_size)
+{
+    return padded(4 * count) + 8 * (count + 1) + 4 * 8 * count + padded(names_size);
+}
@@ -0,0 +1,128 @@
+#ifndef MDU_SNAPSHOT_H
+#define MDU_SNAPSHOT_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*
+ * Snapshots of the directory tree a scan saw, written for
+ * Options::export_file and read back without any parsing.
+ *
+ * A file is a series of sections, one per root, each one self contained
+ * so snapshots can be appended to each other. A section is a
+ * SnapshotHeader followed by columns of header.count entries, each
+ * padded to 8 bytes:
+ *
+ *   parent  uint32_t[count]      index of the parent, the root is entry 0 and its own parent
+ *   name    uint64_t[count + 1]  entry i is names[name[i], name[i + 1]), the root's is its path
+ *   bytes   uint64_t[count]      apparent size of everything below and in the directory
+ *   blocks  uint64_t[count]      allocated size, the same way
+ *   files   uint64_t[count]
+ *   dirs    uint64_t[count]      directories, the directory itself included
+ *   names   char[names_size]
+ *
+ * Entries are in breadth first order with siblings sorted by name, so
+ * parent never decreases and the children of a directory are one run
+ * of it that a binary search finds.
+ *
+ * Author: Marcus Lundqvist.
+ */
+
+typedef struct SnapshotHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t reserved;
+    std::uint64_t count;
+    std::uint64_t names_size;
+    // Of the whole section, this header included
+    std::uint64_t section_size;
+} SnapshotHeader;
+
+// One root of a mapped snapshot, only valid while its Snapshot is open
+typedef struct SnapshotRoot
+{
+    std::uint64_t count{0};
+    const std::uint32_t *parent{nullptr};
+    const std::uint64_t *name{nullptr};
+    const std::uint64_t *bytes{nullptr};
+    const std::uint64_t *blocks{nullptr};
+    const std::uint64_t *files{nullptr};
+    const std::uint64_t *dirs{nullptr};
+    const char *names{nullptr};
+    std::uint64_t names_size{0};
+
+    // Empty for an entry whose name does not fit the names column
+    std::string_view name_of(std::uint32_t dir) const;
+    // The range of entries that are its children
+    std::pair<std::uint32_t, std::uint32_t> children(std::uint32_t dir) const;
+    // Entry of a path relative to the root, "" is the root itself
+    std::optional<std::uint32_t> find(std::string_view relative) const;
+    // Full path, starting with the root's
+    std::string path(std::uint32_t dir) const;
+} SnapshotRoot;
+
+/*
+ * A snapshot file mapped read only. Only the section headers are checked
+ * on open, lookups never read outside the mapping.
+ */
+class Snapshot
+{
+private:
+    void *m_map{nullptr};
+    std::size_t m_size{0};
+    // Without mmap the file is read into memory instead
+    std::vector<std::uint64_t> m_buffer;
+    std::vector<SnapshotRoot> m_roots;
+
+public:
+    static constexpr char magic[8] = {'M', 'D', 'U', 'S', 'N', 'A', 'P', '\0'};
+    static constexpr std::uint32_t version = 1;
+
+    Snapshot() = default;
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+    ~Snapshot();
+
+    // 0 once open, otherwise the errno, EINVAL for a file that is not a snapshot
+    int open(const std::string &path);
+    void close();
+
+    // In the order they were written
+    const std::vector<SnapshotRoot> &roots() const;
+
+    /*
+     * The root a path is in and its entry there. The path has to start
+     * with the root's path as it was given to the scan.
+     */
+    std::optional<std::pair<const SnapshotRoot *, std::uint32_t> > find(std::string_view path) const;
+};
+
+// One directory going into a snapshot, with only what is directly in it
+typedef struct SnapshotEntry
+{
+    // Unique within a scan, parent is 0 for a root
+    std::uint64_t id{0};
+    std::uint64_t parent{0};
+    std::uint32_t root{0};
+    // Set for the one entry of a directory that names it, the others only add to its totals
+    bool named{false};
+    std::string_view name;
+    std::uint64_t files{0};
+    std::uint64_t bytes{0};
+    std::uint64_t blocks{0};
+} SnapshotEntry;
+
+/*
+ * Writes entries as one section per root, roots in index order. An
+ * entry whose parent is not among them is left out with everything
+ * below it. The file is replaced through a rename.
+ * Returns 0 or the errno.
+ */
+int write_snapshot(const std::string &path, std::vector<SnapshotEntry> &entries);
+
+#endif
@@ -0,0 +1,1445 @@
+#include "watch.h"
+
+#ifdef MDU_WATCH
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+#if __has_include(<sys/fanotify.h>) && __has_include(<sys/statfs.h>)
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#endif
+
+// Directory file handles in the events came with Linux 5.9
+#if defined(FAN_REPORT_DFID_NAME) && defined(FAN_MARK_FILESYSTEM)
+#define MDU_FANOTIFY 1
+#endif
+
+/*
+ * Implementation of the watch mode of libmdu. The tree is kept as one
+ * WatchDir per directory holding the size of every file directly in it,
+ * so an event only has to stat the name it is about and apply the
+ * difference. Whatever has to be read whole, at the start or when a
+ * directory appears, is read by a Scanner with the options given, its
+ * workers add each directory to the tree as they open it and the files
+ * they counted are added once the scan is done. Events are read until
+ * the kernel has none left, then every name they were about is looked at
+ * once, however many events it had. Looking at a name only ever makes
+ * the tree agree with what is there now, so events may be handled in any
+ * order and more than once.
+ *
+ * Author: Marcus Lundqvist.
+ */
+
+constexpr std::uint32_t no_dir = std::numeric_limits<std::uint32_t>::max();
+
+// The files a scan counts are set aside in this many shards, picked by thread, until it is done
+constexpr std::size_t file_shards = 64;
+
+// Reads of the event queue before the names are looked at, so a busy tree still gets its snapshot
+constexpr int max_reads = 64;
+
+constexpr std::size_t event_buffer_size = 64 * 1024;
+
+// The directory itself changing comes as an event without a name on it
+constexpr std::uint32_t inotify_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB |
+                                       IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+#ifdef MDU_FANOTIFY
+constexpr std::uint64_t fanotify_mask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY |
+                                        FAN_ATTRIB | FAN_DELETE_SELF | FAN_MOVE_SELF | FAN_ONDIR;
+
+// Events carry the fsid the way statfs() gives it
+constexpr std::size_t fsid_size = sizeof(fanotify_event_info_fid::fsid);
+static_assert(sizeof(statfs::f_fsid) == fsid_size);
+#endif
+
+// Root, device and inode, files are told apart within a root the way the Scanner does
+typedef std::tuple<std::uint32_t, dev_t, ino_t> FileKey;
+
+// Lets the directories a scan opened be looked up by a part of a path without copying it
+struct PathHash
+{
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view path) const
+    {
+        return std::hash<std::string_view>{}(path);
+    }
+};
+
+struct FileKeyHash
+{
+    std::size_t operator()(const FileKey &key) const
+    {
+        std::size_t hash = std::hash<ino_t>()(std::get<2>(key));
+        hash ^= std::hash<dev_t>()(std::get<1>(key)) + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+        return hash ^ (std::get<0>(key) + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2));
+    }
+};
+
+// A file of the tree, with what it adds to its directory
+typedef struct WatchFile
+{
+    std::uint64_t bytes{0};
+    std::uint64_t blocks{0};
+    // Set for more than one link, the size is then kept in WatchState::links
+    bool linked{false};
+    dev_t dev{0};
+    ino_t ino{0};
+} WatchFile;
+
+// Every link the tree has to one file, only the first one is counted
+typedef struct LinkedFile
+{
+    std::uint64_t bytes{0};
+    std::uint64_t blocks{0};
+    std::vector<std::pair<std::uint32_t, std::string> > links;
+} LinkedFile;
+
+// A directory of the tree, with only what is directly in it
+typedef struct WatchDir
+{
+    // Last component, a root's whole path
+    std::string name;
+    // no_dir for a root
+    std::uint32_t parent{no_dir};
+    std::uint32_t root{0};
+    // Bumped whenever the slot is freed, so events still queued for the old directory are dropped
+    std::uint32_t generation{0};
+    bool used{false};
+    dev_t dev{0};
+    ino_t ino{0};
+    // inotify watch, or the fanotify key of its file handle
+    int wd{-1};
+    std::string handle;
+    // The counted files plus the directory itself, as in a snapshot entry
+    std::uint64_t files{0};
+    std::uint64_t bytes{0};
+    std::uint64_t blocks{0};
+    // Size of the directory itself, only the change is applied when it is looked at again
+    std::uint64_t own_bytes{0};
+    std::uint64_t own_blocks{0};
+    std::unordered_map<std::string, WatchFile> entries;
+    std::unordered_map<std::string, std::uint32_t> subdirs;
+} WatchDir;
+
+// A name some event was about, empty for the directory itself
+typedef struct Change
+{
+    std::uint32_t dir{0};
+    std::uint32_t generation{0};
+    std::string name;
+} Change;
+
+// A file a scan counted, kept with its path until the directory it is in can be found
+typedef struct ScannedFile
+{
+    std::uint32_t root{0};
+    std::string path;
+    struct stat st{};
+} ScannedFile;
+
+typedef struct alignas(64) FileShard
+{
+    std::mutex mutex;
+    std::vector<ScannedFile> files;
+} FileShard;
+
+typedef struct WatchState
+{
+    Options options;
+    WatchOptions watch;
+    const WatchCallbacks *callbacks{nullptr};
+    std::vector<std::string> paths;
+    // fanotify or inotify once the source is open
+    WatchSource source{WatchSource::inotify};
+    int fd{-1};
+    // Slots of freed directories are reused, so an index only means a directory along with its generation
+    std::vector<WatchDir> dirs;
+    std::vector<std::uint32_t> free_dirs;
+    // Directory of each root, no_dir while it is not one
+    std::vector<std::uint32_t> roots;
+    std::vector<std::uint64_t> errors;
+    std::unordered_map<FileKey, LinkedFile, FileKeyHash> links;
+    // Directory of every file with one link, a link made to it later has no event that names it
+    std::unordered_map<FileKey, std::uint32_t, FileKeyHash> singles;
+    // Two roots may hold the same directory, so a watch may be for several
+    std::unordered_multimap<int, std::uint32_t> by_wd;
+    std::unordered_multimap<std::string, std::uint32_t> by_handle;
+    // fsid of each fanotify marked filesystem, empty if it could not be marked
+    std::map<dev_t, std::string> filesystems;
+    std::vector<Change> changes;
+    std::vector<char> buffer;
+    // Reads every directory that has to be read whole, with the threads and I/O options asks for
+    Scanner *scanner{nullptr};
+    std::stop_token stop;
+    // While a scan runs, the directory of each path it was given, and every directory it opened by its path
+    std::vector<std::uint32_t> scanning;
+    std::vector<std::unordered_map<std::string, std::uint32_t, PathHash, std::equal_to<> > > opened;
+    // Held by a worker adding a directory to the tree, and while events are read during a scan
+    std::mutex mutex;
+    std::array<FileShard, file_shards> files;
+    // What went wrong while the workers held the tree, reported once the scan is done
+    std::vector<ScanError> scan_errors;
+    // A scan was stopped before it was done, the tree is missing what it did not read
+    bool cancelled{false};
+    // Why a scan went on without io_uring, kept for the totals
+    int ring_error{0};
+    int prefetch_error{0};
+    // Events were lost, the whole tree has to be scanned again
+    bool overflowed{false};
+    // inotify_add_watch() hit fs.inotify.max_user_watches, reported once
+    bool out_of_watches{false};
+    // Changed since the snapshot was last written
+    bool dirty{false};
+    int snapshot_error{0};
+} WatchState;
+
+/**
+ * scan_all() - Scans every root anew with a newly opened event source.
+ * Calls on_scan with the totals once done.
+ *
+ * @state: The watch, anything it had is dropped.
+ *
+ * Returns: 0, or the errno if no event source could be opened.
+ *
+ */
+int scan_all(WatchState &state);
+
+/**
+ * open_source() - Opens fanotify or inotify as WatchOptions::source asks.
+ * Automatically fanotify is only used if every root's filesystem can be
+ * marked, which takes CAP_SYS_ADMIN.
+ *
+ * @state: The watch, its fd is set.
+ *
+ * Returns: 0, or the errno of the source asked for.
+ *
+ */
+int open_source(WatchState &state);
+
+/**
+ * add_root() - Adds one root to the tree, with nothing in it until it is scanned.
+ *
+ * @state: The watch.
+ * @root: Index of the path.
+ *
+ * Returns: 0, or the errno if it is not a directory that can be looked up.
+ *
+ */
+int add_root(WatchState &state, std::uint32_t root);
+
+/**
+ * scan_dirs() - Reads directories and everything below them with the Scanner.
+ * The events that come meanwhile are queued, to be looked at afterwards.
+ *
+ * @state: The watch.
+ * @dirs: Directories already in the tree, with nothing in them yet.
+ *
+ * Returns: Nothing.
+ *
+ */
+void scan_dirs(WatchState &state, const std::vector<std::uint32_t> &dirs);
+
+/**
+ * open_directory() - Adds a directory a worker of the scan opened and watches it.
+ * The watch comes before the first name is read, so a file that
+ * changes after it was counted always has an event. Runs on the worker.
+ *
+ * @state: The watch, its mutex is taken.
+ * @opened: The directory, below one of WatchState::scanning.
+ *
+ * Returns: Nothing.
+ *
+ */
+void open_directory(WatchState &state, const OpenedDirectory &opened);
+
+/**
+ * watch_directory() - Has the event source report changes in a directory.
+ * With fanotify this marks its filesystem the first time one is seen.
+ * What fails goes to WatchState::scan_errors, it runs while a scan does.
+ *
+ * @state: The watch.
+ * @dir: Directory in the tree.
+ * @fd: Its open fd.
+ * @path: Its path, for errors.
+ *
+ * Returns: Nothing.
+ *
+ */
+void watch_directory(WatchState &state, std::uint32_t dir, int fd, const std::string &path);
+
+/**
+ * read_events() - Queues the changes the event source has for the tree.
+ * Events for directories not in the tree are dropped.
+ *
+ * @state: The watch.
+ *
+ * Returns: Nothing.
+ *
+ */
+void read_events(WatchState &state);
+
+/**
+ * apply_changes() - Looks at every queued name once.
+ *
+ * @state: The watch.
+ *
+ * Returns: Nothing.
+ *
+ */
+void apply_changes(WatchState &state);
+
+/**
+ * look_up() - Makes one name of a directory agree with what is there now.
+ * A file gets its size updated, a new or replaced directory is scanned
+ * and whatever is gone is removed.
+ *
+ * @state: The watch.
+ * @dir: Directory in the tree.
+ * @name: Name directly in it.
+ *
+ * Returns: Nothing.
+ *
+ */
+void look_up(WatchState &state, std::uint32_t dir, const std::string &name);
+
+/**
+ * refresh_directory() - Updates the size of a directory itself.
+ * A root that is gone or was replaced is scanned again.
+ *
+ * @state: The watch.
+ * @dir: Directory in the tree.
+ *
+ * Returns: Nothing.
+ *
+ */
+void refresh_directory(WatchState &state, std::uint32_t dir);
+
+/**
+ * set_file() - Counts a file of a directory, or updates its size.
+ *
+ * @state: The watch.
+ * @dir: Directory in the tree.
+ * @name: Name of the file in it.
+ * @st: What the file is now.
+ *
+ * Returns: Nothing.
+ *
+ */
+void set_file(WatchState &state, std::uint32_t dir, const std::string &name, const struct stat &st);
+
+/**
+ * remove_file() - Stops counting a file, if the directory has it.
+ * If it was the counted link of a hard linked file, the next link is
+ * counted instead.
+ *
+ * @state: The watch.
+ * @dir: Directory in the tree.
+ * @name: Name of the file in it.
+ *
+ * Returns: Nothing.
+ *
+ */
+void remove_file(WatchState &state, std::uint32_t dir, const std::string &name);
+
+/**
+ * remove_dir() - Removes a directory and everything below it from the tree.
+ *
+ * @state: The watch.
+ * @dir: Directory in the tree, a root's slot in WatchState::roots is left for the caller.
+ *
+ * Returns: Nothing.
+ *
+ */
+void remove_dir(WatchState &state, std::uint32_t dir);
+
+/**
+ * new_dir() - Adds an empty directory to the tree.
+ *
+ * @state: The watch.
+ * @parent: Directory it is in, no_dir for a root.
+ * @root: Index of the root it is below.
+ * @name: Its name, a root's whole path.
+ *
+ * Returns: Its index.
+ *
+ */
+std::uint32_t new_dir(WatchState &state, std::uint32_t parent, std::uint32_t root, const std::string &name);
+
+/**
+ * dir_path() - Path of a directory in the tree, starting with its root's.
+ *
+ * @state: The watch.
+ * @dir: Directory in the tree.
+ *
+ * Returns: The path.
+ *
+ */
+std::string dir_path(const WatchState &state, std::uint32_t dir);
+
+/**
+ * write_totals() - Writes the snapshot of the tree as it is now.
+ *
+ * @state: The watch.
+ *
+ * Returns: Nothing, a failure goes to on_error once until it works again.
+ *
+ */
+void write_totals(WatchState &state);
+
+/**
+ * totals() - Totals of every root, as a scan would give them.
+ *
+ * @state: The watch.
+ *
+ * Returns: The result, with errors left to on_error.
+ *
+ */
+ScanResult totals(const WatchState &state);
+
+/**
+ * report() - Hands an error to on_error.
+ *
+ * @state: The watch.
+ * @operation: What failed.
+ * @root: Index of the root it is below.
+ * @path: What it failed on.
+ * @code: The errno.
+ *
+ * Returns: Nothing.
+ *
+ */
+void report(WatchState &state, ScanError::Operation operation, std::uint32_t root, const std::string &path, int code);
+
+// path/name, without doubling the slash of a root like "/"
+std::string child_path(const std::string &path, std::string_view name)
+{
+    std::string out = path;
+    if (out.empty() || out.back() != '/')
+    {
+        out.push_back('/');
+    }
+    out.append(name);
+    return out;
+}
+
+#ifdef MDU_FANOTIFY
+// fsid, handle type and handle bytes, what identifies a directory in a fanotify event
+std::string handle_key(const void *fsid, int type, const unsigned char *bytes, unsigned int size)
+{
+    std::string key(static_cast<const char *>(fsid), fsid_size);
+    key.append(reinterpret_cast<const char *>(&type), sizeof(type));
+    key.append(reinterpret_cast<const char *>(bytes), size);
+    return key;
+}
+
+// Marks the filesystem of fd once, false with errno set if it cannot be
+bool mark_filesystem(WatchState &state, dev_t dev, int fd)
+{
+    struct statfs fs{};
+    std::string &fsid = state.filesystems[dev];
+    if (fanotify_mark(state.fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, fanotify_mask, fd, nullptr) != 0 ||
+        fstatfs(fd, &fs) != 0)
+    {
+        return false;
+    }
+    fsid.assign(reinterpret_cast<const char *>(&fs.f_fsid), sizeof(fs.f_fsid));
+    return true;
+}
+#endif
+
+// Directory of the running scan a path it gave is directly in, no_dir if none, and the last component
+std::pair<std::uint32_t, std::string_view> find_parent(const WatchState &state, std::uint32_t root,
+                                                       std::string_view path)
+{
+    std::size_t slash = path.rfind('/');
+    if (slash == std::string_view::npos)
+    {
+        return {no_dir, path};
+    }
+    const auto &opened = state.opened[root];
+    // Only a scanned path like "/" or "dir/" keeps its slash, the paths below it do not double it
+    for (std::size_t end : {slash, slash + 1})
+    {
+        if (auto it = opened.find(path.substr(0, end)); it != opened.end())
+        {
+            return {it->second, path.substr(slash + 1)};
+        }
+    }
+    return {no_dir, path.substr(slash + 1)};
+}
+
+template<typename Key>
+void queue_changes(WatchState &state, const std::unordered_multimap<Key, std::uint32_t> &watched, const Key &key,
+                   const std::string &name)
+{
+    auto [first, last] = watched.equal_range(key);
+    for (; first != last; ++first)
+    {
+        state.changes.push_back(Change{first->second, state.dirs[first->second].generation, name});
+    }
+}
+
+int watch_paths(const Options &options, const WatchOptions &watch, const std::vector<std::string> &paths,
+                const WatchCallbacks &callbacks, std::stop_token stop)
+{
+    using Clock = std::chrono::steady_clock;
+    WatchState state;
+    state.options = options;
+    state.watch = watch;
+    state.callbacks = &callbacks;
+    state.paths = paths;
+    state.stop = stop;
+    state.buffer.resize(event_buffer_size);
+
+    // Every link is reported, the watch counts a hard linked file once itself as links come and go.
+    // Files are reported one by one, which is what the cache and the scan's other output are not read for
+    Options scan = options;
+    scan.count_links = true;
+    scan.max_depth = -1;
+    scan.cache_file.clear();
+    scan.export_file.clear();
+    scan.top = 0;
+    scan.by_owner = false;
+    scan.by_ext = false;
+    scan.histogram = false;
+    Scanner scanner(scan);
+    state.scanner = &scanner;
+
+    int wake[2];
+    if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        return 1;
+    }
+    // Wakes the loop on a stop request, instead of at the next event
+    auto wake_up = [&wake]() {
+        char byte = 0;
+        [[maybe_unused]] ssize_t n = write(wake[1], &byte, 1);
+    };
+    std::optional<std::stop_callback<decltype(wake_up)> > on_stop;
+    on_stop.emplace(stop, wake_up);
+
+    int result = 0;
+    if (int code = scan_all(state); code != 0)
+    {
+        report(state, ScanError::Operation::watch_directory, 0, paths.empty() ? std::string() : paths.front(), code);
+        result = 1;
+    }
+    else if (std::count(state.roots.begin(), state.roots.end(), no_dir) == static_cast<std::ptrdiff_t>(paths.size()))
+    {
+        result = 1;
+    }
+
+    // The first snapshot is written right away
+    Clock::time_point last = Clock::now() - watch.interval;
+    while (result == 0 && !stop.stop_requested())
+    {
+        if (state.overflowed)
+        {
+            // Some events were lost, only a new scan is sure to be right
+            if (int code = scan_all(state); code != 0)
+            {
+                report(state, ScanError::Operation::watch_directory, 0, paths.front(), code);
+                result = 1;
+            }
+            continue;
+        }
+
+        Clock::time_point now = Clock::now();
+        if (now - last >= watch.interval)
+        {
+            if (state.dirty)
+            {
+                write_totals(state);
+            }
+            // A root that is gone is looked for again, quietly
+            std::vector<std::uint32_t> back;
+            for (std::uint32_t root = 0; root < state.roots.size(); ++root)
+            {
+                if (state.roots[root] == no_dir && add_root(state, root) == 0)
+                {
+                    back.push_back(state.roots[root]);
+                }
+            }
+            if (!back.empty())
+            {
+                scan_dirs(state, back);
+                state.dirty = true;
+            }
+            last = now;
+        }
+
+        int timeout = -1;
+        if (!state.changes.empty())
+        {
+            // Read while a directory was scanned, the kernel may have nothing more to wake the loop with
+            timeout = 0;
+        }
+        else if (state.dirty || std::find(state.roots.begin(), state.roots.end(), no_dir) != state.roots.end())
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(last + watch.interval - now);
+            timeout = static_cast<int>(std::max<std::chrono::milliseconds::rep>(left.count(), 0));
+        }
+        pollfd ready[2] = {{state.fd, POLLIN, 0}, {wake[0], POLLIN, 0}};
+        if (poll(ready, 2, timeout) < 0 && errno != EINTR)
+        {
+            result = 1;
+            break;
+        }
+        if (ready[0].revents & POLLIN)
+        {
+            read_events(state);
+        }
+        if (!state.changes.empty())
+        {
+            apply_changes(state);
+        }
+    }
+    // A scan cut short by the stop is missing directories, the last snapshot is better
+    if (result == 0 && state.dirty && !state.cancelled)
+    {
+        write_totals(state);
+    }
+
+    // Waits for a stop request still writing to the pipe
+    on_stop.reset();
+    if (state.fd >= 0)
+    {
+        close(state.fd);
+    }
+    close(wake[0]);
+    close(wake[1]);
+    return result;
+}
+
+int scan_all(WatchState &state)
+{
+    if (state.fd >= 0)
+    {
+        close(state.fd);
+        state.fd = -1;
+    }
+    state.dirs.clear();
+    state.free_dirs.clear();
+    state.links.clear();
+    state.singles.clear();
+    state.by_wd.clear();
+    state.by_handle.clear();
+    state.filesystems.clear();
+    state.changes.clear();
+    state.overflowed = false;
+    state.out_of_watches = false;
+    state.roots.assign(state.paths.size(), no_dir);
+    state.errors.assign(state.paths.size(), 0);
+    if (int code = open_source(state); code != 0)
+    {
+        return code;
+    }
+
+    // All roots in one scan, so the workers have all of them to share
+    std::vector<std::uint32_t> dirs;
+    for (std::uint32_t root = 0; root < state.paths.size(); ++root)
+    {
+        if (int code = add_root(state, root); code != 0)
+        {
+            report(state, code == ENOTDIR ? ScanError::Operation::watch_directory : ScanError::Operation::stat, root,
+                   state.paths[root], code);
+            continue;
+        }
+        dirs.push_back(state.roots[root]);
+    }
+    if (!dirs.empty())
+    {
+        scan_dirs(state, dirs);
+    }
+    state.dirty = true;
+    if (state.callbacks->on_scan && !state.cancelled)
+    {
+        state.callbacks->on_scan(totals(state));
+    }
+    return 0;
+}
+
+int open_source(WatchState &state)
+{
+#ifdef MDU_FANOTIFY
+    if (state.watch.source != WatchSource::inotify)
+    {
+        int code = 0;
+        state.fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK,
+                                 O_RDONLY | O_LARGEFILE);
+        if (state.fd < 0)
+        {
+            code = errno;
+        }
+        for (std::size_t root = 0; state.fd >= 0 && code == 0 && root < state.paths.size(); ++root)
+        {
+            // Roots that are not directories are left to start_root() to report
+            int fd = open(state.paths[root].c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            struct stat st{};
+            if (fd >= 0 && fstat(fd, &st) == 0 && !state.filesystems.contains(st.st_dev) &&
+                !mark_filesystem(state, st.st_dev, fd))
+            {
+                code = errno;
+            }
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+        if (code == 0)
+        {
+            state.source = WatchSource::fanotify;
+            return 0;
+        }
+        if (state.fd >= 0)
+        {
+            close(state.fd);
+            state.fd = -1;
+        }
+        state.filesystems.clear();
+        if (state.watch.source == WatchSource::fanotify)
+        {
+            return code;
+        }
+    }
+#else
+    if (state.watch.source == WatchSource::fanotify)
+    {
+        return EOPNOTSUPP;
+    }
+#endif
+    state.source = WatchSource::inotify;
+    state.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return state.fd < 0 ? errno : 0;
+}
+
+int add_root(WatchState &state, std::uint32_t root)
+{
+    const std::string &path = state.paths[root];
+    struct stat st{};
+    if (stat(path.c_str(), &st) != 0)
+    {
+        return errno;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        return ENOTDIR;
+    }
+    state.roots[root] = new_dir(state, no_dir, root, path);
+    return 0;
+}
+
+// Takes the size of the directory itself from st, only what changed reaches its totals
+void set_own(WatchState &state, std::uint32_t dir, const struct stat &st)
+{
+    WatchDir &node = state.dirs[dir];
+    std::uint64_t bytes = static_cast<std::uint64_t>(st.st_size);
+    std::uint64_t blocks = static_cast<std::uint64_t>(st.st_blocks) * 512;
+    node.bytes += bytes - node.own_bytes;
+    node.blocks += blocks - node.own_blocks;
+    node.own_bytes = bytes;
+    node.own_blocks = blocks;
+    node.dev = st.st_dev;
+    node.ino = st.st_ino;
+}
+
+void scan_dirs(WatchState &state, const std::vector<std::uint32_t> &dirs)
+{
+    std::vector<std::string> paths;
+    paths.reserve(dirs.size());
+    state.scanning = dirs;
+    state.opened.assign(dirs.size(), {});
+    for (std::uint32_t i = 0; i < dirs.size(); ++i)
+    {
+        paths.push_back(dir_path(state, dirs[i]));
+        state.opened[i].emplace(paths.back(), dirs[i]);
+    }
+
+    ScanCallbacks callbacks;
+    callbacks.on_open = [&state](const OpenedDirectory &opened) { open_directory(state, opened); };
+    callbacks.on_file = [&state](const FileResult &file) {
+        // Thread ids are mostly aligned addresses, only the high bits of the product are well mixed
+        std::uint64_t hash = std::hash<std::thread::id>()(std::this_thread::get_id()) * 0x9e3779b97f4a7c15ULL;
+        FileShard &shard = state.files[(hash >> 32) % file_shards];
+        ScannedFile scanned{file.root, std::string(file.path), {}};
+        scanned.st.st_size = static_cast<off_t>(file.bytes);
+        scanned.st.st_blocks = static_cast<blkcnt_t>(file.blocks / 512);
+        scanned.st.st_dev = static_cast<dev_t>(file.dev);
+        scanned.st.st_ino = static_cast<ino_t>(file.ino);
+        scanned.st.st_nlink = static_cast<nlink_t>(file.links);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.files.push_back(std::move(scanned));
+    };
+    // A long scan would overflow the kernel's queue, what the events are about is looked at after it
+    callbacks.on_progress = [&state](const Progress &) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        read_events(state);
+    };
+    ScanResult result = state.scanner->scan(paths, callbacks, state.stop);
+    state.cancelled = state.cancelled || result.cancelled;
+    state.ring_error = result.ring_error != 0 ? result.ring_error : state.ring_error;
+    state.prefetch_error = result.prefetch_error != 0 ? result.prefetch_error : state.prefetch_error;
+
+    for (FileShard &shard : state.files)
+    {
+        for (const ScannedFile &file : shard.files)
+        {
+            if (auto [dir, name] = find_parent(state, file.root, file.path); dir != no_dir)
+            {
+                set_file(state, dir, std::string(name), file.st);
+            }
+        }
+        std::vector<ScannedFile>().swap(shard.files);
+    }
+
+    for (const ScanError &error : result.errors)
+    {
+        const WatchDir &node = state.dirs[dirs[error.root]];
+        // A directory below a root may be gone already, its parent's events remove it
+        if (node.parent != no_dir && error.path == paths[error.root] && (error.code == ENOENT || error.code == ENOTDIR))
+        {
+            continue;
+        }
+        state.scan_errors.push_back(ScanError{error.operation, node.root, error.path, error.code});
+    }
+    // Only counted, against the first of the directories
+    state.errors[state.dirs[dirs.front()].root] += result.errors_dropped;
+    state.scanning.clear();
+    state.opened.clear();
+
+    std::vector<ScanError> errors;
+    errors.swap(state.scan_errors);
+    for (const ScanError &error : errors)
+    {
+        report(state, error.operation, error.root, error.path, error.code);
+    }
+}
+
+void open_directory(WatchState &state, const OpenedDirectory &opened)
+{
+    std::lock_guard<std::mutex> lock(state.mutex);
+    std::uint32_t dir = no_dir;
+    if (opened.depth == 0)
+    {
+        dir = state.scanning[opened.root];
+    }
+    else
+    {
+        auto [parent, name] = find_parent(state, opened.root, opened.path);
+        if (parent == no_dir)
+        {
+            return;
+        }
+        dir = new_dir(state, parent, state.dirs[parent].root, std::string(name));
+        state.opened[opened.root].emplace(opened.path, dir);
+    }
+
+    std::string path(opened.path);
+    bool top = state.dirs[dir].parent == no_dir;
+    int fd = opened.fd;
+    if (fd < 0)
+    {
+        // The portable backend has not opened it yet
+        fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | (top ? 0 : O_NOFOLLOW));
+        if (fd < 0)
+        {
+            // Deleted since its parent was read, the parent's event removes it
+            if (errno != ENOENT)
+            {
+                state.scan_errors.push_back(
+                    ScanError{ScanError::Operation::watch_directory, state.dirs[dir].root, path, errno});
+            }
+            return;
+        }
+    }
+    struct stat st{};
+    if (fstat(fd, &st) == 0)
+    {
+        set_own(state, dir, st);
+    }
+    watch_directory(state, dir, fd, path);
+    if (fd != opened.fd)
+    {
+        close(fd);
+    }
+}
+
+void watch_directory(WatchState &state, std::uint32_t dir, int fd, const std::string &path)
+{
+    WatchDir &node = state.dirs[dir];
+#ifdef MDU_FANOTIFY
+    if (state.source == WatchSource::fanotify)
+    {
+        // Another filesystem mounted below a root needs a mark of its own
+        if (!state.filesystems.contains(node.dev) && !mark_filesystem(state, node.dev, fd))
+        {
+            state.scan_errors.push_back(ScanError{ScanError::Operation::watch_directory, node.root, path, errno});
+        }
+        const std::string &fsid = state.filesystems[node.dev];
+        if (fsid.empty())
+        {
+            return;
+        }
+        alignas(file_handle) unsigned char storage[sizeof(file_handle) + MAX_HANDLE_SZ];
+        file_handle *handle = reinterpret_cast<file_handle *>(storage);
+        handle->handle_bytes = MAX_HANDLE_SZ;
+        int mount_id = 0;
+        if (name_to_handle_at(fd, "", handle, &mount_id, AT_EMPTY_PATH) != 0)
+        {
+            state.scan_errors.push_back(ScanError{ScanError::Operation::watch_directory, node.root, path, errno});
+            return;
+        }
+        node.handle = handle_key(fsid.data(), handle->handle_type, handle->f_handle, handle->handle_bytes);
+        state.by_handle.emplace(node.handle, dir);
+        return;
+    }
+#endif
+    if (state.out_of_watches)
+    {
+        return;
+    }
+    // Through the fd, so the watch is on the very directory being read
+    std::string self = "/proc/self/fd/" + std::to_string(fd);
+    int wd = inotify_add_watch(state.fd, self.c_str(), inotify_mask);
+    if (wd < 0 && errno == ENOENT)
+    {
+        // No /proc, the path is all there is
+        wd = inotify_add_watch(state.fd, path.c_str(), inotify_mask | (node.parent == no_dir ? 0 : IN_DONT_FOLLOW));
+    }
+    if (wd < 0)
+    {
+        // Only the first directory over the limit is reported, every one after it would be too
+        state.out_of_watches = errno == ENOSPC;
+        state.scan_errors.push_back(ScanError{ScanError::Operation::watch_directory, node.root, path, errno});
+        return;
+    }
+    node.wd = wd;
+    state.by_wd.emplace(wd, dir);
+}
+
+void read_events(WatchState &state)
+{
+    for (int reads = 0; reads < max_reads; ++reads)
+    {
+        ssize_t n = read(state.fd, state.buffer.data(), state.buffer.size());
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            // EAGAIN, nothing left
+            return;
+        }
+#ifdef MDU_FANOTIFY
+        if (state.source == WatchSource::fanotify)
+        {
+            auto *event = reinterpret_cast<fanotify_event_metadata *>(state.buffer.data());
+            for (; FAN_EVENT_OK(event, n); event = FAN_EVENT_NEXT(event, n))
+            {
+                if (event->vers != FANOTIFY_METADATA_VERSION)
+                {
+                    return;
+                }
+                if (event->fd >= 0)
+                {
+                    close(event->fd);
+                }
+                if (event->mask & FAN_Q_OVERFLOW)
+                {
+                    state.overflowed = true;
+                    continue;
+                }
+                const unsigned char *end = reinterpret_cast<const unsigned char *>(event) + event->event_len;
+                const unsigned char *info = reinterpret_cast<const unsigned char *>(event) + event->metadata_len;
+                // An event on a directory itself names it with its own handle and "."
+                while (info + sizeof(fanotify_event_info_fid) + offsetof(file_handle, f_handle) <= end)
+                {
+                    fanotify_event_info_header header{};
+                    std::memcpy(&header, info, sizeof(header));
+                    if (header.len == 0 || info + header.len > end)
+                    {
+                        break;
+                    }
+                    if (header.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME || header.info_type == FAN_EVENT_INFO_TYPE_DFID)
+                    {
+                        const unsigned char *fid = info + offsetof(fanotify_event_info_fid, handle);
+                        unsigned int size = 0;
+                        int type = 0;
+                        std::memcpy(&size, fid + offsetof(file_handle, handle_bytes), sizeof(size));
+                        std::memcpy(&type, fid + offsetof(file_handle, handle_type), sizeof(type));
+                        const unsigned char *bytes = fid + offsetof(file_handle, f_handle);
+                        std::string name;
+                        if (header.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME && bytes + size < info + header.len)
+                        {
+                            name = reinterpret_cast<const char *>(bytes + size);
+                        }
+                        if (name == ".")
+                        {
+                            name.clear();
+                        }
+                        queue_changes(state, state.by_handle,
+                                      handle_key(info + offsetof(fanotify_event_info_fid, fsid), type, bytes, size), name);
+                    }
+                    info += header.len;
+                }
+            }
+            continue;
+        }
+#endif
+        for (ssize_t offset = 0; offset + static_cast<ssize_t>(sizeof(inotify_event)) <= n;)
+        {
+            const auto *event = reinterpret_cast<const inotify_event *>(state.buffer.data() + offset);
+            offset += sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                state.overflowed = true;
+                continue;
+            }
+            if (event->mask & IN_IGNORED)
+            {
+                continue;
+            }
+            queue_changes(state, state.by_wd, event->wd, std::string(event->len > 0 ? event->name : ""));
+        }
+    }
+}
+
+void apply_changes(WatchState &state)
+{
+    // Scanning a new directory may queue more, they wait for the next round
+    std::vector<Change> changes;
+    changes.swap(state.changes);
+    std::sort(changes.begin(), changes.end(), [](const Change &a, const Change &b) {
+        return std::tie(a.dir, a.generation, a.name) < std::tie(b.dir, b.generation, b.name);
+    });
+    changes.erase(std::unique(changes.begin(), changes.end(),
+                              [](const Change &a, const Change &b) {
+                                  return a.dir == b.dir && a.generation == b.generation && a.name == b.name;
+                              }),
+                  changes.end());
+
+    auto current = [&state](const Change &change) {
+        const WatchDir &node = state.dirs[change.dir];
+        return node.used && node.generation == change.generation;
+    };
+    for (std::size_t i = 0; i < changes.size(); ++i)
+    {
+        const Change &change = changes[i];
+        if (!current(change))
+        {
+            continue;
+        }
+        state.dirty = true;
+        if (!change.name.empty())
+        {
+            look_up(state, change.dir, change.name);
+        }
+        // Names coming and going change the size of the directory itself, it is looked at once after them
+        bool last = i + 1 == changes.size() || changes[i + 1].dir != change.dir ||
+                    changes[i + 1].generation != change.generation;
+        if (last && current(change))
+        {
+            refresh_directory(state, change.dir);
+        }
+    }
+}
+
+void look_up(WatchState &state, std::uint32_t dir, const std::string &name)
+{
+    std::string path = child_path(dir_path(state, dir), name);
+    struct stat st{};
+    auto subdir = [&state, dir, &name]() {
+        auto it = state.dirs[dir].subdirs.find(name);
+        return it == state.dirs[dir].subdirs.end() ? no_dir : it->second;
+    };
+    if (lstat(path.c_str(), &st) != 0)
+    {
+        if (errno != ENOENT && errno != ENOTDIR)
+        {
+            report(state, ScanError::Operation::stat, state.dirs[dir].root, path, errno);
+            return;
+        }
+        remove_file(state, dir, name);
+        if (std::uint32_t child = subdir(); child != no_dir)
+        {
+            remove_dir(state, child);
+        }
+        return;
+    }
+
+    std::uint32_t child = subdir();
+    if (!S_ISDIR(st.st_mode))
+    {
+        if (child != no_dir)
+        {
+            remove_dir(state, child);
+        }
+        set_file(state, dir, name, st);
+        return;
+    }
+    remove_file(state, dir, name);
+    if (child != no_dir)
+    {
+        const WatchDir &node = state.dirs[child];
+        // Still the same directory, whatever changed in it has events of its own
+        if (node.dev == st.st_dev && node.ino == st.st_ino)
+        {
+            return;
+        }
+        remove_dir(state, child);
+    }
+    scan_dirs(state, {new_dir(state, dir, state.dirs[dir].root, name)});
+}
+
+void refresh_directory(WatchState &state, std::uint32_t dir)
+{
+    const WatchDir &node = state.dirs[dir];
+    bool top = node.parent == no_dir;
+    std::string path = dir_path(state, dir);
+    struct stat st{};
+    if (fstatat(AT_FDCWD, path.c_str(), &st, top ? 0 : AT_SYMLINK_NOFOLLOW) != 0 || st.st_dev != node.dev ||
+        st.st_ino != node.ino)
+    {
+        // Gone or replaced, below a root the parent's events say so
+        if (top)
+        {
+            std::uint32_t root = node.root;
+            remove_dir(state, dir);
+            state.roots[root] = no_dir;
+            if (add_root(state, root) == 0)
+            {
+                scan_dirs(state, {state.roots[root]});
+            }
+        }
+        return;
+    }
+    set_own(state, dir, st);
+}
+
+void set_file(WatchState &state, std::uint32_t dir, const std::string &name, const struct stat &st)
+{
+    WatchDir &node = state.dirs[dir];
+    std::uint64_t bytes = static_cast<std::uint64_t>(st.st_size);
+    std::uint64_t blocks = static_cast<std::uint64_t>(st.st_blocks) * 512;
+    bool linked = st.st_nlink > 1 && !state.options.count_links;
+    if (auto it = node.entries.find(name); it != node.entries.end())
+    {
+        WatchFile &file = it->second;
+        if (!linked && !file.linked)
+        {
+            node.bytes += bytes - file.bytes;
+            node.blocks += blocks - file.blocks;
+            file.bytes = bytes;
+            file.blocks = blocks;
+            return;
+        }
+        if (linked && file.linked && file.dev == st.st_dev && file.ino == st.st_ino)
+        {
+            // Counted wherever its first link is
+            LinkedFile &shared = state.links[{node.root, file.dev, file.ino}];
+            WatchDir &counted = state.dirs[shared.links.front().first];
+            counted.bytes += bytes - shared.bytes;
+            counted.blocks += blocks - shared.blocks;
+            shared.bytes = bytes;
+            shared.blocks = blocks;
+            return;
+        }
+        remove_file(state, dir, name);
+    }
+
+    FileKey key{node.root, st.st_dev, st.st_ino};
+    if (!linked)
+    {
+        node.entries.emplace(name, WatchFile{bytes, blocks, false, st.st_dev, st.st_ino});
+        ++node.files;
+        node.bytes += bytes;
+        node.blocks += blocks;
+        if (!state.options.count_links)
+        {
+            state.singles[key] = dir;
+        }
+        return;
+    }
+    LinkedFile &shared = state.links[key];
+    if (shared.links.empty())
+    {
+        shared.bytes = bytes;
+        shared.blocks = blocks;
+        auto single = state.singles.find(key);
+        WatchFile *first = nullptr;
+        if (single != state.singles.end())
+        {
+            for (auto &[other, file] : state.dirs[single->second].entries)
+            {
+                if (!file.linked && file.dev == st.st_dev && file.ino == st.st_ino)
+                {
+                    shared.links.emplace_back(single->second, other);
+                    first = &file;
+                    break;
+                }
+            }
+            state.singles.erase(single);
+        }
+        if (first != nullptr)
+        {
+            // Counted when it had one link, it stays the counted one
+            WatchDir &counted = state.dirs[shared.links.front().first];
+            counted.bytes += bytes - first->bytes;
+            counted.blocks += blocks - first->blocks;
+            *first = WatchFile{0, 0, true, st.st_dev, st.st_ino};
+        }
+        else
+        {
+            ++node.files;
+            node.bytes += bytes;
+            node.blocks += blocks;
+        }
+    }
+    shared.links.emplace_back(dir, name);
+    node.entries.emplace(name, WatchFile{0, 0, true, st.st_dev, st.st_ino});
+}
+
+void remove_file(WatchState &state, std::uint32_t dir, const std::string &name)
+{
+    WatchDir &node = state.dirs[dir];
+    auto it = node.entries.find(name);
+    if (it == node.entries.end())
+    {
+        return;
+    }
+    WatchFile file = it->second;
+    node.entries.erase(it);
+    if (!file.linked)
+    {
+        --node.files;
+        node.bytes -= file.bytes;
+        node.blocks -= file.blocks;
+        // A file being moved may already have been counted where it went
+        if (auto single = state.singles.find({node.root, file.dev, file.ino});
+            single != state.singles.end() && single->second == dir)
+        {
+            state.singles.erase(single);
+        }
+        return;
+    }
+
+    auto shared = state.links.find({node.root, file.dev, file.ino});
+    auto &links = shared->second.links;
+    auto link = std::find(links.begin(), links.end(), std::make_pair(dir, name));
+    bool counted = link == links.begin();
+    links.erase(link);
+    if (counted)
+    {
+        --node.files;
+        node.bytes -= shared->second.bytes;
+        node.blocks -= shared->second.blocks;
+        if (!links.empty())
+        {
+            WatchDir &next = state.dirs[links.front().first];
+            ++next.files;
+            next.bytes += shared->second.bytes;
+            next.blocks += shared->second.blocks;
+        }
+    }
+    if (links.empty())
+    {
+        state.links.erase(shared);
+    }
+}
+
+void remove_dir(WatchState &state, std::uint32_t dir)
+{
+    std::vector<std::uint32_t> gone{dir};
+    for (std::size_t i = 0; i < gone.size(); ++i)
+    {
+        for (const auto &[name, child] : state.dirs[gone[i]].subdirs)
+        {
+            gone.push_back(child);
+        }
+    }
+    // Files first, a hard link counted in here may move to a directory that is not gone
+    for (std::uint32_t each : gone)
+    {
+        while (!state.dirs[each].entries.empty())
+        {
+            std::string name = state.dirs[each].entries.begin()->first;
+            remove_file(state, each, name);
+        }
+    }
+
+    if (std::uint32_t parent = state.dirs[dir].parent; parent != no_dir)
+    {
+        state.dirs[parent].subdirs.erase(state.dirs[dir].name);
+    }
+    auto forget = [](auto &watched, const auto &key, std::uint32_t each) {
+        auto [first, last] = watched.equal_range(key);
+        for (; first != last; ++first)
+        {
+            if (first->second == each)
+            {
+                watched.erase(first);
+                break;
+            }
+        }
+        return watched.count(key);
+    };
+    for (std::uint32_t each : gone)
+    {
+        WatchDir &node = state.dirs[each];
+        // A directory moved away still exists, it must not keep a watch that another root does not share
+        if (node.wd >= 0 && forget(state.by_wd, node.wd, each) == 0)
+        {
+            inotify_rm_watch(state.fd, node.wd);
+            state.out_of_watches = false;
+        }
+        if (!node.handle.empty())
+        {
+            forget(state.by_handle, node.handle, each);
+        }
+        std::uint32_t generation = node.generation + 1;
+        node = WatchDir{};
+        node.generation = generation;
+        state.free_dirs.push_back(each);
+    }
+}
+
+std::uint32_t new_dir(WatchState &state, std::uint32_t parent, std::uint32_t root, const std::string &name)
+{
+    std::uint32_t dir = 0;
+    if (!state.free_dirs.empty())
+    {
+        dir = state.free_dirs.back();
+        state.free_dirs.pop_back();
+    }
+    else
+    {
+        dir = static_cast<std::uint32_t>(state.dirs.size());
+        state.dirs.emplace_back();
+    }
+    WatchDir &node = state.dirs[dir];
+    node.name = name;
+    node.parent = parent;
+    node.root = root;
+    node.used = true;
+    if (parent != no_dir)
+    {
+        state.dirs[parent].subdirs[name] = dir;
+    }
+    return dir;
+}
+
+std::string dir_path(const WatchState &state, std::uint32_t dir)
+{
+    std::vector<const std::string *> names;
+    for (; dir != no_dir; dir = state.dirs[dir].parent)
+    {
+        names.push_back(&state.dirs[dir].name);
+    }
+    std::string path = *names.back();
+    for (auto it = names.rbegin() + 1; it != names.rend(); ++it)
+    {
+        path = child_path(path, **it);
+    }
+    return path;
+}
+
+void write_totals(WatchState &state)
+{
+    std::vector<SnapshotEntry> entries;
+    entries.reserve(state.dirs.size() - state.free_dirs.size());
+    for (std::uint32_t dir = 0; dir < state.dirs.size(); ++dir)
+    {
+        const WatchDir &node = state.dirs[dir];
+        if (node.used)
+        {
+            std::uint64_t parent = node.parent == no_dir ? 0 : node.parent + 1ULL;
+            entries.push_back(SnapshotEntry{dir + 1ULL, parent, node.root, true, node.name, node.files, node.bytes,
+                                            node.blocks});
+        }
+    }
+    int code = write_snapshot(state.watch.snapshot, entries);
+    if (code != 0 && code != state.snapshot_error)
+    {
+        report(state, ScanError::Operation::write_snapshot, 0, state.watch.snapshot, code);
+    }
+    state.snapshot_error = code;
+    // Written again after the next change, or the next interval if it failed
+    state.dirty = code != 0;
+}
+
+ScanResult totals(const WatchState &state)
+{
+    ScanResult result;
+    result.ring_error = state.ring_error;
+    result.prefetch_error = state.prefetch_error;
+    result.roots.resize(state.paths.size());
+    for (std::uint32_t root = 0; root < state.paths.size(); ++root)
+    {
+        RootResult &out = result.roots[root];
+        out.index = root;
+        out.path = state.paths[root];
+        out.totals.errors = state.errors[root];
+        result.error |= out.totals.errors > 0 ? 1 : 0;
+        if (state.roots[root] == no_dir)
+        {
+            struct stat st{};
+            out.error = stat(out.path.c_str(), &st) != 0 ? errno : ENOTDIR;
+        }
+    }
+    for (const WatchDir &node : state.dirs)
+    {
+        if (!node.used)
+        {
+            continue;
+        }
+        Counters &counters = result.roots[node.root].totals;
+        ++counters.dirs;
+        counters.files += node.files;
+        counters.bytes += node.bytes;
+        counters.blocks += node.blocks;
+        for (const auto &[name, file] : node.entries)
+        {
+            counters.linked += file.linked ? 1 : 0;
+        }
+    }
+    for (RootResult &root : result.roots)
+    {
+        root.size = state.options.apparent_size ? root.totals.bytes : root.totals.blocks;
+    }
+    return result;
+}
+
+void report(WatchState &state, ScanError::Operation operation, std::uint32_t root, const std::string &path, int code)
+{
+    if (root < state.errors.size())
+    {
+        ++state.errors[root];
+    }
+    if (state.callbacks->on_error)
+    {
+        state.callbacks->on_error(ScanError{operation, root, path, code});
+    }
+}
+#endif
@@ -0,0 +1,65 @@
+#ifndef MDU_WATCH_H
+#define MDU_WATCH_H
+
+#include "mdu.h"
+
+/*
+ * Keeping the totals of a tree current after one full scan. Every
+ * directory is watched before it is read, so nothing that changes
+ * afterwards is missed, and each event only looks at the one name it is
+ * about. The totals are written as an --export snapshot, so mdu query
+ * answers from them while the tree keeps changing.
+ *
+ * fanotify with FAN_REPORT_DFID_NAME needs one mark per filesystem but
+ * CAP_SYS_ADMIN and Linux 5.9, inotify needs a watch per directory,
+ * limited by fs.inotify.max_user_watches.
+ *
+ * Author: Marcus Lundqvist.
+ */
+
+// What changed is looked at with lstat(), the portable backend needs it as well
+#if __has_include(<sys/inotify.h>) && (defined(MDU_GETDENTS) || defined(MDU_LSTAT))
+#define MDU_WATCH 1
+#endif
+
+// Where the events come from
+enum class WatchSource
+{
+    // fanotify where it can be used, otherwise inotify
+    automatic,
+    fanotify,
+    inotify
+};
+
+typedef struct WatchOptions
+{
+    // Snapshot rewritten with the current totals, empty when not watching
+    std::string snapshot;
+    // The snapshot is rewritten at most this often, and only after a change
+    std::chrono::milliseconds interval{1000};
+    WatchSource source{WatchSource::automatic};
+} WatchOptions;
+
+typedef struct WatchCallbacks
+{
+    // After the first scan, and after every one redone because events were lost
+    std::function<void(const ScanResult &)> on_scan;
+    // Whatever could not be read, watched or written, as it happens
+    std::function<void(const ScanError &)> on_error;
+} WatchCallbacks;
+
+#ifdef MDU_WATCH
+/*
+ * Scans paths and keeps their totals current until stop is requested,
+ * writing the snapshot once more before returning. The scans run on a
+ * Scanner of its own with options, except that files are counted one
+ * by one, so the cache file, the export and the breakdowns are not used.
+ * A root that is removed is left out of the snapshot until it is back.
+ * Returns 0 once stopped, 1 if no events could be watched for or none
+ * of the paths is a directory.
+ */
+int watch_paths(const Options &options, const WatchOptions &watch, const std::vector<std::string> &paths,
+                const WatchCallbacks &callbacks = {}, std::stop_token stop = {});
+#endif
+
+#endif
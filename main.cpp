@@ -1,16 +1,31 @@
 #include <iostream>
-#include <stack>
 #include <vector>
+#include <deque>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
 #include <filesystem>
 #include <chrono>
+#include <optional>
+#include <algorithm>
+#include <cstring>
+
+#include "mdu.h"
+#include "cluster.h"
+#include "snapshot.h"
+#include "watch.h"
+
+#ifdef MDU_WATCH
+#include <cerrno>
+#include <csignal>
+#include <pthread.h>
+#endif
 
 /*
  * Implementation of mdu,
  * a program that uses multithreading to measure disk usage.
- * Usage: mdu -j {number of threads} {file} [files ...]
+ * The scanning itself is libmdu, this is the command line on top of it.
+ * Usage: mdu -j {number of threads|auto} [--apparent-size] [--count-links] [--max-depth N] [--as-completed] [--stats[=json]] [--io-uring] [--cache FILE] [--format=text|ndjson|binary] [--max-queue-mem BYTES[K|M|G]] [--split-threshold N] [--stat-threads N] [--top N [--files]] [--by-owner] [--by-ext] [--histogram] [--affinity|--numa] [--export SNAPSHOT] [--order=dfs|bfs|hybrid[:K]] [--prefetch K] [--inline N] [--quiet] [--watch SNAPSHOT [--watch-interval SECONDS] [--inotify]] [--coordinator [ADDRESS:]PORT] {file} [files ...] | mdu -j N --worker HOST[:PORT] | mdu query SNAPSHOT [path] [--ls] [--top N] [--apparent-size]
  *
  * Author: Marcus Lundqvist.
  *
@@ -18,19 +33,123 @@
  * Version information:
  */
 
-// Struct for the threads to read from and write to
-typedef struct ThreadInfo
+/*
+ * Writes --format records to stdout on its own thread. Workers fill a
+ * buffer of their own and only hand it over when it is full, so they
+ * never wait on whoever reads the pipe.
+ */
+class OutputWriter
 {
-    std::pair<std::stack<std::string>, std::uintmax_t> stack;
-    int error{0};
-    int process_count{0};
-    bool no_more_work{false};
-    std::mutex mutex;
-    std::condition_variable work_available;
-    std::condition_variable threads_complete;
+private:
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<std::string> m_queue;
+    // Written buffers, handed back so their capacity is reused
+    std::vector<std::string> m_spare;
+    bool m_done{false};
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true)
+        {
+            m_ready.wait(lock, [this]() { return m_done || !m_queue.empty(); });
+            if (m_queue.empty())
+            {
+                break;
+            }
+            std::string buffer = std::move(m_queue.front());
+            m_queue.pop_front();
+            lock.unlock();
+            std::cout.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            buffer.clear();
+            lock.lock();
+            m_spare.push_back(std::move(buffer));
+        }
+        std::cout.flush();
+    }
+
+public:
+    static constexpr std::size_t buffer_size = 64 * 1024;
+
+    OutputWriter() = default;
+    OutputWriter(const OutputWriter &) = delete;
+    OutputWriter &operator=(const OutputWriter &) = delete;
+
+    ~OutputWriter()
+    {
+        finish();
+    }
+
+    void start()
+    {
+        m_thread = std::thread([this]() { run(); });
+    }
+
+    // Queues buffer for writing and leaves an empty one in its place
+    void submit(std::string &buffer)
+    {
+        if (buffer.empty())
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(std::move(buffer));
+        buffer.clear();
+        if (!m_spare.empty())
+        {
+            buffer = std::move(m_spare.back());
+            m_spare.pop_back();
+        }
+        m_ready.notify_one();
+    }
 
+    // Writes everything queued and stops the thread
+    void finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_done = true;
+        }
+        m_ready.notify_one();
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    }
+};
 
-} ThreadInfo;
+// How results are written, text is the original human readable output
+enum class Format
+{
+    text,
+    ndjson,
+    binary
+};
+
+// Command line options, on top of what the scanner itself takes
+typedef struct CliOptions
+{
+    Options scan;
+    // Print roots as they complete instead of in argument order
+    bool as_completed{false};
+    // Print run statistics at exit, as text or JSON
+    bool stats{false};
+    bool stats_json{false};
+    Format format{Format::text};
+    // Text output without the thread count, the echoed arguments and the time
+    bool quiet{false};
+    // Scan as the coordinator of --worker processes, listening on this port
+    std::optional<std::uint16_t> coordinator;
+    // Address it listens on, empty for loopback only
+    std::string coordinator_address;
+    // Scan for the coordinator there instead of scanning any paths
+    std::string worker_host;
+    std::uint16_t worker_port{0};
+    // Keep the totals current in a snapshot after the scan, until SIGINT or SIGTERM
+    WatchOptions watch;
+} CliOptions;
 
 class Timer
 {
@@ -55,236 +174,636 @@ public:
 
 /**
  * check_num_threads() - Checks for the -j flag and number of threads.
+ * Other flags are stored in options.
  * @argc: Argument count.
  * @argv: Argument values.
+ * @options: Options to fill in.
  *
  * Returns: Number of threads to use and paths to measure.
  *
  */
-std::pair<std::vector<std::string>, int> check_num_threads(int argc, char *argv[]);
+std::pair<std::vector<std::string>, int> check_num_threads(int argc, char *argv[], CliOptions &options);
+
 
 /**
- * add_directory() - loops trough directory.
- * @threadInfo: Struct containing information for the threads.
- * @path: Path to directory
+ * append_record() - Encodes one --format record.
+ * ndjson writes one JSON object per line. binary writes a u32 length
+ * of the rest of the record, a type byte, 3 zero bytes, u32 depth,
+ * u64 size, files, dirs and errors and then the path bytes, all
+ * little endian, after an 8 byte "MDUOUT" header.
  *
- * Returns: 0 if successful, 1 if error occurred.
+ * @format: ndjson or binary.
+ * @out: Buffer to append to.
+ * @type: 'r' for a root, 'd' directory, 'f' file argument, 't' one of
+ *        the --top entries, 'b' a row of a breakdown and 'e' for the end
+ *        of the stream with the elapsed microseconds as size.
+ * @path: Path of the entry, may be empty. The key of a breakdown row.
+ * @depth: Depth below the root, the rank for --top. For a breakdown row
+ *          which breakdown, an index into breakdown_names.
+ * @size: Size of the entry.
+ * @totals: Totals of a root, only the files of a breakdown row, nullptr
+ *          for everything else.
+ *
+ * Returns: Nothing.
  *
  */
-int add_directory(ThreadInfo &threadInfo, const std::string& path);
+void append_record(Format format, std::string &out, char type, std::string_view path, int depth, std::uint64_t size,
+                   const Counters *totals);
+
 
 /**
- * threadFunction() - Function run by every thread.
- * Adds folder to stack to process and processes folders.
+ * print_top() - Prints the --top entries after the roots.
  *
- * @arg: Used to pass ThreadInfo struct.
+ * @options: Format to print them in.
+ * @writer: Writer of the streaming formats.
+ * @top: The entries, largest first.
  *
  * Returns: Nothing.
  *
  */
-void thread_function(void *arg);
+void print_top(const CliOptions &options, OutputWriter &writer, const std::vector<TopEntry> &top);
+
+// The breakdowns in the order print_breakdown() prints them
+static constexpr const char *breakdown_names[] = {"uid", "gid", "extension", "size", "age"};
 
 /**
- * init_threads() - Initiates all the threads.
+ * print_breakdown() - Prints the --by-owner, --by-ext and --histogram rows after the roots.
+ * Size buckets are keyed by the smallest size they hold, age buckets
+ * by the number of days they reach back, "older" for the rest.
  *
- * @cmdArgs: Contains files to measure and number of threads to init.
- * @threadInfo: Struct containing information for the threads.
+ * @options: Which breakdowns and the format to print them in.
+ * @writer: Writer of the streaming formats.
+ * @breakdown: The breakdown of the scan.
  *
  * Returns: Nothing.
  *
  */
-void init_threads(std::pair<std::vector<std::string>, int>& cmdArgs, ThreadInfo &threadInfo);
+void print_breakdown(const CliOptions &options, OutputWriter &writer, const Breakdown &breakdown);
 
-int main(int argc, char *argv[])
-{
-    // Init the threadInfo struct
-    ThreadInfo threadInfo;
+/**
+ * print_errors() - Prints what the scan could not read to stderr.
+ * Only done once the scan is over, so the workers never wait on
+ * stderr while they run. An io_uring it went on without comes first.
+ *
+ * @result: Result of the scan.
+ *
+ * Returns: Nothing.
+ *
+ */
+void print_errors(const ScanResult &result);
 
-    // Get the number of threads to use
-    std::pair<std::vector<std::string>, int> cmdArgs{check_num_threads(argc, argv)};
-    //Start Timer
-    Timer t;
-    // Start threads
-    init_threads(cmdArgs, threadInfo);
-    // Print time
-    std::cout << "Time elapsed: " << t.elapsed() << " seconds\n";
-    // Check if an error occurred
-    int exit_value = threadInfo.error;
+/**
+ * print_stats() - Prints the --stats summary to stderr.
+ * Must be called after the scanner is shut down.
+ *
+ * @options: How to print them.
+ * @scanStats: Statistics of the scanner.
+ * @result: Result of the scan.
+ * @elapsed: Wall time of the scan in seconds.
+ *
+ * Returns: Nothing.
+ *
+ */
+void print_stats(const CliOptions &options, const ScanStats &scanStats, const ScanResult &result, double elapsed);
 
-    return exit_value;
-}
+/**
+ * run_query() - Runs mdu query, which answers from an --export snapshot.
+ * Prints the size of every root, or of one path, followed by its
+ * subdirectories largest first with --ls and the largest directories
+ * anywhere below it with --top.
+ *
+ * @argc: Argument count, after "query".
+ * @argv: Argument values, after "query".
+ *
+ * Returns: The exit code.
+ *
+ */
+int run_query(int argc, char *argv[]);
 
-void init_threads(std::pair<std::vector<std::string>, int>& cmdArgs, ThreadInfo &threadInfo)
-{
-    namespace fs = std::filesystem;
+#ifdef MDU_WATCH
+/**
+ * run_watch() - Runs mdu --watch until SIGINT or SIGTERM.
+ * Prints the size of every root after the scan, and again whenever the
+ * tree had to be scanned anew, errors are printed as they happen.
+ *
+ * @options: Command line options.
+ * @paths: Directories to watch.
+ *
+ * Returns: The exit code.
+ *
+ */
+int run_watch(const CliOptions &options, const std::vector<std::string> &paths);
+#endif
 
-    std::vector<std::thread> threads;
-    threads.reserve(cmdArgs.second); // Preallocate memory
+/*
+ * Orders a --max-depth listing like du, every directory after its
+ * subdirectories and the names of a directory next to each other.
+ * Paths are relative to the same root.
+ */
+bool post_order_less(std::string_view a, std::string_view b);
 
-    // Create threads
-    for (int t = 0; t < cmdArgs.second; ++t)
-    {
-        threads.emplace_back([&threadInfo]() { thread_function(&threadInfo); });
-    }
+/*
+ * Prints what the Scanner reports. Roots come in on the main thread as
+ * they complete, the --max-depth directories on the worker threads.
+ */
+class ResultPrinter
+{
+private:
+    const CliOptions &m_options;
+    OutputWriter &m_writer;
+    // Roots done before an earlier argument, for the text output in argument order
+    std::vector<std::optional<RootResult> > m_waiting;
+    std::size_t m_next{0};
+    // Everything below is what the worker threads touch, protected by m_mutex
+    std::mutex m_mutex;
+    // Text --max-depth listing of every root, path and size
+    std::vector<std::vector<std::pair<std::string, std::uint64_t> > > m_dirs;
+    // Records of the streaming formats not yet handed to the writer
+    std::string m_out;
 
-    // Process directories
-    for (const auto& dir : cmdArgs.first)
+    void print(const RootResult &root)
     {
-        fs::path path(dir);
-        if (fs::exists(path) && fs::is_directory(path))
+        namespace fs = std::filesystem;
+        if (root.error != 0)
         {
-            std::stack<std::string> newStack;
-            newStack.push(path.string());
-
-            {
-                std::lock_guard<std::mutex> lock(threadInfo.mutex);
-                threadInfo.stack.first = newStack;
-                // Signal to threads that work is available
-                threadInfo.work_available.notify_one();
-            }
-
-            // Wait for threads to complete
+            // Not measured at all, print_errors() says why
+            return;
+        }
+        if (m_options.format != Format::text)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            append_record(m_options.format, m_out, root.directory ? 'r' : 'f', root.path, 0, root.size,
+                          root.directory ? &root.totals : nullptr);
+            m_writer.submit(m_out);
+        }
+        else if (!root.directory)
+        {
+            std::cout << root.size << " " << fs::path(root.path) << std::endl;
+        }
+        else if (m_options.scan.max_depth >= 0)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto &dirs = m_dirs[root.index];
+            std::size_t prefix = root.path.size();
+            std::sort(dirs.begin(), dirs.end(), [prefix](const auto &a, const auto &b) {
+                return post_order_less(std::string_view(a.first).substr(prefix),
+                                       std::string_view(b.first).substr(prefix));
+            });
+            for (const auto &[path, size] : dirs)
             {
-                std::unique_lock<std::mutex> lock(threadInfo.mutex);
-                threadInfo.threads_complete.wait(lock);
+                std::cout << size << '\t' << path << '\n';
             }
-
-            // Print result
-            std::cout << "Path: " << path << " Size: " <<threadInfo.stack.second << '\n';
+            std::cout << root.size << '\t' << root.path << '\n';
+            dirs = {};
         }
         else
         {
-            std::cout << fs::file_size(path) << " " << path << std::endl;
+            std::cout << "Path: " << fs::path(root.path) << " Size: " << root.size << '\n';
         }
     }
 
-    // Signal that there is no more work to do
+public:
+    ResultPrinter(const CliOptions &options, OutputWriter &writer, std::size_t roots)
+        : m_options(options), m_writer(writer), m_waiting(roots), m_dirs(roots)
     {
-        std::lock_guard<std::mutex> lock(threadInfo.mutex);
-        threadInfo.no_more_work = true;
-        threadInfo.work_available.notify_all();
     }
 
-    // Wait for threads to finish
-    for (std::thread &th : threads)
+    void directory(const DirectoryResult &dir)
     {
-        th.join();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_options.format == Format::text)
+        {
+            m_dirs[dir.root].emplace_back(dir.path, dir.size);
+            return;
+        }
+        append_record(m_options.format, m_out, 'd', dir.path, dir.depth, dir.size, nullptr);
+        if (m_out.size() >= OutputWriter::buffer_size)
+        {
+            m_writer.submit(m_out);
+        }
     }
-}
-void thread_function(void *arg)
-{
-    auto &threadInfo = *static_cast<ThreadInfo *>(arg);
-    // wait for work
+
+    void root(const RootResult &root)
     {
-        std::unique_lock<std::mutex> lock(threadInfo.mutex);
-        threadInfo.work_available.wait(lock);
+        // The streaming formats write roots as they complete
+        if (m_options.as_completed || m_options.format != Format::text)
+        {
+            print(root);
+            return;
+        }
+        m_waiting[root.index] = root;
+        while (m_next < m_waiting.size() && m_waiting[m_next].has_value())
+        {
+            print(*m_waiting[m_next]);
+            m_waiting[m_next].reset();
+            ++m_next;
+        }
     }
+};
 
-    while (true)
+int main(int argc, char *argv[])
+{
+    CliOptions options;
+    if (argc > 1 && std::string(argv[1]) == "query")
     {
-        std::unique_lock<std::mutex> lock(threadInfo.mutex);
+        return run_query(argc - 2, argv + 2);
+    }
+    // Every run is one scan, for a small tree starting the threads would cost more than it does
+    options.scan.inline_entries = 512;
 
-        // Check if stack is empty and no thread is working
-        while (threadInfo.stack.first.empty() && (threadInfo.process_count > 0))
+    // Get the number of threads to use
+    std::pair<std::vector<std::string>, int> cmdArgs{check_num_threads(argc, argv, options)};
+    options.scan.threads = cmdArgs.second;
+#ifdef MDU_CLUSTER
+    if (!options.worker_host.empty())
+    {
+        try
         {
-            //std::cout << "1 " << std::endl;
-            threadInfo.work_available.wait(lock);
-
+            run_cluster_worker(options.scan, options.worker_host, options.worker_port);
         }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: " << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+#endif
+#ifdef MDU_WATCH
+    if (!options.watch.snapshot.empty())
+    {
+        return run_watch(options, cmdArgs.first);
+    }
+#endif
+    //Start Timer
+    Timer t;
 
-        if(threadInfo.no_more_work)
+    OutputWriter writer;
+    if (options.format != Format::text)
+    {
+        writer.start();
+        if (options.format == Format::binary)
         {
-            //std::cout <<  "2 "<< std::endl;
-            lock.unlock();
-            return;
+            std::string header("MDUOUT\0\1", 8);
+            writer.submit(header);
         }
+    }
+    ResultPrinter printer(options, writer, cmdArgs.first.size());
+    ScanCallbacks callbacks;
+    callbacks.on_root = [&printer](const RootResult &root) { printer.root(root); };
+    if (options.scan.max_depth >= 0)
+    {
+        callbacks.on_directory = [&printer](const DirectoryResult &dir) { printer.directory(dir); };
+    }
 
-        if (threadInfo.stack.first.empty())
+    ScanResult result;
+    ScanStats stats;
+#ifdef MDU_CLUSTER
+    if (options.coordinator)
+    {
+        try
         {
-            //std::cout <<  "3 "<< std::endl;
-            threadInfo.threads_complete.notify_one();
-            // Wait for work_available
-            threadInfo.work_available.wait(lock);
-            lock.unlock();
+            result = coordinate_scan(options.scan, options.coordinator_address, *options.coordinator, cmdArgs.first,
+                                     callbacks);
         }
-        else
+        catch (const std::system_error &e)
         {
-            //std::cout <<  "5 "<< std::endl;
-            std::string path = threadInfo.stack.first.top();
-            threadInfo.stack.first.pop();
-            threadInfo.process_count++;
+            std::cerr << "Error: " << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+    else
+#endif
+    {
+        // Start threads
+        Scanner scanner(options.scan);
+        result = scanner.scan(cmdArgs.first, callbacks);
+        scanner.shutdown();
+        stats = scanner.stats();
+    }
+    print_errors(result);
 
-            lock.unlock();
+    if (options.scan.top > 0)
+    {
+        print_top(options, writer, result.top);
+    }
+    print_breakdown(options, writer, result.breakdown);
 
-            int error = add_directory(threadInfo, path);
+    // Print time
+    double elapsed = t.elapsed();
+    if (options.format == Format::text)
+    {
+        if (!options.quiet)
+        {
+            std::cout << "Time elapsed: " << elapsed << " seconds\n";
+        }
+    }
+    else
+    {
+        std::string end;
+        append_record(options.format, end, 'e', std::string_view(), 0, static_cast<std::uint64_t>(elapsed * 1e6), nullptr);
+        writer.submit(end);
+        writer.finish();
+    }
+    if (options.stats)
+    {
+        print_stats(options, stats, result, elapsed);
+    }
+    // Check if an error occurred
+    int exit_value = result.error;
 
-            lock.lock();
+    return exit_value;
+}
 
-            if (error == 1)
+bool post_order_less(std::string_view a, std::string_view b)
+{
+    auto [ia, ib] = std::mismatch(a.begin(), a.end(), b.begin(), b.end());
+    if (ia == a.end())
+    {
+        // a is a prefix, b is either below it and goes first or a longer name next to it
+        return ib != b.end() && *ib != '/';
+    }
+    if (ib == b.end())
+    {
+        return *ia == '/';
+    }
+    // The end of a name sorts before any character, so a directory's subtree stays in one piece
+    auto rank = [](char c) { return c == '/' ? 0 : static_cast<unsigned char>(c) + 1; };
+    return rank(*ia) < rank(*ib);
+}
+
+void append_record(Format format, std::string &out, char type, std::string_view path, int depth, std::uint64_t size,
+                   const Counters *totals)
+{
+    if (format == Format::binary)
+    {
+        auto put = [&out](std::uint64_t value, int bytes) {
+            for (int i = 0; i < bytes; ++i)
             {
-                threadInfo.error = error;
+                out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
             }
-            threadInfo.process_count--;
+        };
+        Counters none;
+        const Counters &counters = totals != nullptr ? *totals : none;
+        put(40 + path.size(), 4);
+        put(static_cast<unsigned char>(type), 4);
+        put(static_cast<std::uint32_t>(depth), 4);
+        put(size, 8);
+        put(counters.files, 8);
+        put(counters.dirs, 8);
+        put(counters.errors, 8);
+        out += path;
+        return;
+    }
 
-            // Wake up every thread to see if work is done
-            threadInfo.work_available.notify_all();
+    static constexpr const char *types[] = {"root", "dir", "file", "top", "breakdown", "end"};
+    const char *name = types[type == 'r' ? 0 : type == 'd' ? 1 : type == 'f' ? 2 : type == 't' ? 3 : type == 'b' ? 4 : 5];
+    out.append("{\"type\":\"").append(name).append("\"");
+    if (type == 'e')
+    {
+        out.append(",\"elapsed_us\":").append(std::to_string(size)).append("}\n");
+        return;
+    }
+    if (type == 'b')
+    {
+        out.append(",\"by\":\"").append(breakdown_names[depth]).append("\"");
+    }
+
+    // Paths are bytes, only what JSON cannot hold as is gets escaped
+    out.append(type == 'b' ? ",\"key\":\"" : ",\"path\":\"");
+    for (unsigned char c : path)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out.push_back('\\');
+            out.push_back(static_cast<char>(c));
+        }
+        else if (c < 0x20)
+        {
+            static constexpr char hex[] = "0123456789abcdef";
+            out.append("\\u00");
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 0xf]);
+        }
+        else
+        {
+            out.push_back(static_cast<char>(c));
         }
     }
+    out.append("\"");
+    if (type == 'd')
+    {
+        out.append(",\"depth\":").append(std::to_string(depth));
+    }
+    else if (type == 't')
+    {
+        out.append(",\"rank\":").append(std::to_string(depth));
+    }
+    out.append(",\"size\":").append(std::to_string(size));
+    if (type == 'b')
+    {
+        out.append(",\"files\":").append(std::to_string(totals->files));
+    }
+    else if (totals != nullptr)
+    {
+        out.append(",\"files\":").append(std::to_string(totals->files));
+        out.append(",\"dirs\":").append(std::to_string(totals->dirs));
+        out.append(",\"errors\":").append(std::to_string(totals->errors));
+    }
+    out.append("}\n");
 }
 
-int add_directory(ThreadInfo &threadInfo, const std::string &path)
+void print_top(const CliOptions &options, OutputWriter &writer, const std::vector<TopEntry> &top)
 {
-    namespace fs = std::filesystem;
-    int error = 0;
-    std::uintmax_t size = 0;
+    if (options.format != Format::text)
+    {
+        std::string records;
+        for (std::size_t i = 0; i < top.size(); ++i)
+        {
+            append_record(options.format, records, 't', top[i].path, static_cast<int>(i + 1), top[i].size, nullptr);
+        }
+        writer.submit(records);
+        return;
+    }
 
-    for (const auto &entry : fs::directory_iterator(path))
+    std::cout << (options.scan.top_files ? "Largest files:\n" : "Largest directories:\n");
+    for (const TopEntry &entry : top)
     {
-        if (fs::is_symlink(entry))
+        std::cout << entry.size << '\t' << entry.path << '\n';
+    }
+}
+
+void print_breakdown(const CliOptions &options, OutputWriter &writer, const Breakdown &breakdown)
+{
+    static constexpr const char *titles[] = {"By uid:\n", "By gid:\n", "By extension:\n", "By size:\n", "By age:\n"};
+    std::string records;
+    // The key goes into the records, the label is what the text listing shows
+    auto row = [&](int kind, const std::string &key, const std::string &label, const Aggregate &aggregate) {
+        if (options.format != Format::text)
         {
-            // Do not add symbolic links to stack
-            size += fs::file_size(entry.path());
-            continue;
+            Counters files;
+            files.files = aggregate.files;
+            append_record(options.format, records, 'b', key, kind, aggregate.size, &files);
+            return;
         }
+        std::cout << aggregate.size << '\t' << aggregate.files << " files\t" << label << '\n';
+    };
+    auto title = [&](int kind) {
+        if (options.format == Format::text)
+        {
+            std::cout << titles[kind];
+        }
+    };
 
-        if (entry.is_directory())
+    if (options.scan.by_owner)
+    {
+        title(0);
+        for (const auto &[uid, aggregate] : breakdown.uids)
         {
-            if (fs::exists(entry.path()) && (fs::status(entry.path()).permissions() & fs::perms::owner_read) != fs::perms::none)
+            row(0, std::to_string(uid), std::to_string(uid), aggregate);
+        }
+        title(1);
+        for (const auto &[gid, aggregate] : breakdown.gids)
+        {
+            row(1, std::to_string(gid), std::to_string(gid), aggregate);
+        }
+    }
+    if (options.scan.by_ext)
+    {
+        title(2);
+        for (const auto &[extension, aggregate] : breakdown.extensions)
+        {
+            row(2, extension, extension.empty() ? "(none)" : "." + extension, aggregate);
+        }
+    }
+    if (options.scan.histogram)
+    {
+        title(3);
+        for (std::size_t b = 0; b < breakdown.sizes.size(); ++b)
+        {
+            if (breakdown.sizes[b].files > 0)
             {
-                {
-                    std::unique_lock<std::mutex> lock(threadInfo.mutex);
-                    threadInfo.stack.first.push(entry.path().string());
-                    // Wake up one
-                    threadInfo.work_available.notify_one();
-                }
+                // Bucket b ends just before twice its start, for the last one 2^64 - 1
+                std::uint64_t start = b == 0 ? 0 : std::uint64_t{1} << (b - 1);
+                std::uint64_t end = b == 0 ? 0 : 2 * start - 1;
+                row(3, std::to_string(start), std::to_string(start) + "-" + std::to_string(end), breakdown.sizes[b]);
             }
-            else
+        }
+        title(4);
+        for (std::size_t b = 0; b < breakdown.ages.size(); ++b)
+        {
+            if (breakdown.ages[b].files > 0)
             {
-                std::cerr << "Cannot read directory '" << entry.path() << "': Permission denied\n";
-                // Set error variable
-                error = 1;
+                bool older = b == Breakdown::age_days.size();
+                std::string days = older ? "older" : std::to_string(Breakdown::age_days[b]);
+                row(4, days, older ? days : "<" + days + "d", breakdown.ages[b]);
             }
         }
-        else
+    }
+    if (!records.empty())
+    {
+        writer.submit(records);
+    }
+}
+
+void print_errors(const ScanResult &result)
+{
+    static constexpr const char *what[] = {"Cannot read directory", "Cannot stat", "Cannot write cache",
+                                                 "Cannot write snapshot", "Cannot watch"};
+    std::string out;
+    if (result.ring_error != 0)
+    {
+        out.append("io_uring unavailable (").append(std::strerror(result.ring_error)).append("), using fstatat\n");
+    }
+    if (result.prefetch_error != 0)
+    {
+        out.append("io_uring unavailable (").append(std::strerror(result.prefetch_error)).append("), not prefetching\n");
+    }
+    for (const ScanError &error : result.errors)
+    {
+        out.append(what[static_cast<int>(error.operation)]).append(" '").append(error.path).append("': ");
+        out.append(std::strerror(error.code)).append("\n");
+    }
+    if (result.errors_dropped > 0)
+    {
+        out.append(std::to_string(result.errors_dropped)).append(" more errors not shown\n");
+    }
+    std::cerr << out;
+}
+
+void print_stats(const CliOptions &options, const ScanStats &scanStats, const ScanResult &result, double elapsed)
+{
+    Counters total;
+    for (const RootResult &root : result.roots)
+    {
+        if (root.directory)
         {
-            size += fs::file_size(entry.path());
-            //std::cout << "Path: " << entry.path() << " size: " << size << '\n';
+            total += root.totals;
         }
     }
 
+    const WorkerStats &sum = scanStats.total;
+    double rate = elapsed > 0 ? sum.entries / elapsed : 0;
+
+    std::ostream &out = std::cerr;
+    if (options.stats_json)
     {
-        std::unique_lock<std::mutex> lock(threadInfo.mutex);
-        threadInfo.stack.second += size;
+        out << "{\"elapsed_s\":" << elapsed << ",\"entries\":" << sum.entries << ",\"entries_per_s\":" << rate
+            << ",\"dirs\":" << total.dirs << ",\"files\":" << total.files << ",\"stat_calls\":" << sum.stat_calls
+            << ",\"syscalls\":" << sum.syscalls << ",\"ring_ops\":" << sum.ring_ops << ",\"errors\":" << total.errors
+            << ",\"peak_queue_depth\":" << sum.peak_depth << ",\"steals\":" << sum.steals
+            << ",\"failed_steals\":" << sum.failed_steals << ",\"parks\":" << sum.parks
+            << ",\"cache_hits\":" << sum.cache_hits << ",\"suspends\":" << sum.suspends << ",\"retries\":" << sum.retries
+            << ",\"vanished\":" << sum.vanished << ",\"prefetches\":" << sum.prefetches << ",\"ring_failures\":" << sum.ring_failures << ",\"busy_s\":" << sum.busy << ",\"idle_s\":" << sum.idle << ",\"lock_wait_s\":" << sum.lock_wait << ",\"threads\":[";
+        for (std::size_t i = 0; i < scanStats.threads.size(); ++i)
+        {
+            const ThreadStats &thread = scanStats.threads[i];
+            const WorkerStats &stats = thread.stats;
+            out << (i ? "," : "") << "{\"id\":" << thread.id << ",\"cpu\":" << thread.cpu << ",\"node\":" << thread.node
+                << ",\"dirs\":" << thread.dirs
+                << ",\"entries\":" << stats.entries << ",\"steals\":" << stats.steals
+                << ",\"peak_queue_depth\":" << stats.peak_depth << ",\"busy_s\":" << stats.busy
+                << ",\"idle_s\":" << stats.idle << ",\"lock_wait_s\":" << stats.lock_wait << '}';
+        }
+        out << "]}\n";
+        return;
     }
 
-    return error;
+    out << "Entries: " << sum.entries << " (" << rate << "/s)\n"
+        << "Directories: " << total.dirs << "\n"
+        << "Files: " << total.files << "\n"
+        << "Stat calls: " << sum.stat_calls << "\n"
+        << "Syscalls: " << sum.syscalls << " (+" << sum.ring_ops << " through io_uring)\n"
+        << "Errors: " << total.errors << "\n"
+        << "Peak queue depth: " << sum.peak_depth << "\n"
+        << "Steals: " << sum.steals << " (" << sum.failed_steals << " lost races)\n"
+        << "Parks: " << sum.parks << "\n"
+        << "Cache hits: " << sum.cache_hits << "\n"
+        << "Set aside: " << sum.suspends << "\n"
+        << "Retries: " << sum.retries << "\n"
+        << "Vanished: " << sum.vanished << "\n"
+        << "Prefetched opens: " << sum.prefetches << "\n"
+        << "Rings dropped: " << sum.ring_failures << "\n";
+    if (options.scan.auto_threads)
+    {
+        out << "Active threads at the end: " << scanStats.active_threads << '\n';
+    }
+    out << "Thread  cpu  node  dirs  entries  steals  peak  busy_s  idle_s  lock_wait_s\n";
+    for (const ThreadStats &thread : scanStats.threads)
+    {
+        const WorkerStats &stats = thread.stats;
+        out << thread.id << "  " << thread.cpu << "  " << thread.node << "  " << thread.dirs << "  " << stats.entries
+            << "  " << stats.steals << "  " << stats.peak_depth << "  " << stats.busy << "  " << stats.idle << "  "
+            << stats.lock_wait << '\n';
+    }
 }
 
-std::pair<std::vector<std::string>, int> check_num_threads(int argc, char *argv[])
+std::pair<std::vector<std::string>, int> check_num_threads(int argc, char *argv[], CliOptions &options)
 {
     int numThreads = 1; // Default to 1 thread
-    int maxThreads = static_cast<int>(std::thread::hardware_concurrency());
     std::vector<std::string> files;
+    // Only printed for --format=text, the other formats keep stdout to records
+    std::string chatter;
 
     // Check if the -j flag is provided and parse the number of threads and files
     for (int i = 1; i < argc; i++)
@@ -293,37 +812,612 @@ std::pair<std::vector<std::string>, int> check_num_threads(int argc, char *argv[
         {
             if (std::string(argv[i]) == "-j")
             {
-                std::cout << "Num threads: " << argv[i + 1] << '\n';
-                numThreads = std::stoi(argv[++i]);
-                // Check if numThreads is greater than hardware concurrency
-                if (numThreads > maxThreads)
+                if (i + 1 >= argc)
                 {
-                    std::cerr << "Number of threads exceeds hardware concurrency. Maximum supported threads: "
-                              << maxThreads << '\n';
-                    numThreads = maxThreads;
+                    throw std::invalid_argument("-j needs a number");
                 }
-
+                chatter.append("Num threads: ").append(argv[i + 1]).append("\n");
+                if (std::string(argv[++i]) == "auto")
+                {
+                    // Latency bound filesystems want many times the cores, the tuner parks what does not help
+                    int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+                    options.scan.auto_threads = true;
+                    numThreads = std::min(std::max(64, cores * 16), 1024);
+                }
+                else
+                {
+                    // More threads than cores is fine, they mostly wait for the filesystem
+                    options.scan.auto_threads = false;
+                    numThreads = std::stoi(argv[i]);
+                    if (numThreads < 1)
+                    {
+                        throw std::invalid_argument("-j must be at least 1");
+                    }
+                }
+            }
+            else if (std::string(argv[i]) == "-l" || std::string(argv[i]) == "--count-links")
+            {
+                options.scan.count_links = true;
+            }
+            else if (std::string(argv[i]) == "--max-depth")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("--max-depth needs a number");
+                }
+                options.scan.max_depth = std::stoi(argv[++i]);
+                if (options.scan.max_depth < 0)
+                {
+                    throw std::invalid_argument("--max-depth must be 0 or more");
+                }
+            }
+            else if (std::string(argv[i]) == "--stats" || std::string(argv[i]) == "--stats=json")
+            {
+                options.stats = true;
+                options.stats_json = std::string(argv[i]) == "--stats=json";
+            }
+            else if (std::string(argv[i]) == "--cache")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("--cache needs a file");
+                }
+#ifdef MDU_GETDENTS
+                options.scan.cache_file = argv[++i];
+#else
+                ++i;
+                std::cerr << "mdu was built without the getdents64 backend, ignoring --cache\n";
+#endif
+            }
+            else if (std::string(argv[i]) == "--export")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("--export needs a file");
+                }
+                options.scan.export_file = argv[++i];
+            }
+            else if (std::string(argv[i]).starts_with("--order="))
+            {
+                std::string order = std::string(argv[i]).substr(8);
+                if (order == "dfs")
+                {
+                    options.scan.order = Order::dfs;
+                }
+                else if (order == "bfs")
+                {
+                    options.scan.order = Order::bfs;
+                }
+                else if (order == "hybrid" || order.starts_with("hybrid:"))
+                {
+                    options.scan.order = Order::hybrid;
+                    if (order.size() > 6)
+                    {
+                        options.scan.bfs_levels = std::stoi(order.substr(7));
+                    }
+                    if (options.scan.bfs_levels < 0)
+                    {
+                        throw std::invalid_argument("--order=hybrid needs 0 or more levels");
+                    }
+                }
+                else
+                {
+                    throw std::invalid_argument("unknown order " + order);
+                }
+            }
+            else if (std::string(argv[i]) == "--inline")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("--inline needs a number");
+                }
+                long long entries = std::stoll(argv[++i]);
+                if (entries < 0)
+                {
+                    throw std::invalid_argument("--inline must be 0 or more");
+                }
+                options.scan.inline_entries = static_cast<std::uint64_t>(entries);
+            }
+            else if (std::string(argv[i]) == "--quiet")
+            {
+                options.quiet = true;
+            }
+            else if (std::string(argv[i]) == "--watch")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("--watch needs a file");
+                }
+#ifdef MDU_WATCH
+                options.watch.snapshot = argv[++i];
+#else
+                std::cerr << "mdu was built without watch support, ignoring " << argv[i++] << '\n';
+#endif
+            }
+            else if (std::string(argv[i]) == "--watch-interval")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("--watch-interval needs a number");
+                }
+                double seconds = std::stod(argv[++i]);
+                if (!(seconds > 0))
+                {
+                    throw std::invalid_argument("--watch-interval must be more than 0");
+                }
+                options.watch.interval = std::max(std::chrono::milliseconds(1),
+                                                  std::chrono::milliseconds(static_cast<long long>(seconds * 1000)));
+            }
+            else if (std::string(argv[i]) == "--inotify")
+            {
+                options.watch.source = WatchSource::inotify;
+            }
+            else if (std::string(argv[i]) == "--prefetch")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("--prefetch needs a number");
+                }
+                options.scan.prefetch = std::stoi(argv[++i]);
+                if (options.scan.prefetch < 0)
+                {
+                    throw std::invalid_argument("--prefetch must be 0 or more");
+                }
+#ifndef MDU_IO_URING
+                std::cerr << "mdu was built without io_uring support, ignoring --prefetch\n";
+                options.scan.prefetch = 0;
+#endif
+            }
+            else if (std::string(argv[i]).starts_with("--format="))
+            {
+                std::string format = std::string(argv[i]).substr(9);
+                if (format == "text")
+                {
+                    options.format = Format::text;
+                }
+                else if (format == "ndjson")
+                {
+                    options.format = Format::ndjson;
+                }
+                else if (format == "binary")
+                {
+                    options.format = Format::binary;
+                }
+                else
+                {
+                    throw std::invalid_argument("unknown format " + format);
+                }
+            }
+            else if (std::string(argv[i]) == "--max-queue-mem")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("--max-queue-mem needs a size");
+                }
+                std::string size = argv[++i];
+                std::size_t end = 0;
+                options.scan.max_queue_mem = std::stoull(size, &end);
+                std::string suffix = size.substr(end);
+                if (suffix == "K" || suffix == "k")
+                {
+                    options.scan.max_queue_mem <<= 10;
+                }
+                else if (suffix == "M" || suffix == "m")
+                {
+                    options.scan.max_queue_mem <<= 20;
+                }
+                else if (suffix == "G" || suffix == "g")
+                {
+                    options.scan.max_queue_mem <<= 30;
+                }
+                else if (!suffix.empty())
+                {
+                    throw std::invalid_argument("unknown size suffix " + suffix);
+                }
+#ifndef MDU_GETDENTS
+                std::cerr << "mdu was built without the getdents64 backend, ignoring --max-queue-mem\n";
+#endif
+            }
+            else if (std::string(argv[i]) == "--split-threshold")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("--split-threshold needs a number");
+                }
+                options.scan.split_threshold = std::stoll(argv[++i]);
+                if (options.scan.split_threshold < 0)
+                {
+                    throw std::invalid_argument("--split-threshold must be 0 or more");
+                }
+            }
+            else if (std::string(argv[i]) == "--stat-threads")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("--stat-threads needs a number");
+                }
+                options.scan.stat_threads = std::stoi(argv[++i]);
+                if (options.scan.stat_threads < 0)
+                {
+                    throw std::invalid_argument("--stat-threads must be 0 or more");
+                }
+#ifndef MDU_GETDENTS
+                std::cerr << "mdu was built without the getdents64 backend, ignoring --stat-threads\n";
+                options.scan.stat_threads = 0;
+#endif
+            }
+            else if (std::string(argv[i]) == "--top")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("--top needs a number");
+                }
+                int top = std::stoi(argv[++i]);
+                if (top < 1)
+                {
+                    throw std::invalid_argument("--top must be at least 1");
+                }
+                options.scan.top = static_cast<std::size_t>(top);
+            }
+            else if (std::string(argv[i]) == "--files")
+            {
+                options.scan.top_files = true;
+            }
+            else if (std::string(argv[i]) == "--by-owner")
+            {
+                options.scan.by_owner = true;
+            }
+            else if (std::string(argv[i]) == "--by-ext")
+            {
+                options.scan.by_ext = true;
+            }
+            else if (std::string(argv[i]) == "--histogram")
+            {
+                options.scan.histogram = true;
+            }
+            else if (std::string(argv[i]) == "--affinity" || std::string(argv[i]) == "--numa")
+            {
+#ifdef __linux__
+                (std::string(argv[i]) == "--numa" ? options.scan.numa : options.scan.affinity) = true;
+#else
+                std::cerr << "mdu can only pin threads on Linux, ignoring " << argv[i] << '\n';
+#endif
+            }
+            else if (std::string(argv[i]) == "--coordinator" || std::string(argv[i]) == "--worker")
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument(std::string(argv[i]) == "--worker" ? "--worker needs a host" : "--coordinator needs a port");
+                }
+#ifdef MDU_CLUSTER
+                std::string flag = argv[i];
+                std::string where = argv[++i];
+                std::size_t colon = where.rfind(':');
+                // A port outside the range would wrap around to another one
+                auto parse_port = [&flag](const std::string &text) {
+                    int port = std::stoi(text);
+                    if (port < 1 || port > 65535)
+                    {
+                        throw std::invalid_argument(flag + " port must be between 1 and 65535");
+                    }
+                    return static_cast<std::uint16_t>(port);
+                };
+                std::string host;
+                std::uint16_t port = default_cluster_port;
+                if (colon == std::string::npos || where.find(']', colon) != std::string::npos)
+                {
+                    // The coordinator takes a bare port and listens on loopback, a worker a bare host
+                    if (flag == "--coordinator")
+                    {
+                        port = parse_port(where);
+                    }
+                    else
+                    {
+                        host = where;
+                    }
+                }
+                else
+                {
+                    host = where.substr(0, colon);
+                    port = parse_port(where.substr(colon + 1));
+                }
+                // Brackets around an IPv6 address are for the port's sake only
+                if (host.starts_with('[') && host.ends_with(']'))
+                {
+                    host = host.substr(1, host.size() - 2);
+                }
+                if (flag == "--coordinator")
+                {
+                    options.coordinator = port;
+                    options.coordinator_address = host;
+                }
+                else
+                {
+                    options.worker_host = host;
+                    options.worker_port = port;
+                }
+#else
+                std::cerr << "mdu was built without cluster support, ignoring " << argv[i++] << '\n';
+#endif
+            }
+            else if (std::string(argv[i]) == "--as-completed")
+            {
+                options.as_completed = true;
+            }
+            else if (std::string(argv[i]) == "--apparent-size")
+            {
+                options.scan.apparent_size = true;
+            }
+            else if (std::string(argv[i]) == "--io-uring")
+            {
+#ifdef MDU_IO_URING
+                options.scan.io_uring = true;
+#else
+                std::cerr << "mdu was built without io_uring support, ignoring --io-uring\n";
+#endif
             }
             else
             {
                 files.emplace_back(argv[i]);
-                std::cout << "File: " << argv[i] << '\n';
+                chatter.append("File: ").append(argv[i]).append("\n");
             }
         }
         catch (const std::exception& e)
         {
             // Handle the exception (e.g., print an error message)
-            std::cerr << "Error: " << e.what() << " ,Usage: mdu -j {number of threads} {file} [files ...] " << '\n';
+            std::cerr << "Error: " << e.what() << " ,Usage: mdu -j {number of threads|auto} [--apparent-size] [--count-links] [--max-depth N] [--as-completed] [--stats[=json]] [--io-uring] [--cache FILE] [--format=text|ndjson|binary] [--max-queue-mem BYTES[K|M|G]] [--split-threshold N] [--stat-threads N] [--top N [--files]] [--by-owner] [--by-ext] [--histogram] [--affinity|--numa] [--export SNAPSHOT] [--order=dfs|bfs|hybrid[:K]] [--prefetch K] [--inline N] [--quiet] [--watch SNAPSHOT [--watch-interval SECONDS] [--inotify]] [--coordinator [ADDRESS:]PORT] {file} [files ...] | mdu -j N --worker HOST[:PORT] | mdu query SNAPSHOT [path] [--ls] [--top N] [--apparent-size] " << '\n';
             exit(EXIT_FAILURE);
         }
 
 
     }
 
-    std::cout << "Number of threads: " << numThreads << '\n';
+    // The workers only send totals back, nothing to build these from
+    if (options.coordinator && (options.scan.top > 0 || options.scan.by_owner || options.scan.by_ext ||
+                                options.scan.histogram || !options.scan.cache_file.empty() ||
+                                !options.scan.export_file.empty() || options.stats))
+    {
+        std::cerr << "--coordinator ignores --top, --by-owner, --by-ext, --histogram, --cache, --export and --stats\n";
+        options.scan.top = 0;
+        options.scan.by_owner = options.scan.by_ext = options.scan.histogram = false;
+        options.scan.cache_file.clear();
+        options.scan.export_file.clear();
+        options.stats = false;
+    }
+    // Workers are not authenticated, say so whenever other hosts may be able to connect
+    if (options.coordinator && !options.coordinator_address.empty())
+    {
+        std::cerr << "--coordinator on " << options.coordinator_address
+                  << " lets anyone who can reach the port join the scan and report totals, there is no authentication\n";
+    }
+
+    // Only the totals are kept current, the snapshot is the output
+    if (!options.watch.snapshot.empty() &&
+        (options.coordinator || options.scan.max_depth >= 0 || options.scan.top > 0 || options.scan.by_owner ||
+         options.scan.by_ext || options.scan.histogram || !options.scan.cache_file.empty() ||
+         !options.scan.export_file.empty() || options.stats || options.format != Format::text))
+    {
+        std::cerr << "--watch ignores --coordinator, --max-depth, --top, --by-owner, --by-ext, --histogram, --cache, "
+                     "--export, --stats and --format\n";
+        options.coordinator.reset();
+        options.stats = false;
+        options.format = Format::text;
+    }
+
+    if (options.format == Format::text && !options.quiet)
+    {
+        std::cout << chatter << "Number of threads: " << numThreads << '\n';
+    }
 
     // Store the values in cmdArgs
     std::pair<std::vector<std::string>, int> cmdArgs = {files, numThreads};
 
     return cmdArgs;
-}
\ No newline at end of file
+}
+
+int run_query(int argc, char *argv[])
+{
+    namespace fs = std::filesystem;
+    std::string file;
+    std::optional<std::string> path;
+    bool list = false;
+    bool apparent = false;
+    std::size_t top = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        try
+        {
+            if (std::string(argv[i]) == "--ls")
+            {
+                list = true;
+            }
+            else if (std::string(argv[i]) == "--apparent-size")
+            {
+                apparent = true;
+            }
+            else if (std::string(argv[i]) == "--top")
+            {
+                if (i + 1 >= argc || std::stoi(argv[i + 1]) < 1)
+                {
+                    throw std::invalid_argument("--top needs a number of at least 1");
+                }
+                top = static_cast<std::size_t>(std::stoi(argv[++i]));
+            }
+            else if (file.empty())
+            {
+                file = argv[i];
+            }
+            else if (!path)
+            {
+                path = argv[i];
+            }
+            else
+            {
+                throw std::invalid_argument(std::string("unexpected ") + argv[i]);
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: " << e.what()
+                      << " ,Usage: mdu query SNAPSHOT [path] [--ls] [--top N] [--apparent-size]" << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+    if (file.empty())
+    {
+        std::cerr << "Error: no snapshot ,Usage: mdu query SNAPSHOT [path] [--ls] [--top N] [--apparent-size]\n";
+        return EXIT_FAILURE;
+    }
+
+    Snapshot snapshot;
+    if (int code = snapshot.open(file); code != 0)
+    {
+        std::cerr << "Cannot read snapshot '" << file << "': " << std::strerror(code) << '\n';
+        return EXIT_FAILURE;
+    }
+    // Every root, or the one directory asked for
+    std::vector<std::pair<const SnapshotRoot *, std::uint32_t> > targets;
+    if (path)
+    {
+        auto found = snapshot.find(*path);
+        if (!found)
+        {
+            std::cerr << "Not in the snapshot '" << *path << "'\n";
+            return EXIT_FAILURE;
+        }
+        targets.push_back(*found);
+    }
+    else
+    {
+        for (const SnapshotRoot &root : snapshot.roots())
+        {
+            targets.emplace_back(&root, 0);
+        }
+    }
+
+    auto size = [apparent](const SnapshotRoot &root, std::uint32_t dir) {
+        return apparent ? root.bytes[dir] : root.blocks[dir];
+    };
+    for (const auto &[root, dir] : targets)
+    {
+        std::cout << "Path: " << fs::path(root->path(dir)) << " Size: " << size(*root, dir)
+                  << " Files: " << root->files[dir] << " Dirs: " << root->dirs[dir] << '\n';
+        if (list)
+        {
+            auto [first, last] = root->children(dir);
+            std::vector<std::uint32_t> children;
+            for (std::uint32_t child = first; child < last; ++child)
+            {
+                children.push_back(child);
+            }
+            std::stable_sort(children.begin(), children.end(), [&](std::uint32_t a, std::uint32_t b) {
+                return size(*root, a) > size(*root, b);
+            });
+            for (std::uint32_t child : children)
+            {
+                std::cout << size(*root, child) << '\t' << root->path(child) << '\n';
+            }
+        }
+    }
+
+    if (top > 0)
+    {
+        // Min-heap of the largest directories below the targets, walked through the children runs
+        typedef std::pair<std::uint64_t, std::pair<const SnapshotRoot *, std::uint32_t> > Largest;
+        auto larger = [](const Largest &a, const Largest &b) { return a.first > b.first; };
+        std::vector<Largest> heap;
+        std::vector<std::uint32_t> stack;
+        for (const auto &[root, dir] : targets)
+        {
+            stack.assign(1, dir);
+            while (!stack.empty())
+            {
+                auto [first, last] = root->children(stack.back());
+                stack.pop_back();
+                for (std::uint32_t child = first; child < last; ++child)
+                {
+                    stack.push_back(child);
+                    if (heap.size() < top || size(*root, child) > heap.front().first)
+                    {
+                        heap.emplace_back(size(*root, child), std::pair(root, child));
+                        std::push_heap(heap.begin(), heap.end(), larger);
+                        if (heap.size() > top)
+                        {
+                            std::pop_heap(heap.begin(), heap.end(), larger);
+                            heap.pop_back();
+                        }
+                    }
+                }
+            }
+        }
+        std::sort_heap(heap.begin(), heap.end(), larger);
+        std::cout << "Largest directories:\n";
+        for (const auto &[bytes, where] : heap)
+        {
+            std::cout << bytes << '\t' << where.first->path(where.second) << '\n';
+        }
+    }
+    return 0;
+}
+
+#ifdef MDU_WATCH
+int run_watch(const CliOptions &options, const std::vector<std::string> &paths)
+{
+    namespace fs = std::filesystem;
+    // Taken by a thread of its own, a handler could not request the stop
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::stop_source stop;
+    std::thread waiter([&signals, &stop]() {
+        int signal = 0;
+        sigwait(&signals, &signal);
+        stop.request_stop();
+    });
+
+    WatchCallbacks callbacks;
+    bool warned = false;
+    callbacks.on_scan = [&options, &warned](const ScanResult &result) {
+        // The errors went to on_error already, only an io_uring that could not be used is left, once
+        if (!warned && (result.ring_error != 0 || result.prefetch_error != 0))
+        {
+            print_errors(result);
+            warned = true;
+        }
+        bool watching = false;
+        for (const RootResult &root : result.roots)
+        {
+            if (root.error == 0)
+            {
+                std::cout << "Path: " << fs::path(root.path) << " Size: " << root.size << '\n';
+                watching = true;
+            }
+        }
+        if (watching && !options.quiet)
+        {
+            std::cout << "Watching, totals in " << fs::path(options.watch.snapshot) << '\n';
+        }
+        std::cout.flush();
+    };
+    callbacks.on_error = [](const ScanError &error) {
+        ScanResult one;
+        one.errors.push_back(error);
+        print_errors(one);
+        if (error.operation == ScanError::Operation::watch_directory && error.code == ENOSPC)
+        {
+            std::cerr << "Directories past fs.inotify.max_user_watches are not kept current\n";
+        }
+    };
+    int code = watch_paths(options.scan, options.watch, paths, callbacks, stop.get_token());
+
+    // Stopped on its own, the waiter still needs its signal
+    if (!stop.stop_requested())
+    {
+        pthread_kill(waiter.native_handle(), SIGTERM);
+    }
+    waiter.join();
+    return code;
+}
+#endif
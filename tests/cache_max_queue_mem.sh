@@ -0,0 +1,34 @@
+#!/bin/sh
+# A directory set aside under --max-queue-mem must not be cached from its
+# first, partial pass. Scans a wide directory twice with the same cache
+# file and checks that the second run reports what the first one did.
+#
+# Usage: cache_max_queue_mem.sh MDU
+set -eu
+
+mdu=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+mkdir "$dir/tree"
+i=0
+while [ $i -lt 3000 ]; do
+    mkdir "$dir/tree/subdirectory_with_a_long_name_to_fill_the_queue_$i"
+    i=$((i + 1))
+done
+i=0
+while [ $i -lt 1000 ]; do
+    head -c 12000 /dev/zero > "$dir/tree/file_$i"
+    i=$((i + 1))
+done
+
+size() {
+    "$mdu" --max-queue-mem 1K --cache "$dir/cache" "$dir/tree" | sed -n 's/.* Size: //p'
+}
+
+first=$(size)
+second=$(size)
+if [ -z "$first" ] || [ "$first" != "$second" ]; then
+    echo "first run: $first, second run with the cache: $second" >&2
+    exit 1
+fi